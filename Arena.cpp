@@ -0,0 +1,87 @@
+//
+// Monotonic bump allocation for scratch data.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include "Arena.h"
+
+void* Arena::allocate(size_t bytes, size_t alignment) {
+    for (;; ++block, offset = 0) {
+        if (block == blocks.size()) {
+            size_t size = std::max(block_size, bytes + alignment);
+            if (!sizes.empty()) size = std::max(size, 2 * sizes.back());
+            blocks.emplace_back(new char[size]);
+            sizes.push_back(size);
+        }
+        auto base = reinterpret_cast<uintptr_t>(blocks[block].get());
+        size_t start = ((base + offset + alignment - 1) & ~(uintptr_t)(alignment - 1)) - base;
+        if (start + bytes <= sizes[block]) {
+            offset = start + bytes;
+            return blocks[block].get() + start;
+        }
+    }
+}
+
+size_t Arena::capacity() const {
+    size_t total = 0;
+    for (size_t s : sizes) total += s;
+    return total;
+}
+
+Arena& thread_arena() {
+    thread_local Arena arena;
+    return arena;
+}
+
+#ifdef TREECL_COUNT_ALLOCATIONS
+/*
+ * Counting replacements for the global allocation functions, so the instrumentation can report how many heap
+ * allocations an iteration makes. Every allocation in the process pays for the shared counter, so they are only
+ * built with TREECL_COUNT_ALLOCATIONS. The nothrow and array forms forward to these.
+ */
+namespace {
+    std::atomic<unsigned long> allocation_count(0);
+}
+
+unsigned long heap_allocations() {
+    return allocation_count.load(std::memory_order_relaxed);
+}
+
+void* operator new(std::size_t size) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    for (;;) {
+        if (void* p = std::malloc(size ? size : 1)) return p;
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) throw std::bad_alloc();
+        handler();
+    }
+}
+
+void* operator new[](std::size_t size) {
+    return ::operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept {
+    std::free(p);
+}
+#else
+unsigned long heap_allocations() {
+    return 0;
+}
+#endif
@@ -0,0 +1,83 @@
+//
+// Monotonic bump allocation for scratch data.
+//
+
+#ifndef TREECL_EM_ARENA_H
+#define TREECL_EM_ARENA_H
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+/*
+ * Hands out memory by bumping an offset through a list of blocks; nothing is freed individually. reset() or
+ * rewind() make the space reusable, and blocks are kept, so once an arena has grown to fit one iteration's scratch
+ * data the following iterations allocate nothing from the heap.
+ */
+class Arena {
+    std::vector<std::unique_ptr<char[]>> blocks;
+    std::vector<size_t> sizes;
+    size_t block = 0;   // Block being bumped
+    size_t offset = 0;  // Bytes used in that block
+    size_t block_size;
+
+public:
+    struct Marker {
+        size_t block;
+        size_t offset;
+    };
+
+    explicit Arena(size_t block_size = 64 * 1024) : block_size(block_size) {}
+    Arena(const Arena& other) = delete;
+    Arena& operator=(const Arena& other) = delete;
+
+    void* allocate(size_t bytes, size_t alignment);
+    Marker mark() const { return Marker{block, offset}; }
+    void rewind(Marker marker) { block = marker.block; offset = marker.offset; }
+    void reset() { block = 0; offset = 0; }
+    size_t capacity() const;
+};
+
+// Scratch arena of the calling thread. Use it through ArenaScope so nested users release in LIFO order.
+Arena& thread_arena();
+
+// Rewinds the arena to where it was when the scope was entered
+class ArenaScope {
+    Arena& arena;
+    Arena::Marker marker;
+
+public:
+    explicit ArenaScope(Arena& arena) : arena(arena), marker(arena.mark()) {}
+    ArenaScope(const ArenaScope& other) = delete;
+    ArenaScope& operator=(const ArenaScope& other) = delete;
+    ~ArenaScope() { arena.rewind(marker); }
+};
+
+template<typename T>
+class ArenaAllocator {
+public:
+    using value_type = T;
+    Arena* arena;
+
+    explicit ArenaAllocator(Arena& arena) : arena(&arena) {}
+    template<typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T))); }
+    void deallocate(T*, size_t) {}
+};
+
+template<typename T, typename U>
+bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) { return a.arena == b.arena; }
+
+template<typename T, typename U>
+bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) { return a.arena != b.arena; }
+
+template<typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+// Number of global operator new calls so far, across all threads (PLL itself allocates with malloc). Always 0 unless
+// built with TREECL_COUNT_ALLOCATIONS.
+unsigned long heap_allocations();
+
+#endif //TREECL_EM_ARENA_H
@@ -0,0 +1,113 @@
+//
+// Many datasets clustered in one process, from a manifest.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <exception>
+#include <fstream>
+#include <future>
+#include <mutex>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+#include "BatchRunner.h"
+#include "Dataset.h"
+#include "MemoryPlanner.h"
+#include "threadpool.h"
+#include "utils.h"
+
+std::vector<ManifestEntry> read_manifest(const std::string& filename) {
+    std::ifstream file(filename);
+    if (!file) throw std::invalid_argument("Can't read manifest " + filename);
+    std::vector<ManifestEntry> entries;
+    std::string line;
+    for (int number = 1; std::getline(file, line); ++number) {
+        std::istringstream stream(line);
+        std::vector<std::string> fields;
+        for (std::string field; stream >> field;) fields.push_back(field);
+        if (fields.empty() || fields[0][0] == '#') continue;
+        std::string where = "Manifest line " + std::to_string(number) + ": ";
+        if (fields.size() < 3 || fields.size() > 5) {
+            throw std::invalid_argument(where + "expected alignment, partitions, K and optionally schedule and seed");
+        }
+
+        ManifestEntry entry;
+        entry.alignment = fields[0];
+        entry.partitions = fields[1];
+        entry.line = number;
+        try {
+            long groups = std::stol(fields[2]);
+            if (groups < 1) throw std::invalid_argument("K must be at least 1");
+            entry.groups = static_cast<unsigned>(groups);
+            if (fields.size() > 3) entry.schedule = parse_schedule(fields[3]);
+            if (fields.size() > 4) entry.seed = static_cast<unsigned>(std::stoul(fields[4]));
+        }
+        catch (const std::exception& e) {
+            throw std::invalid_argument(where + e.what());
+        }
+        entries.push_back(entry);
+    }
+    return entries;
+}
+
+BatchResult BatchRunner::run_job(size_t job, const ManifestEntry& entry, MemoryGate* gate) {
+    auto start = std::chrono::steady_clock::now();
+    BatchResult result{job, entry, RunResult(), {}, 0, ""};
+    try {
+        auto dataset = std::make_shared<const Dataset>(entry.alignment, utils::readlines(entry.partitions));
+        if (entry.groups > dataset->size()) throw std::invalid_argument("More groups than loci");
+
+        // Barrier execution builds one group instance at a time, none larger than one over every locus
+        std::vector<int> loci(dataset->size());
+        std::iota(loci.begin(), loci.end(), 0);
+        size_t bytes = gate ? clv_bytes(dataset->locus_shapes(), loci, InstanceMode::FULL, 0) : 0;
+        MemoryGate::Reservation reservation(gate, bytes);
+
+        auto job_attr = std::make_shared<pllInstanceAttr>(*attr);
+        if (entry.seed) job_attr->randomNumberSeed = static_cast<int>(entry.seed);
+        Optimiser o(dataset, job_attr);
+        if (entry.seed) o.set_seed(entry.seed);
+        o.set_schedule(entry.schedule);
+        o.set_cache(cache);
+        // A child of the batch's budget, so cancelling the batch reaches jobs already running
+        BudgetSPtr job_budget = policy.job_seconds > 0 ? std::make_shared<Budget>(policy.job_seconds, budget)
+                                                        : std::make_shared<Budget>(budget);
+        o.set_budget(job_budget);
+        result.run = o.run_restarts(policy.restarts, entry.groups, policy.max_iterations);
+        result.assignment = o.get_assignment();
+    }
+    catch (const std::exception& e) {
+        result.error = e.what();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    result.seconds = elapsed.count();
+    return result;
+}
+
+size_t BatchRunner::run(const std::vector<ManifestEntry>& jobs, const Sink& sink) {
+    std::unique_ptr<MemoryGate> gate;
+    if (policy.memory_bytes) gate = std::make_unique<MemoryGate>(policy.memory_bytes);
+    std::mutex mut;
+    size_t failed = 0;
+    auto report = [&](const BatchResult& result) {
+        std::lock_guard<std::mutex> lock(mut);
+        if (!result.error.empty()) ++failed;
+        sink(result);
+    };
+
+    work_stealing_thread_pool pool(std::max(1u, policy.threads));
+    std::vector<std::future<void>> tasks;
+    for (size_t job = 0; job < jobs.size(); ++job) {
+        tasks.push_back(pool.submit([&, job]() {
+            if (budget->expired()) {
+                report(BatchResult{job, jobs[job], RunResult(), {}, 0, "Batch budget expired before the job began"});
+                return;
+            }
+            report(run_job(job, jobs[job], gate.get()));
+        }));
+    }
+    for (auto& task : tasks) task.get();
+    return failed;
+}
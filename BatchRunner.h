@@ -0,0 +1,72 @@
+//
+// Many datasets clustered in one process, from a manifest.
+//
+
+#ifndef TREECL_EM_BATCHRUNNER_H
+#define TREECL_EM_BATCHRUNNER_H
+
+#include <functional>
+#include <string>
+#include <vector>
+#include "Budget.h"
+#include "memory_management.h"
+#include "Optimiser.h"
+#include "ResultCache.h"
+
+// One manifest line: "alignment partitions K [schedule [seed]]", whitespace separated. Paths are used as given.
+struct ManifestEntry {
+    std::string alignment;
+    std::string partitions;     // File of partition lines
+    unsigned groups;
+    Schedule schedule = Schedule::NO_SEARCH;
+    unsigned seed = 0;          // 0 for a random seed
+    int line = 0;               // In the manifest, for messages
+};
+
+// Blank lines and lines starting with '#' are skipped; a malformed line throws, naming its line number
+std::vector<ManifestEntry> read_manifest(const std::string& filename);
+
+struct BatchPolicy {
+    unsigned threads = 1;       // Jobs running at once, one per pool thread
+    size_t memory_bytes = 0;    // Shared by the running jobs' PLL instances; 0 for no limit
+    int max_iterations = 20;
+    int restarts = 1;
+    double job_seconds = 0;     // Time limit of each job; 0 for none
+};
+
+struct BatchResult {
+    size_t job;                 // Index into the manifest entries
+    ManifestEntry entry;
+    RunResult run;
+    std::vector<int> assignment;
+    double seconds;
+    std::string error;          // Empty if the job succeeded
+};
+
+/*
+ * Jobs run on one work-stealing pool for the whole batch, so no job pays for thread creation, and each job is a
+ * single-threaded Optimiser in barrier execution: small datasets gain more from running side by side than from
+ * being split. Before it starts optimising, a job reserves the estimated size of its largest PLL instance from a
+ * gate shared by the batch, which holds it back while the running jobs would exceed the memory budget. Results go
+ * to the sink as jobs finish, one call at a time; a failing job is reported there and doesn't stop the batch.
+ */
+class BatchRunner {
+    attrSPtr attr;
+    BatchPolicy policy;
+    BudgetSPtr budget = std::make_shared<Budget>();
+    std::shared_ptr<ResultCache> cache;
+
+    BatchResult run_job(size_t job, const ManifestEntry& entry, MemoryGate* gate);
+
+public:
+    using Sink = std::function<void(const BatchResult&)>;
+
+    BatchRunner(attrSPtr attr, BatchPolicy policy) : attr(attr), policy(policy) {};
+    void set_budget(BudgetSPtr budget) { this->budget = budget; };  // Of the whole batch; unstarted jobs are skipped
+    void set_cache(std::shared_ptr<ResultCache> cache) { this->cache = cache; };  // Shared by every job
+
+    // Returns the number of jobs that failed or were skipped
+    size_t run(const std::vector<ManifestEntry>& jobs, const Sink& sink);
+};
+
+#endif //TREECL_EM_BATCHRUNNER_H
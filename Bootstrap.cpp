@@ -0,0 +1,91 @@
+//
+// Bootstrap support for the assignment of loci to groups.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <future>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include "Bootstrap.h"
+#include "threadpool.h"
+
+CoAssignment::CoAssignment(unsigned nloci) :
+        n(nloci), counts(nloci > 1 ? static_cast<size_t>(nloci) * (nloci - 1) / 2 : 0, 0) {}
+
+void CoAssignment::add(const std::vector<int>& assignment) {
+    if (assignment.size() != n) throw std::invalid_argument("Assignment has the wrong number of loci");
+    for (unsigned i = 0; i < n; ++i) {
+        uint32_t* row = counts.data() + pair(i, i + 1);
+        for (unsigned j = i + 1; j < n; ++j) row[j - i - 1] += (assignment[i] == assignment[j]);
+    }
+    ++replicates;
+}
+
+double CoAssignment::frequency(unsigned i, unsigned j) const {
+    if (i == j) return 1;
+    if (replicates == 0) return 0;
+    if (i > j) std::swap(i, j);
+    return static_cast<double>(counts[pair(i, j)]) / replicates;
+}
+
+std::vector<double> CoAssignment::support(const std::vector<int>& assignment) const {
+    if (assignment.size() != n) throw std::invalid_argument("Assignment has the wrong number of loci");
+    std::vector<double> result(n, 0);
+    std::vector<unsigned> partners(n, 0);
+    for (unsigned i = 0; i < n; ++i) {
+        for (unsigned j = i + 1; j < n; ++j) {
+            if (assignment[i] != assignment[j]) continue;
+            double f = frequency(i, j);
+            result[i] += f;
+            result[j] += f;
+            ++partners[i];
+            ++partners[j];
+        }
+    }
+    for (unsigned i = 0; i < n; ++i) result[i] = partners[i] ? result[i] / partners[i] : 1;
+    return result;
+}
+
+CoAssignment Bootstrap::run(const EMState& point) {
+    if (point.assignment.size() != dataset->size()) {
+        throw std::invalid_argument("Point estimate has the wrong number of loci");
+    }
+    // Seeds are drawn up front, so a given seed gives the same replicates whatever order they run in
+    std::mt19937 seeder(policy.seed ? policy.seed : std::random_device()());
+    std::vector<unsigned> seeds(std::max(0, policy.replicates));
+    for (auto& seed : seeds) seed = seeder();
+
+    CoAssignment coassignment(dataset->size());
+    std::mutex mut;
+    std::exception_ptr error;
+    std::atomic_bool failed(false);  // Stops replicates not yet started
+    work_stealing_thread_pool pool(std::max(1u, policy.threads));
+    std::vector<std::future<void>> replicates;
+    for (unsigned seed : seeds) {
+        replicates.push_back(pool.submit([&, seed]() {
+            if (failed || budget->expired()) return;
+            try {
+                std::mt19937 engine(seed);
+                Optimiser o(dataset->resample(engine), attr);
+                o.set_budget(budget);
+                o.set_schedule(policy.schedule);
+                o.warm_start(point);
+                RunResult result = o.run(policy.max_iterations);
+                if (result.out_of_budget) return;
+                std::lock_guard<std::mutex> lock(mut);
+                coassignment.add(o.get_assignment());
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lock(mut);
+                if (!error) error = std::current_exception();
+                failed = true;
+            }
+        }));
+    }
+    for (auto& replicate : replicates) replicate.get();
+    if (error) std::rethrow_exception(error);
+    return coassignment;
+}
@@ -0,0 +1,67 @@
+//
+// Bootstrap support for the assignment of loci to groups.
+//
+
+#ifndef TREECL_EM_BOOTSTRAP_H
+#define TREECL_EM_BOOTSTRAP_H
+
+#include <cstdint>
+#include <vector>
+#include "Budget.h"
+#include "Dataset.h"
+#include "Optimiser.h"
+
+struct BootstrapPolicy {
+    int replicates = 100;
+    unsigned threads = 1;                       // Replicates fitted at once, one per pool thread
+    int max_iterations = 20;
+    Schedule schedule = Schedule::NO_SEARCH;    // Of every replicate, which starts from the point estimate's trees
+    unsigned seed = 0;                          // 0 draws one from std::random_device
+};
+
+/*
+ * How often each pair of loci was assigned to the same group, over the replicates added so far. Only the strict
+ * upper triangle is stored, as 32-bit counts: a few hundred replicates of a few thousand loci take tens of MB.
+ */
+class CoAssignment {
+    unsigned n;
+    std::vector<uint32_t> counts;
+    int replicates = 0;
+
+    size_t pair(unsigned i, unsigned j) const {
+        return static_cast<size_t>(i) * (2 * static_cast<size_t>(n) - i - 1) / 2 + (j - i - 1);
+    }
+
+public:
+    explicit CoAssignment(unsigned nloci);
+    unsigned size() const { return n; }
+    int nreplicates() const { return replicates; }
+
+    void add(const std::vector<int>& assignment);
+    double frequency(unsigned i, unsigned j) const;
+    // Per locus, its mean co-assignment frequency with the other loci of its group in assignment; 1 if it is alone
+    std::vector<double> support(const std::vector<int>& assignment) const;
+};
+
+/*
+ * Non-parametric bootstrap of a clustering. Each replicate resamples the sites of every locus as weights on a copy
+ * of the alignment (Dataset::resample), sharing the parsed partitions, then runs EM from the point estimate's
+ * assignment, trees and parameters. Replicates run on a work-stealing pool, one Optimiser each in barrier
+ * execution, and are counted into the co-assignment matrix as they finish. Replicates the budget cut short are not
+ * counted.
+ */
+class Bootstrap {
+    DatasetSPtr dataset;
+    attrSPtr attr;
+    BootstrapPolicy policy;
+    BudgetSPtr budget = std::make_shared<Budget>();
+
+public:
+    Bootstrap(DatasetSPtr dataset, attrSPtr attr, BootstrapPolicy policy) :
+        dataset(dataset), attr(attr), policy(policy) {};
+    void set_budget(BudgetSPtr budget) { this->budget = budget; };
+
+    CoAssignment run(const EMState& point);
+};
+
+#endif //TREECL_EM_BOOTSTRAP_H
@@ -0,0 +1,69 @@
+//
+// Wall-clock budget and cancellation token.
+//
+
+#ifndef TREECL_EM_BUDGET_H
+#define TREECL_EM_BUDGET_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <memory>
+
+/*
+ * Shared between the Optimiser, its pool tasks and the PLL wrappers. Work checks expired() at points where it can
+ * stop cleanly (between iterations, restarts, group optimisations, optimiser blocks and E-step cells); PLL's own
+ * routines can't be interrupted, so expensive calls use can_afford() to decide whether to start at all.
+ */
+class Budget {
+    using clock = std::chrono::steady_clock;
+    clock::time_point start;
+    clock::time_point deadline;
+    bool bounded;
+    std::atomic_bool cancelled;
+    std::shared_ptr<const Budget> parent;
+
+public:
+    // Unbounded: only expires if cancelled
+    Budget() : start(clock::now()), deadline(start), bounded(false), cancelled(false) {}
+
+    explicit Budget(double seconds) : start(clock::now()), bounded(true), cancelled(false) {
+        deadline = start + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(seconds));
+    }
+
+    // Child: expires with its parent, and can also be cancelled on its own or given a shorter deadline
+    explicit Budget(std::shared_ptr<const Budget> parent) : Budget() { this->parent = std::move(parent); }
+    Budget(double seconds, std::shared_ptr<const Budget> parent) : Budget(seconds) { this->parent = std::move(parent); }
+
+    Budget(const Budget& other) = delete;
+    Budget& operator=(const Budget& other) = delete;
+
+    void cancel() { cancelled = true; }
+
+    bool is_cancelled() const { return cancelled || (parent && parent->is_cancelled()); }
+
+    bool expired() const {
+        return cancelled || (bounded && clock::now() >= deadline) || (parent && parent->expired());
+    }
+
+    // Seconds left before the deadline (or the parent's, if sooner); negative once it has passed, infinite if unbounded
+    double remaining() const {
+        double own = bounded ? std::chrono::duration<double>(deadline - clock::now()).count()
+                             : std::numeric_limits<double>::infinity();
+        return parent ? std::min(own, parent->remaining()) : own;
+    }
+
+    double elapsed() const {
+        return std::chrono::duration<double>(clock::now() - start).count();
+    }
+
+    // True if a task expected to take this many seconds would finish before the deadline
+    bool can_afford(double seconds) const {
+        return !is_cancelled() && seconds <= remaining();
+    }
+};
+
+using BudgetSPtr = std::shared_ptr<Budget>;
+
+#endif //TREECL_EM_BUDGET_H
@@ -0,0 +1,79 @@
+//
+// Alignment and partitions parsed once, shared by every Optimiser working on them.
+//
+
+#include <cstring>
+#include "Dataset.h"
+#include "utils.h"
+
+Dataset::Dataset(const std::string& alignment, const std::vector<std::string>& partitions) :
+        table(std::make_shared<const PartitionTable>(partitions)), source(utils::parse_alignment_file(alignment)),
+        labels(alignment_labels(source.get())), index(taxon_index(labels)) {}
+
+Dataset::Dataset(const Dataset& base, const std::vector<int>& site_weights) :
+        table(base.table), source(utils::copy_alignment(base.alignment())), labels(base.labels), index(base.index) {
+    std::memcpy(source->siteWeights, site_weights.data(), site_weights.size() * sizeof(int));
+}
+
+long Dataset::sites() const {
+    long total = 0;
+    for (size_t i = 0; i < table->size(); ++i) total += (*table)[i].sites();
+    return total;
+}
+
+std::shared_ptr<const Dataset> Dataset::resample(std::mt19937& engine) const {
+    std::vector<int> weights(source->sequenceLength, 0);
+    std::vector<int> sites;
+    for (size_t i = 0; i < table->size(); ++i) {
+        sites.clear();
+        for (const auto& region : (*table)[i].regions) {
+            int stride = region.stride > 0 ? region.stride : 1;
+            for (int s = region.start; s <= region.end; s += stride) sites.push_back(s - 1);
+        }
+        if (sites.empty()) continue;
+        std::uniform_int_distribution<size_t> pick(0, sites.size() - 1);
+        for (size_t draw = 0; draw < sites.size(); ++draw) ++weights[sites[pick(engine)]];
+    }
+    return std::shared_ptr<const Dataset>(new Dataset(*this, weights));
+}
+
+const std::vector<std::shared_ptr<const LocusData>>& Dataset::locus_data() const {
+    std::call_once(data_once, [this]() {
+        for (size_t i = 0; i < table->size(); ++i) {
+            data.push_back(std::make_shared<const LocusData>(source.get(), (*table)[i]));
+        }
+    });
+    return data;
+}
+
+const std::vector<LocusShape>& Dataset::locus_shapes() const {
+    std::call_once(shapes_once, [this]() {
+        for (size_t i = 0; i < table->size(); ++i) shapes.push_back(locus_shape(source.get(), (*table)[i]));
+    });
+    return shapes;
+}
+
+const DistanceTable& Dataset::locus_distances(work_stealing_thread_pool& pool) const {
+    std::call_once(distances_once, [this, &pool]() { distances = ::locus_distances(locus_data(), pool); });
+    return distances;
+}
+
+const std::vector<ContentHash>& Dataset::locus_hashes() const {
+    std::call_once(hashes_once, [this]() {
+        for (size_t i = 0; i < table->size(); ++i) {
+            const PartitionSpec& spec = (*table)[i];
+            ContentHash hash;
+            hash.add(spec.data_type).add(spec.model);
+            for (const auto& label : labels) hash.add(label);
+            for (const auto& region : spec.regions) {
+                int stride = region.stride > 0 ? region.stride : 1;
+                for (int s = region.start; s <= region.end; s += stride) {
+                    hash.add(source->siteWeights[s - 1]);
+                    for (int t = 1; t <= source->sequenceCount; ++t) hash.add(source->sequenceData[t][s - 1]);
+                }
+            }
+            hashes.push_back(hash);
+        }
+    });
+    return hashes;
+}
@@ -0,0 +1,71 @@
+//
+// Alignment and partitions parsed once, shared by every Optimiser working on them.
+//
+
+#ifndef TREECL_EM_DATASET_H
+#define TREECL_EM_DATASET_H
+
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+#include "memory_management.h"
+#include "MemoryPlanner.h"
+#include "NativeLikelihood.h"
+#include "PartitionTable.h"
+#include "ResultCache.h"
+#include "Seeding.h"
+#include "threadpool.h"
+
+/*
+ * Read-only after construction, apart from the derived per-locus data, which is built once on first use under
+ * call_once. Safe to share between Optimisers running on different threads. Sites count as many times as their
+ * weight in the source alignment, both in PLL instances and in the native scorer's patterns.
+ */
+class Dataset {
+    std::shared_ptr<const PartitionTable> table;
+    alignmentUPtr source;   // Never loaded into PLL; instances get copies
+    std::vector<std::string> labels;
+    TaxonIndex index;
+    mutable std::once_flag data_once;
+    mutable std::vector<std::shared_ptr<const LocusData>> data;
+    mutable std::once_flag shapes_once;
+    mutable std::vector<LocusShape> shapes;
+    mutable std::once_flag distances_once;
+    mutable DistanceTable distances;
+    mutable std::once_flag hashes_once;
+    mutable std::vector<ContentHash> hashes;
+
+    Dataset(const Dataset& base, const std::vector<int>& site_weights);
+
+public:
+    Dataset(const std::string& alignment, const std::vector<std::string>& partitions);
+    Dataset(const Dataset& other) = delete;
+    Dataset& operator=(const Dataset& other) = delete;
+
+    size_t size() const { return table->size(); }
+    const PartitionTable& partitions() const { return *table; }
+    const pllAlignmentData* alignment() const { return source.get(); }
+    const TaxonIndex& taxa() const { return index; }
+    const std::vector<std::string>& taxon_labels() const { return labels; }
+    int ntaxa() const { return source->sequenceCount; }
+    long sites() const;
+
+    // Bootstrap replicate: the sites of each locus resampled with replacement, as site weights on a copy of the
+    // alignment. The partitions are shared with this dataset.
+    std::shared_ptr<const Dataset> resample(std::mt19937& engine) const;
+
+    // Site patterns of every locus, for the native scorer
+    const std::vector<std::shared_ptr<const LocusData>>& locus_data() const;
+    // Footprint inputs of every locus, for the memory planner
+    const std::vector<LocusShape>& locus_shapes() const;
+    // Taxon distance matrix of every locus, for seeding; computed on pool by the first caller
+    const DistanceTable& locus_distances(work_stealing_thread_pool& pool) const;
+    // Hash of every locus's partition definition, taxon labels and weighted columns, for result cache keys
+    const std::vector<ContentHash>& locus_hashes() const;
+};
+
+using DatasetSPtr = std::shared_ptr<const Dataset>;
+
+#endif //TREECL_EM_DATASET_H
@@ -0,0 +1,175 @@
+//
+// Memory footprint estimates for PLL instances, and admission control under a global budget.
+//
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <fstream>
+#include <string>
+#include <unordered_set>
+#include "MemoryPlanner.h"
+#include "SubstitutionModel.h"
+
+const char* instance_mode_name(InstanceMode mode) {
+    switch (mode) {
+        case InstanceMode::FULL: return "full";
+        case InstanceMode::SAVE_MEMORY: return "saveMemory";
+        case InstanceMode::RECOMPUTE: return "useRecom";
+        case InstanceMode::SAVE_RECOMPUTE: return "saveMemory+useRecom";
+    }
+    return "";
+}
+
+void apply_mode(InstanceMode mode, pllInstanceAttr& attr) {
+    attr.saveMemory = (mode == InstanceMode::SAVE_MEMORY || mode == InstanceMode::SAVE_RECOMPUTE) ? PLL_TRUE : PLL_FALSE;
+    attr.useRecom = (mode == InstanceMode::RECOMPUTE || mode == InstanceMode::SAVE_RECOMPUTE) ? PLL_TRUE : PLL_FALSE;
+}
+
+LocusShape locus_shape(const pllAlignmentData* alignment, const PartitionSpec& partition) {
+    LocusShape shape;
+    shape.ntaxa = alignment->sequenceCount;
+    shape.states = partition.states;
+    bool protein = (partition.data_type == PLL_AA_DATA);
+    auto undetermined = [protein](char c) {
+        c = static_cast<char>(std::toupper(c));
+        return c == '-' || c == '?' || c == 'X' || (!protein && (c == 'N' || c == 'O'));
+    };
+
+    std::unordered_set<std::string> patterns;
+    std::string column(shape.ntaxa, '\0');
+    long entries = 0, gaps = 0;
+    for (const auto& region : partition.regions) {
+        int stride = region.stride > 0 ? region.stride : 1;
+        for (int s = region.start; s <= region.end; s += stride) {
+            for (int t = 0; t < shape.ntaxa; ++t) {
+                column[t] = static_cast<char>(alignment->sequenceData[t + 1][s - 1]);
+                gaps += undetermined(column[t]);
+            }
+            entries += shape.ntaxa;
+            patterns.insert(column);
+        }
+    }
+    shape.npatterns = static_cast<int>(patterns.size());
+    shape.gap_fraction = entries ? static_cast<double>(gaps) / entries : 0;
+    return shape;
+}
+
+/*
+ * PLL holds one vector of patterns x states x categories doubles, plus a scaling count per pattern, for each of the
+ * ntaxa - 2 inner nodes; tips use lookup tables and are ignored. saveMemory drops the columns of subtrees that are
+ * all gaps, approximated here by the share of gaps at the tips. useRecom keeps recom_fraction of the inner vectors,
+ * but never fewer than PLL's minimum of 3 + log2(ntaxa).
+ */
+size_t clv_bytes(const std::vector<LocusShape>& shapes, const std::vector<int>& loci, InstanceMode mode,
+                 double recom_fraction) {
+    if (loci.empty()) return 0;
+    bool save = (mode == InstanceMode::SAVE_MEMORY || mode == InstanceMode::SAVE_RECOMPUTE);
+    bool recompute = (mode == InstanceMode::RECOMPUTE || mode == InstanceMode::SAVE_RECOMPUTE);
+
+    double per_vector = 0;
+    int ntaxa = 0;
+    for (int i : loci) {
+        const LocusShape& shape = shapes[i];
+        double values = static_cast<double>(shape.npatterns) * shape.states * GAMMA_CATEGORIES;
+        if (save) values *= 1 - shape.gap_fraction;
+        per_vector += values * sizeof(double) + static_cast<double>(shape.npatterns) * sizeof(int);
+        ntaxa = std::max(ntaxa, shape.ntaxa);
+    }
+
+    int inner = std::max(ntaxa - 2, 1);
+    int vectors = inner;
+    if (recompute) {
+        int minimum = 3 + static_cast<int>(std::log2(std::max(ntaxa, 2)));
+        vectors = std::min(inner, std::max(minimum, static_cast<int>(std::ceil(recom_fraction * inner))));
+    }
+    return static_cast<size_t>(per_vector * vectors);
+}
+
+MemoryPlan plan_instances(const std::vector<std::array<size_t, 4>>& footprints, size_t budget,
+                          unsigned max_concurrency) {
+    MemoryPlan plan;
+    size_t n = footprints.size();
+    plan.modes.assign(n, InstanceMode::FULL);
+    plan.bytes.assign(n, 0);
+    if (n == 0) return plan;
+    max_concurrency = std::max(1u, std::min(max_concurrency, static_cast<unsigned>(n)));
+
+    for (unsigned c = max_concurrency; c >= 1; --c) {
+        size_t allowance = budget / c;
+        bool fits = true;
+        for (size_t k = 0; k < n && fits; ++k) {
+            fits = false;
+            for (int m = 0; m < 4; ++m) {
+                if (footprints[k][m] <= allowance) {
+                    plan.modes[k] = static_cast<InstanceMode>(m);
+                    plan.bytes[k] = footprints[k][m];
+                    fits = true;
+                    break;
+                }
+            }
+        }
+        if (fits) {
+            plan.concurrency = c;
+            return plan;
+        }
+    }
+
+    plan.concurrency = 1;
+    plan.over_budget = true;
+    for (size_t k = 0; k < n; ++k) {
+        auto smallest = std::min_element(footprints[k].begin(), footprints[k].end());
+        plan.modes[k] = static_cast<InstanceMode>(smallest - footprints[k].begin());
+        plan.bytes[k] = *smallest;
+    }
+    return plan;
+}
+
+void MemoryGate::acquire(size_t bytes) {
+    std::unique_lock<std::mutex> lock(mut);
+    cv.wait(lock, [&]() { return used == 0 || used + bytes <= budget; });
+    used += bytes;
+    peak = std::max(peak, used);
+}
+
+void MemoryGate::release(size_t bytes) {
+    {
+        std::lock_guard<std::mutex> lock(mut);
+        used -= bytes;
+    }
+    cv.notify_all();
+}
+
+size_t MemoryGate::peak_reserved() {
+    std::lock_guard<std::mutex> lock(mut);
+    return peak;
+}
+
+namespace {
+    // Value of a "Field:   1234 kB" line of /proc/self/status, in bytes
+    size_t status_bytes(const std::string& field) {
+        std::ifstream status("/proc/self/status");
+        std::string line;
+        while (std::getline(status, line)) {
+            if (line.compare(0, field.size(), field) == 0 && line.size() > field.size() && line[field.size()] == ':') {
+                return std::stoul(line.substr(field.size() + 1)) * 1024;
+            }
+        }
+        return 0;
+    }
+}
+
+size_t resident_bytes() {
+    return status_bytes("VmRSS");
+}
+
+size_t peak_resident_bytes() {
+    return status_bytes("VmHWM");
+}
+
+bool reset_peak_resident() {
+    std::ofstream clear_refs("/proc/self/clear_refs");
+    if (!clear_refs) return false;
+    clear_refs << "5" << std::endl;
+    return static_cast<bool>(clear_refs);
+}
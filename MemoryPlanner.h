@@ -0,0 +1,96 @@
+//
+// Memory footprint estimates for PLL instances, and admission control under a global budget.
+//
+
+#ifndef TREECL_EM_MEMORYPLANNER_H
+#define TREECL_EM_MEMORYPLANNER_H
+
+#include <array>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+#include "memory_management.h"
+#include "PartitionTable.h"
+
+enum class InstanceMode {
+    FULL,           // Every inner likelihood vector held in full
+    SAVE_MEMORY,    // PLL saveMemory: no storage for all-gap subtree columns
+    RECOMPUTE,      // PLL useRecom: a fraction of the inner vectors, recomputed on demand
+    SAVE_RECOMPUTE, // Both
+}; // Ordered from fastest to most frugal
+
+const char* instance_mode_name(InstanceMode mode);
+void apply_mode(InstanceMode mode, pllInstanceAttr& attr);
+
+// What the likelihood vector estimate needs to know about one locus
+struct LocusShape {
+    int ntaxa = 0;
+    int npatterns = 0;
+    int states = 0;
+    double gap_fraction = 0;    // Share of tip entries that are completely undetermined
+};
+
+LocusShape locus_shape(const pllAlignmentData* alignment, const PartitionSpec& partition);
+
+// Estimated bytes of the inner likelihood vectors and scaling counts of a PLL instance over the given loci
+size_t clv_bytes(const std::vector<LocusShape>& shapes, const std::vector<int>& loci, InstanceMode mode,
+                 double recom_fraction);
+
+struct MemoryPolicy {
+    size_t budget_bytes = 0;        // Shared by all concurrently live instances; 0 leaves every instance FULL
+    double recom_fraction = 0.1;    // Share of inner vectors a recomputing instance keeps (PLL's default)
+    bool report_rss = false;        // Record the peak resident set size of every phase
+};
+
+struct MemoryPlan {
+    std::vector<InstanceMode> modes;
+    std::vector<size_t> bytes;      // Estimate in the chosen mode
+    unsigned concurrency = 0;       // Instances guaranteed to fit the budget together
+    bool over_budget = false;       // Some instance exceeds the budget even in its most frugal mode
+};
+
+/*
+ * Picks the highest concurrency c (up to max_concurrency) at which every instance fits into budget / c in some mode,
+ * giving each instance the fastest mode that does. footprints[k][m] is instance k's estimate in mode m. If not even
+ * one instance at a time fits, every instance gets its smallest mode and the plan is flagged over budget.
+ */
+MemoryPlan plan_instances(const std::vector<std::array<size_t, 4>>& footprints, size_t budget,
+                          unsigned max_concurrency);
+
+/*
+ * Counting semaphore over bytes. An instance reserves its estimate before it is built and releases it when it is
+ * destroyed, so the instances alive at once never exceed the budget. A reservation larger than the whole budget is
+ * admitted when nothing else is reserved, rather than never.
+ */
+class MemoryGate {
+    std::mutex mut;
+    std::condition_variable cv;
+    size_t budget;
+    size_t used = 0;
+    size_t peak = 0;
+
+public:
+    explicit MemoryGate(size_t budget) : budget(budget) {}
+    void acquire(size_t bytes);
+    void release(size_t bytes);
+    size_t peak_reserved();
+
+    class Reservation {
+        MemoryGate* gate;
+        size_t bytes;
+    public:
+        Reservation(MemoryGate* gate, size_t bytes) : gate(gate), bytes(bytes) { if (gate) gate->acquire(bytes); }
+        Reservation(const Reservation& other) = delete;
+        Reservation& operator=(const Reservation& other) = delete;
+        ~Reservation() { if (gate) gate->release(bytes); }
+    };
+};
+
+// Resident set size of this process in bytes, from /proc/self/status; 0 where unavailable
+size_t resident_bytes();
+size_t peak_resident_bytes();
+// Restart the peak (VmHWM) from the current resident size. Returns false if the kernel doesn't allow it.
+bool reset_peak_resident();
+
+#endif //TREECL_EM_MEMORYPLANNER_H
@@ -0,0 +1,145 @@
+//
+// Choice of the number of groups by information criterion.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include "ModelSelection.h"
+
+// Fitted once, by a throwaway Optimiser using every thread. False if the budget ran out before every locus was.
+bool ModelSelector::fit_loci() {
+    if (!have_fits) {
+        Optimiser o(dataset, attr);
+        o.set_budget(budget);
+        o.set_execution(Execution::PIPELINED, std::max(1u, policy.threads));
+        if (!o.fit_loci(policy.locus_schedule)) return false;
+        fits = o.get_parameter_store();
+        have_fits = true;
+    }
+    return true;
+}
+
+const ParameterStore& ModelSelector::locus_fits() {
+    if (!fit_loci()) throw std::runtime_error("Budget expired before every locus was fitted");
+    return fits;
+}
+
+namespace {
+    // Free parameters of one locus's substitution model and gamma shape. DNA and GTR protein models estimate their
+    // exchangeabilities; the empirical protein matrices (LG, WAG, ...) fix them, and the frequencies too unless the
+    // model name ends in F.
+    long model_parameters(const PartitionSpec& spec) {
+        const std::string& model = spec.model;
+        bool estimated = spec.data_type == PLL_DNA_DATA || model.compare(0, 3, "GTR") == 0;
+        long rates = estimated ? static_cast<long>(ParameterStore::rates_size(spec.states)) - 1 : 0;
+        long freqs = (estimated || (!model.empty() && model.back() == 'F')) ? spec.states - 1 : 0;
+        return rates + freqs + 1;
+    }
+}
+
+long ModelSelector::free_parameters(unsigned groups) const {
+    long count = 0;
+    const PartitionTable& partitions = dataset->partitions();
+    for (size_t i = 0; i < partitions.size(); ++i) count += model_parameters(partitions[i]);
+    count += static_cast<long>(groups) * (2 * dataset->ntaxa() - 3);
+    count += groups - 1;
+    return count;
+}
+
+double ModelSelector::criterion(const SelectionResult& result) const {
+    return policy.criterion == Criterion::BIC ? result.bic : result.aic;
+}
+
+std::vector<SelectionResult> ModelSelector::run() {
+    if (!fit_loci()) return {};     // Unfitted loci would start every K from all-zero parameters
+    const ParameterStore& start = fits;
+    unsigned kmax = std::min<unsigned>(policy.max_groups, dataset->size());
+    unsigned concurrency = std::max(1u, std::min(policy.concurrency, kmax));
+    unsigned threads_per_run = std::max(1u, policy.threads / concurrency);
+    double sample_size = static_cast<double>(dataset->sites());
+
+    std::mutex mut;
+    std::map<unsigned, SelectionResult> completed;
+    std::map<unsigned, BudgetSPtr> running;
+    std::atomic<unsigned> next(1);
+    std::atomic<unsigned> stop_after(kmax);    // No K beyond this is started
+    std::exception_ptr error;
+
+    // Walk the completed K in order from 1, stopping the scan at the first run of patience worsening steps. A run the
+    // deadline cut short isn't a fair comparison, so the walk stops there.
+    auto finished = [&](unsigned k) { return completed.count(k) && !completed.at(k).run.out_of_budget; };
+    auto update_stop = [&]() {
+        unsigned streak = 0;
+        for (unsigned k = 2; finished(k) && finished(k - 1); ++k) {
+            streak = (criterion(completed[k]) > criterion(completed[k - 1])) ? streak + 1 : 0;
+            if (streak >= policy.patience && k < stop_after) {
+                stop_after = k;
+                for (auto& r : running) {
+                    if (r.first > k) r.second->cancel();
+                }
+                break;
+            }
+        }
+    };
+
+    auto worker = [&]() {
+        for (;;) {
+            unsigned k = next++;
+            if (k > stop_after || budget->expired()) return;
+            auto run_budget = std::make_shared<Budget>(budget);   // Cancelled on its own if the scan stops early
+            {
+                std::lock_guard<std::mutex> lock(mut);
+                running[k] = run_budget;
+            }
+            try {
+                Optimiser o(dataset, attr);
+                o.set_budget(run_budget);
+                o.set_execution(Execution::PIPELINED, threads_per_run);
+                o.set_schedule(policy.schedule);
+                o.set_seeding(policy.seeding);
+                o.set_parameters(start);
+                RunResult result = o.run_restarts(policy.restarts, k, policy.max_iterations);
+
+                SelectionResult selection{k, result, o.get_assignment(), o.get_trees(), o.get_likelihood(),
+                                          free_parameters(k), 0, 0};
+                selection.bic = -2 * selection.likelihood + selection.parameters * std::log(sample_size);
+                selection.aic = -2 * selection.likelihood + 2.0 * selection.parameters;
+
+                std::lock_guard<std::mutex> lock(mut);
+                running.erase(k);
+                if (!run_budget->is_cancelled()) {
+                    completed.emplace(k, std::move(selection));
+                    update_stop();
+                }
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lock(mut);
+                running.erase(k);
+                if (!error) error = std::current_exception();
+                stop_after = 0;
+                return;
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned w = 0; w < concurrency; ++w) workers.emplace_back(worker);
+    for (auto& w : workers) w.join();
+    if (error) std::rethrow_exception(error);
+
+    std::vector<SelectionResult> results;
+    for (auto& c : completed) {
+        if (c.first <= stop_after) results.push_back(std::move(c.second));
+    }
+    std::stable_sort(results.begin(), results.end(), [this](const SelectionResult& a, const SelectionResult& b) {
+        if (a.run.out_of_budget != b.run.out_of_budget) return b.run.out_of_budget;
+        return criterion(a) < criterion(b);
+    });
+    return results;
+}
@@ -0,0 +1,73 @@
+//
+// Choice of the number of groups by information criterion.
+//
+
+#ifndef TREECL_EM_MODELSELECTION_H
+#define TREECL_EM_MODELSELECTION_H
+
+#include <vector>
+#include "Budget.h"
+#include "Dataset.h"
+#include "Optimiser.h"
+#include "ParameterStore.h"
+
+enum class Criterion {
+    BIC,
+    AIC,
+}; // Information criterion used to rank and stop the scan over K
+
+struct SelectionPolicy {
+    unsigned max_groups = 10;       // Kmax
+    unsigned concurrency = 2;       // K values optimised at once
+    unsigned threads = 1;           // Cores shared by all of them
+    unsigned patience = 2;          // Stop once the criterion has worsened for this many consecutive K
+    Criterion criterion = Criterion::BIC;
+    int restarts = 1;
+    int max_iterations = 20;
+    Schedule locus_schedule = Schedule::PARAM_SEARCH;   // Shared single-locus fits
+    Schedule schedule = Schedule::NO_SEARCH;            // Initial schedule of every K
+    Seeding seeding = Seeding::DISTANCE;                // Distances are computed once and shared by every K
+};
+
+struct SelectionResult {
+    unsigned groups;
+    RunResult run;
+    std::vector<int> assignment;
+    std::vector<pergroup> trees;
+    double likelihood;
+    long parameters;    // Free parameters: per-locus models, branch lengths of every group tree, proportions
+    double bic;
+    double aic;
+};
+
+/*
+ * Runs K = 1..max_groups on one dataset, several K at a time, each with its own Optimiser and an equal share of
+ * the threads. Everything that doesn't depend on K is done once and shared: the parsed alignment and partitions,
+ * the native scorer's site patterns (both through the Dataset), and the single-locus fits every run starts its
+ * parameters from. K values are claimed in increasing order; once the criterion has worsened for patience
+ * consecutive K, no larger K is started and runs already going beyond that point are cancelled.
+ */
+class ModelSelector {
+    DatasetSPtr dataset;
+    attrSPtr attr;
+    SelectionPolicy policy;
+    BudgetSPtr budget = std::make_shared<Budget>();
+    ParameterStore fits;
+    bool have_fits = false;
+
+    bool fit_loci();
+    double criterion(const SelectionResult& result) const;
+    long free_parameters(unsigned groups) const;
+
+public:
+    ModelSelector(DatasetSPtr dataset, attrSPtr attr, SelectionPolicy policy) :
+        dataset(dataset), attr(attr), policy(policy) {};
+    void set_budget(BudgetSPtr budget) { this->budget = budget; };
+    const ParameterStore& locus_fits();
+
+    // Completed K values, best first, then those the deadline cut short (run.out_of_budget), best first; none if
+    // the budget runs out during the single-locus fits
+    std::vector<SelectionResult> run();
+};
+
+#endif //TREECL_EM_MODELSELECTION_H
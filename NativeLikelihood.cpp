@@ -0,0 +1,492 @@
+//
+// Self-contained Felsenstein pruning for scoring single loci against fixed trees with fixed parameters.
+//
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include "Arena.h"
+#include "NativeLikelihood.h"
+#include "reduce.h"
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace {
+    // Same scaling scheme as PLL: rescale a pattern's partials by 2^256 once they all fall below 2^-256
+    const double SCALE_THRESHOLD = std::ldexp(1.0, -256);
+    const double SCALE_FACTOR = std::ldexp(1.0, 256);
+    const double LOG_SCALE_THRESHOLD = -256 * std::log(2.0);
+
+    const char* AA_ORDER = "ARNDCQEGHILKMFPSTWYV";
+
+    uint32_t dna_mask(char c) {
+        switch (c) {
+            case 'A': return 1;
+            case 'C': return 2;
+            case 'G': return 4;
+            case 'T': case 'U': return 8;
+            case 'M': return 1 | 2;
+            case 'R': return 1 | 4;
+            case 'W': return 1 | 8;
+            case 'S': return 2 | 4;
+            case 'Y': return 2 | 8;
+            case 'K': return 4 | 8;
+            case 'V': return 1 | 2 | 4;
+            case 'H': return 1 | 2 | 8;
+            case 'D': return 1 | 4 | 8;
+            case 'B': return 2 | 4 | 8;
+            case 'N': case 'O': case 'X': case '-': case '?': return 15;
+            default: return 0;
+        }
+    }
+
+    uint32_t aa_mask(char c) {
+        const char* pos = std::strchr(AA_ORDER, c);
+        if (c != '\0' && pos) return 1u << (pos - AA_ORDER);
+        switch (c) {
+            case 'B': return aa_mask('N') | aa_mask('D');
+            case 'Z': return aa_mask('Q') | aa_mask('E');
+            case 'J': return aa_mask('I') | aa_mask('L');
+            case 'X': case 'U': case 'O': case '-': case '?': case '*': return (1u << 20) - 1;
+            default: return 0;
+        }
+    }
+
+    // out = P v, with P stored column-major and padded to a multiple of 4 rows
+    template<int States>
+    inline void matvec(const double* pm, const double* v, double* out) {
+        const int padded = SubstitutionModel<States>::PADDED;
+#ifdef __AVX2__
+        const int blocks = padded / 4;
+        __m256d acc[blocks];
+        for (int b = 0; b < blocks; ++b) acc[b] = _mm256_setzero_pd();
+        for (int j = 0; j < States; ++j) {
+            __m256d vj = _mm256_broadcast_sd(v + j);
+            const double* col = pm + j * padded;
+            for (int b = 0; b < blocks; ++b) {
+                acc[b] = _mm256_fmadd_pd(_mm256_loadu_pd(col + 4 * b), vj, acc[b]);
+            }
+        }
+        for (int b = 0; b < blocks; ++b) _mm256_storeu_pd(out + 4 * b, acc[b]);
+#else
+        for (int i = 0; i < padded; ++i) out[i] = 0;
+        for (int j = 0; j < States; ++j) {
+            const double* col = pm + j * padded;
+            for (int i = 0; i < padded; ++i) out[i] += col[i] * v[j];
+        }
+#endif
+    }
+
+    // out *= v, elementwise over N (a multiple of 4) values
+    template<int N>
+    inline void multiply_into(double* out, const double* v) {
+#ifdef __AVX2__
+        for (int i = 0; i < N; i += 4) {
+            _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(out + i), _mm256_loadu_pd(v + i)));
+        }
+#else
+        for (int i = 0; i < N; ++i) out[i] *= v[i];
+#endif
+    }
+
+    inline double max_of(const double* v, int n) {
+        double m = v[0];
+        for (int i = 1; i < n; ++i) if (v[i] > m) m = v[i];
+        return m;
+    }
+
+    void read_label(const std::string& s, size_t& pos, std::string& label) {
+        label.clear();
+        if (pos < s.size() && s[pos] == '\'') {
+            size_t end = s.find('\'', pos + 1);
+            if (end == std::string::npos) throw std::invalid_argument("Unterminated quoted label in newick");
+            label.assign(s, pos + 1, end - pos - 1);
+            pos = end + 1;
+            return;
+        }
+        while (pos < s.size() && !std::strchr(",():;", s[pos]) && !std::isspace(static_cast<unsigned char>(s[pos]))) {
+            label.push_back(s[pos++]);
+        }
+    }
+
+    void skip_space(const std::string& s, size_t& pos) {
+        while (pos < s.size() && std::isspace(static_cast<unsigned char>(s[pos]))) ++pos;
+    }
+
+}
+
+std::vector<std::string> alignment_labels(const pllAlignmentData* alignment) {
+    std::vector<std::string> labels;
+    for (int t = 1; t <= alignment->sequenceCount; ++t) {
+        labels.push_back(alignment->sequenceLabels[t]);
+    }
+    return labels;
+}
+
+LocusData::LocusData(const pllAlignmentData* alignment, const PartitionSpec& partition) {
+    bool protein = (partition.data_type == PLL_AA_DATA);
+    if (partition.data_type != PLL_AA_DATA && partition.data_type != PLL_DNA_DATA) {
+        throw std::invalid_argument("Native likelihood supports DNA and amino acid partitions only");
+    }
+    states = protein ? 20 : 4;
+    ntaxa = alignment->sequenceCount;
+
+    std::vector<int> sites;
+    for (const auto& region : partition.regions) {
+        int stride = region.stride > 0 ? region.stride : 1;
+        for (int s = region.start; s <= region.end; s += stride) sites.push_back(s - 1);
+    }
+
+    std::unordered_map<uint32_t, uint8_t> code_of;
+    std::map<std::string, int> pattern_of;
+    std::vector<std::string> columns;
+    std::string column(ntaxa, '\0');
+    for (int site : sites) {
+        int site_weight = alignment->siteWeights[site];
+        if (site_weight == 0) continue; // Not drawn in a bootstrap replicate
+        for (int t = 0; t < ntaxa; ++t) {
+            char c = static_cast<char>(std::toupper(alignment->sequenceData[t + 1][site]));
+            uint32_t mask = protein ? aa_mask(c) : dna_mask(c);
+            if (!mask) throw std::invalid_argument(std::string("Unrecognised character in alignment: ") + c);
+            auto found = code_of.find(mask);
+            if (found == code_of.end()) {
+                found = code_of.emplace(mask, static_cast<uint8_t>(code_masks.size())).first;
+                code_masks.push_back(mask);
+            }
+            column[t] = static_cast<char>(found->second);
+        }
+        auto inserted = pattern_of.emplace(column, static_cast<int>(columns.size()));
+        if (inserted.second) {
+            columns.push_back(column);
+            weights.push_back(0);
+        }
+        weights[inserted.first->second] += site_weight;
+    }
+
+    npatterns = static_cast<int>(columns.size());
+    codes.resize(static_cast<size_t>(ntaxa) * npatterns);
+    for (int p = 0; p < npatterns; ++p) {
+        for (int t = 0; t < ntaxa; ++t) {
+            codes[static_cast<size_t>(t) * npatterns + p] = static_cast<uint8_t>(columns[p][t]);
+        }
+    }
+}
+
+TaxonIndex taxon_index(const std::vector<std::string>& labels) {
+    TaxonIndex taxa;
+    for (size_t i = 0; i < labels.size(); ++i) taxa[labels[i]] = static_cast<int>(i);
+    return taxa;
+}
+
+void NativeTree::parse(const std::string& newick, const TaxonIndex& taxa) {
+    nodes.clear();
+    child_index.clear();
+    stack.clear();
+    ntips = 0;
+    size_t pos = 0;
+    parse_subtree(newick, pos, taxa);
+}
+
+std::string NativeTree::newick(const std::vector<std::string>& labels) const {
+    std::ostringstream out;
+    out.precision(12);
+    write_subtree(root(), labels, out);
+    out << ';';
+    return out.str();
+}
+
+void NativeTree::write_subtree(int n, const std::vector<std::string>& labels, std::ostringstream& out) const {
+    const Node& node = nodes[n];
+    if (node.nchildren == 0) {
+        out << labels[node.taxon];
+    }
+    else {
+        out << '(';
+        const int* kids = children(node);
+        for (int c = 0; c < node.nchildren; ++c) {
+            if (c) out << ',';
+            write_subtree(kids[c], labels, out);
+        }
+        out << ')';
+    }
+    if (n != root()) out << ':' << node.length;
+}
+
+int NativeTree::parse_subtree(const std::string& s, size_t& pos, const TaxonIndex& taxa) {
+    Node node;
+    skip_space(s, pos);
+    if (pos < s.size() && s[pos] == '(') {
+        ++pos;
+        size_t base = stack.size();
+        for (;;) {
+            int child = parse_subtree(s, pos, taxa);
+            stack.push_back(child);
+            skip_space(s, pos);
+            if (pos < s.size() && s[pos] == ',') {
+                ++pos;
+                continue;
+            }
+            if (pos < s.size() && s[pos] == ')') {
+                ++pos;
+                break;
+            }
+            throw std::invalid_argument("Malformed newick string");
+        }
+        node.first_child = static_cast<int>(child_index.size());
+        node.nchildren = static_cast<int>(stack.size() - base);
+        child_index.insert(child_index.end(), stack.begin() + base, stack.end());
+        stack.resize(base);
+        read_label(s, pos, label); // Internal node labels are ignored
+    }
+    else {
+        read_label(s, pos, label);
+        auto it = taxa.find(label);
+        if (it == taxa.end()) throw std::invalid_argument("Tree tip " + label + " is not in the alignment");
+        node.taxon = it->second;
+        ntips++;
+    }
+    skip_space(s, pos);
+    if (pos < s.size() && s[pos] == ':') {
+        ++pos;
+        const char* start = s.c_str() + pos;
+        char* end;
+        node.length = std::strtod(start, &end);
+        pos += end - start;
+    }
+    nodes.push_back(node);
+    return static_cast<int>(nodes.size()) - 1;
+}
+
+namespace {
+    // Pruning kernel for one state count
+    template<int States>
+    class FixedStateScorer : public LocusScorer {
+        using Model = SubstitutionModel<States>;
+        static constexpr int PADDED = Model::PADDED;
+        static constexpr int WIDTH = GAMMA_CATEGORIES * PADDED;    // Partials per pattern
+
+        struct BranchCache {
+            std::array<double, Model::MATRIX_SIZE> pmatrix;
+            double* tip_table;  // ncodes x WIDTH in tables: P applied to each tip state set
+        };
+        std::unique_ptr<Model> model;
+        std::vector<BranchCache> cache;
+        std::vector<std::pair<uint64_t, unsigned>> cache_index;  // Sorted (length bits, cache entry)
+        Arena tables;
+
+        void clear_cache() {
+            cache.clear();
+            cache_index.clear();
+            tables.reset();
+        }
+        const BranchCache& branch(double length);
+        double evaluate() override;
+
+    public:
+        void set_data(std::shared_ptr<const LocusData> data) override {
+            this->data = data;
+            loaded_model.clear();
+            clear_cache();
+            evaluated = false;
+        }
+
+        void set_model(const double* rates, const double* freqs, double alpha) override {
+            if (model) *model = Model(rates, freqs, alpha);
+            else model = std::make_unique<Model>(rates, freqs, alpha);
+            loaded_model.clear();
+            clear_cache();
+            evaluated = false;
+        }
+    };
+
+    template<int States>
+    auto FixedStateScorer<States>::branch(double length) -> const BranchCache& {
+        uint64_t key;
+        std::memcpy(&key, &length, sizeof(key));
+        auto found = std::lower_bound(cache_index.begin(), cache_index.end(), std::make_pair(key, 0u));
+        if (found != cache_index.end() && found->first == key) return cache[found->second];
+        cache_index.insert(found, std::make_pair(key, static_cast<unsigned>(cache.size())));
+
+        const int ncodes = static_cast<int>(data->code_masks.size());
+        cache.emplace_back();
+        BranchCache& bc = cache.back();
+        model->transition_matrices(length, bc.pmatrix.data());
+
+        std::array<double, PADDED> tipvec;
+        bc.tip_table = static_cast<double*>(tables.allocate(sizeof(double) * ncodes * WIDTH, alignof(double)));
+        for (int code = 0; code < ncodes; ++code) {
+            for (int i = 0; i < PADDED; ++i) tipvec[i] = (i < States && (data->code_masks[code] >> i) & 1) ? 1 : 0;
+            for (int c = 0; c < GAMMA_CATEGORIES; ++c) {
+                matvec<States>(bc.pmatrix.data() + c * PADDED * PADDED, tipvec.data(),
+                               bc.tip_table + code * WIDTH + c * PADDED);
+            }
+        }
+        return bc;
+    }
+
+    template<int States>
+    double FixedStateScorer<States>::evaluate() {
+        if (!model || !tree) throw std::runtime_error("LocusScorer needs a model and a tree before evaluating");
+        if (cache.size() > MAX_CACHED_BRANCHES) clear_cache();
+
+        const int npat = data->npatterns;
+        const size_t block = static_cast<size_t>(npat) * WIDTH;
+        Arena& arena = thread_arena();
+        ArenaScope scope(arena);
+
+        ArenaVector<int> slot(tree->nodes.size(), -1, ArenaAllocator<int>(arena));
+        int ninternal = 0;
+        for (size_t n = 0; n < tree->nodes.size(); ++n) {
+            if (tree->nodes[n].taxon < 0) slot[n] = ninternal++;
+        }
+        ArenaVector<double> clv(block * ninternal, ArenaAllocator<double>(arena));        // One block per internal node
+        ArenaVector<int> scale(static_cast<size_t>(npat) * ninternal, ArenaAllocator<int>(arena)); // Scaling counts
+        std::array<double, PADDED> tmp;
+
+        for (size_t n = 0; n < tree->nodes.size(); ++n) {
+            const auto& node = tree->nodes[n];
+            if (node.taxon >= 0) continue;
+            double* out = clv.data() + block * slot[n];
+            int* sc = scale.data() + static_cast<size_t>(npat) * slot[n];
+            std::fill(sc, sc + npat, 0);
+
+            const int* kids = tree->children(node);
+            for (int k = 0; k < node.nchildren; ++k) {
+                const auto& child = tree->nodes[kids[k]];
+                const BranchCache& bc = branch(child.length);
+                if (child.taxon >= 0) {
+                    const uint8_t* codes = data->taxon_codes(child.taxon);
+                    for (int p = 0; p < npat; ++p) {
+                        const double* v = bc.tip_table + static_cast<size_t>(codes[p]) * WIDTH;
+                        double* o = out + static_cast<size_t>(p) * WIDTH;
+                        if (k == 0) std::memcpy(o, v, WIDTH * sizeof(double));
+                        else multiply_into<WIDTH>(o, v);
+                    }
+                }
+                else {
+                    const double* in = clv.data() + block * slot[kids[k]];
+                    const int* child_sc = scale.data() + static_cast<size_t>(npat) * slot[kids[k]];
+                    for (int p = 0; p < npat; ++p) {
+                        for (int c = 0; c < GAMMA_CATEGORIES; ++c) {
+                            size_t offset = static_cast<size_t>(p) * WIDTH + c * PADDED;
+                            const double* pm = bc.pmatrix.data() + c * PADDED * PADDED;
+                            if (k == 0) {
+                                matvec<States>(pm, in + offset, out + offset);
+                            }
+                            else {
+                                matvec<States>(pm, in + offset, tmp.data());
+                                multiply_into<PADDED>(out + offset, tmp.data());
+                            }
+                        }
+                        sc[p] += child_sc[p];
+                    }
+                }
+            }
+
+            for (int p = 0; p < npat; ++p) {
+                double* o = out + static_cast<size_t>(p) * WIDTH;
+                if (max_of(o, WIDTH) < SCALE_THRESHOLD) {
+                    for (int i = 0; i < WIDTH; ++i) o[i] *= SCALE_FACTOR;
+                    sc[p]++;
+                }
+            }
+        }
+
+        // Root: average over rate categories, weighted by the equilibrium frequencies
+        int root = tree->root();
+        const double* rclv = clv.data() + block * slot[root];
+        const int* rsc = scale.data() + static_cast<size_t>(npat) * slot[root];
+        const auto& pi = model->frequencies();
+        ArenaVector<double> site_lnl(npat, ArenaAllocator<double>(arena));
+        for (int p = 0; p < npat; ++p) {
+            double site = 0;
+            for (int c = 0; c < GAMMA_CATEGORIES; ++c) {
+                const double* v = rclv + static_cast<size_t>(p) * WIDTH + c * PADDED;
+                for (int i = 0; i < States; ++i) site += pi[i] * v[i];
+            }
+            site_lnl[p] = data->weights[p] * (std::log(site / GAMMA_CATEGORIES) + rsc[p] * LOG_SCALE_THRESHOLD);
+        }
+        return reduce::pairwise_sum(site_lnl);
+    }
+}
+
+LocusScorer& LocusScorer::for_thread(int states) {
+    thread_local FixedStateScorer<4> dna;
+    thread_local FixedStateScorer<20> protein;
+    switch (states) {
+        case 4:  return dna;
+        case 20: return protein;
+        default: throw std::invalid_argument("Native likelihood supports 4 or 20 states only");
+    }
+}
+
+void LocusScorer::load(std::shared_ptr<const LocusData> data, const double* rates, const double* freqs,
+                       double alpha) {
+    int states = data->states;
+    size_t nrates = static_cast<size_t>(states) * (states - 1) / 2;
+    bool same = data == this->data && loaded_model.size() == 1 + states + nrates && loaded_model[0] == alpha &&
+                std::equal(freqs, freqs + states, loaded_model.begin() + 1) &&
+                std::equal(rates, rates + nrates, loaded_model.begin() + 1 + states);
+    if (same) return;
+    set_data(data);
+    set_model(rates, freqs, alpha);
+    loaded_model.assign(1, alpha);
+    loaded_model.insert(loaded_model.end(), freqs, freqs + states);
+    loaded_model.insert(loaded_model.end(), rates, rates + nrates);
+}
+
+void LocusScorer::set_tree(std::shared_ptr<const NativeTree> tree, bool evaluate) {
+    this->tree = tree;
+    evaluated = false;
+    if (evaluate) get_likelihood();
+}
+
+double LocusScorer::get_likelihood() {
+    if (!evaluated) {
+        likelihood = evaluate();
+        evaluated = true;
+    }
+    return likelihood;
+}
+
+// Weighted Fitch parsimony on the current tree
+unsigned LocusScorer::get_parsimony() {
+    if (!tree) throw std::runtime_error("LocusScorer needs a tree before evaluating parsimony");
+    const int npat = data->npatterns;
+    Arena& arena = thread_arena();
+    ArenaScope scope(arena);
+    ArenaVector<uint32_t> sets(tree->nodes.size() * npat, ArenaAllocator<uint32_t>(arena));  // Node-major
+    double cost = 0;
+    for (size_t n = 0; n < tree->nodes.size(); ++n) {
+        const auto& node = tree->nodes[n];
+        uint32_t* set = sets.data() + n * npat;
+        if (node.taxon >= 0) {
+            const uint8_t* codes = data->taxon_codes(node.taxon);
+            for (int p = 0; p < npat; ++p) set[p] = data->code_masks[codes[p]];
+            continue;
+        }
+        const int* kids = tree->children(node);
+        const uint32_t* first = sets.data() + static_cast<size_t>(kids[0]) * npat;
+        std::copy(first, first + npat, set);
+        for (int k = 1; k < node.nchildren; ++k) {
+            const uint32_t* other = sets.data() + static_cast<size_t>(kids[k]) * npat;
+            for (int p = 0; p < npat; ++p) {
+                uint32_t both = set[p] & other[p];
+                if (both) {
+                    set[p] = both;
+                }
+                else {
+                    set[p] |= other[p];
+                    cost += data->weights[p];
+                }
+            }
+        }
+    }
+    return static_cast<unsigned>(cost);
+}
@@ -0,0 +1,104 @@
+//
+// Self-contained Felsenstein pruning for scoring single loci against fixed trees with fixed parameters.
+//
+
+#ifndef TREECL_EM_NATIVELIKELIHOOD_H
+#define TREECL_EM_NATIVELIKELIHOOD_H
+
+#include <cstdint>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "memory_management.h"
+#include "PartitionTable.h"
+#include "SubstitutionModel.h"
+
+// Site patterns of one locus, with tip states encoded as indices into a table of state sets
+class LocusData {
+public:
+    int states;
+    int ntaxa;
+    int npatterns;
+    std::vector<double> weights;        // Pattern multiplicities, summing the alignment's site weights
+    std::vector<uint8_t> codes;         // ntaxa x npatterns, taxon-major
+    std::vector<uint32_t> code_masks;   // State set (bit per state) of each code
+
+    // alignment must not have been loaded into a PLL instance (which recodes it); taxa are indexed from 0
+    LocusData(const pllAlignmentData* alignment, const PartitionSpec& partition);
+    const uint8_t* taxon_codes(int taxon) const { return codes.data() + static_cast<size_t>(taxon) * npatterns; }
+};
+
+using TaxonIndex = std::unordered_map<std::string, int>;
+
+// Newick tree with tips resolved to alignment taxon indices
+class NativeTree {
+public:
+    struct Node {
+        int first_child = 0;    // Children are child_index[first_child, first_child + nchildren)
+        int nchildren = 0;
+        double length = 0;      // Length of the branch to the parent
+        int taxon = -1;         // Alignment index for tips
+    };
+    std::vector<Node> nodes;    // Post-order: children always precede their parent; the root is last
+    std::vector<int> child_index;
+    int ntips = 0;
+
+    NativeTree() = default;
+    NativeTree(const std::string& newick, const TaxonIndex& taxa) { parse(newick, taxa); }
+
+    // Replace the tree, reusing this object's storage
+    void parse(const std::string& newick, const TaxonIndex& taxa);
+    const int* children(const Node& node) const { return child_index.data() + node.first_child; }
+    int root() const { return static_cast<int>(nodes.size()) - 1; }
+    // Newick string, tips named by labels[taxon]
+    std::string newick(const std::vector<std::string>& labels) const;
+
+private:
+    std::vector<int> stack;     // Parser scratch: children of the nodes being read
+    std::string label;
+    int parse_subtree(const std::string& s, size_t& pos, const TaxonIndex& taxa);
+    void write_subtree(int node, const std::vector<std::string>& labels, std::ostringstream& out) const;
+};
+
+std::vector<std::string> alignment_labels(const pllAlignmentData* alignment);
+TaxonIndex taxon_index(const std::vector<std::string>& labels);
+
+/*
+ * Likelihood of one locus under a fixed model. Mirrors the parts of the PLL wrapper the E-step uses (set_tree,
+ * get_likelihood, get_parsimony) so it can be used in its place. The pruning kernel is compiled separately for
+ * each supported state count (4 and 20). Scorers hold no per-locus storage beyond their branch cache, so each
+ * thread keeps one per state count (for_thread) and loads loci into it in turn; partials and other scratch come
+ * from the thread's arena.
+ */
+class LocusScorer {
+protected:
+    std::shared_ptr<const LocusData> data;
+    std::shared_ptr<const NativeTree> tree;
+    double likelihood = 0;
+    bool evaluated = false;
+    std::vector<double> loaded_model;   // alpha, freqs, rates as last given to load(); cleared by set_data/set_model
+
+    virtual double evaluate() = 0;
+
+public:
+    // Transition matrices, and their products with each tip state set, are cached per branch length until the
+    // model changes or this many lengths have been seen
+    static const size_t MAX_CACHED_BRANCHES = 4096;
+
+    // The calling thread's scorer for loci with this many states
+    static LocusScorer& for_thread(int states);
+    virtual ~LocusScorer() = default;
+    virtual void set_data(std::shared_ptr<const LocusData> data) = 0;  // Must be followed by set_model
+    virtual void set_model(const double* rates, const double* freqs, double alpha) = 0;
+    // set_data and set_model, skipped if this locus and model are already loaded, so the model's eigensystem and the
+    // branch cache survive scoring one locus against several trees
+    void load(std::shared_ptr<const LocusData> data, const double* rates, const double* freqs, double alpha);
+    void set_tree(std::shared_ptr<const NativeTree> tree, bool evaluate=true);
+    double get_likelihood();
+    unsigned get_parsimony();
+    int states() const { return data->states; }
+};
+
+#endif //TREECL_EM_NATIVELIKELIHOOD_H
@@ -5,17 +5,46 @@
 #include "Optimiser.h"
 #include "utils.h"
 #include "ValueTable.h"
+#include "reduce.h"
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <future>
 #include <cmath>
+#include <numeric>
 #include <random>
+#include <stdexcept>
+#include <tuple>
+
+const char* schedule_name(Schedule schedule) {
+    switch (schedule) {
+        case Schedule::NO_SEARCH:    return "NO_SEARCH";
+        case Schedule::PARAM_SEARCH: return "PARAM_SEARCH";
+        case Schedule::TREE_SEARCH:  return "TREE_SEARCH";
+        case Schedule::FULL_SEARCH:  return "FULL_SEARCH";
+    }
+    return "UNKNOWN";
+}
+
+Schedule parse_schedule(const std::string& name) {
+    for (Schedule schedule : {Schedule::NO_SEARCH, Schedule::PARAM_SEARCH, Schedule::TREE_SEARCH,
+                              Schedule::FULL_SEARCH}) {
+        if (name == schedule_name(schedule)) return schedule;
+    }
+    throw std::invalid_argument("Unknown schedule: " + name);
+}
 
 int Optimiser::get_number_of_groups(const std::vector<int>& a) {
     auto max_elem = std::max_element(a.begin(), a.end());
     return 1 + *max_elem;
 }
 
+// Group members are cleared rather than erased so their storage is reused from one iteration to the next
 void Optimiser::index(const std::vector<int>& a) {
-    indexmap.clear();
+    for (auto& members : indexmap) members.second.clear();
     for (int i = 0; i < a.size(); ++i) {
         int grp = a[i];
         indexmap[grp].push_back(i);
@@ -24,8 +53,6 @@ void Optimiser::index(const std::vector<int>& a) {
 
 std::vector<int> Optimiser::make_random_assignment() {
     std::vector<int> v;
-    std::random_device rd;
-    std::mt19937 engine(rd());
     std::uniform_int_distribution<int> dist(0, nGroups-1);
 
     for (int i=0; i < nGroups; ++i) {
@@ -33,29 +60,61 @@ std::vector<int> Optimiser::make_random_assignment() {
     }
 
     for (int i=nGroups; i < nLoci; ++i ) {
-        v.push_back(dist(engine));
+        v.push_back(dist(rng));
     }
 
-    std::shuffle(v.begin(), v.end(), engine);
+    std::shuffle(v.begin(), v.end(), rng);
     return v;
 }
 
-std::vector<double> Optimiser::get_proportions(int pseudocount) {
-    std::vector<double> props;
+// Clusters of loci with similar taxon distances. The distances are computed once per dataset; each call draws new
+// k-means++ centres, so restarts still start from different assignments.
+std::vector<int> Optimiser::make_distance_assignment() {
+    make_pool();
+    const DistanceTable& distances = dataset->locus_distances(*pool);
+    return kmeans_plus_plus(distances, nGroups, rng);
+}
 
+// Proportions with the default pseudocount, updated in place
+void Optimiser::update_proportions() {
+    ArenaVector<unsigned> counts(nGroups, ArenaAllocator<unsigned>(iteration_arena));
+    reduce::histogram(assignment, nGroups, counts.begin());
+    proportions.resize(nGroups);
     for (int i=0; i<nGroups; ++i) {
-        props.push_back(std::count(assignment.begin(), assignment.end(), i));
+        proportions[i] = (counts[i] + 1) / static_cast<double>(nLoci + nGroups);
     }
+}
+
+std::vector<double> Optimiser::get_proportions(int pseudocount) {
+    std::vector<unsigned> counts = reduce::histogram(assignment, nGroups);
+    std::vector<double> props(nGroups);
 
-    for (double& n : props) {
-        n = (n + pseudocount) / (nLoci + (pseudocount * nGroups));
+    for (int i=0; i<nGroups; ++i) {
+        props[i] = (counts[i] + pseudocount) / static_cast<double>(nLoci + (pseudocount * nGroups));
     }
 
     return props;
 }
 
+// Summed on the worker pool; parallel_sum gives the same bits as a serial pairwise sum, so these don't depend on the
+// thread count
+std::vector<double> Optimiser::get_expected_sizes() {
+    if (!have_posterior) throw std::runtime_error("No posterior yet: run an E-step first");
+    make_pool();
+    return sparse ? sparse->colsum(pool.get()) : vtab->colsum(pool.get());
+}
+
 void Optimiser::make_probability_table() {
-    std::vector<double> logprobsum;
+    if (posterior == Posterior::SPARSE) {
+        sparse->clear();
+        for (const auto& row : vtab->get_table()) {
+            sparse->append_log_row(row);
+        }
+        return;
+    }
+
+    ArenaVector<double> logprobsum{ArenaAllocator<double>(iteration_arena)};
+    logprobsum.reserve(vtab->nrows());
     for (const auto& row : vtab->get_table()) {
         double lps = utils::logsumexp(row);
         std::cout << "LPS = " << lps << std::endl;
@@ -69,36 +128,239 @@ void Optimiser::make_probability_table() {
     }
 }
 
+// Build a single-locus instance loaded with the current parameter estimates for locus i
+PLLUPtr Optimiser::make_locus_pll(int i) {
+    auto locus_al = utils::copy_alignment(dataset->alignment());
+    auto locus_q = dataset->partitions().make_queue(i);
+    pllInstanceAttr locus_attr = *attr;
+    if (!locus_modes.empty()) apply_mode(locus_modes[i], locus_attr);
+    PLLUPtr pll = std::make_unique<PLL>(locus_attr, locus_q.get(), locus_al.get());
+
+    // Load current parameter estimates
+    pll->set_alpha(parameters.alpha(i), 0, false);
+    pll->set_frequencies(parameters.freqs(i), 0, false);
+    pll->set_rates(parameters.rates(i), 0, false);
+    return pll;
+}
+
+// Log joint probability of locus i (already loaded into pll) and group j
+double Optimiser::score_cell(PLL& pll, int j) {
+    if (trees[j].tree.empty()) return UNLIKELY; // Group has never been optimised
+    pll.set_tree(trees[j].tree);
+    return pll.get_likelihood() + log(proportions[j]);
+}
+
+// Site patterns of every locus, for the native scorer, built by the dataset the first time any Optimiser asks
+void Optimiser::load_locus_data() {
+    locus_data = dataset->locus_data();
+}
+
+// The calling thread's scorer, loaded with locus i and its current parameter estimates. Reloading the same locus and
+// parameters is free, so scoring one locus against every group builds its model once.
+LocusScorer& Optimiser::load_locus_scorer(int i) {
+    LocusScorer& scorer = LocusScorer::for_thread(locus_data[i]->states);
+    scorer.load(locus_data[i], parameters.rates(i), parameters.freqs(i), parameters.alpha(i));
+    return scorer;
+}
+
+void Optimiser::update_native_tree(int g) {
+    if (scorer != Scorer::NATIVE || trees[g].tree.empty()) return;
+    if (!native_trees[g]) native_trees[g] = std::make_shared<NativeTree>();
+    native_trees[g]->parse(trees[g].tree, dataset->taxa());
+}
+
+void Optimiser::refresh_native_trees() {
+    native_trees.assign(nGroups, nullptr);
+    if (scorer != Scorer::NATIVE) return;
+    if (locus_data.empty()) load_locus_data();
+    for (int g=0; g < nGroups; ++g) update_native_tree(g);
+}
+
+double Optimiser::score_cell(LocusScorer& scorer, int j) {
+    if (trees[j].tree.empty()) return UNLIKELY;
+    scorer.set_tree(native_trees[j]);
+    return scorer.get_likelihood() + log(proportions[j]);
+}
+
+// Decide whether this E-step is a full refresh and, if not, collect each locus's top-k groups from the previous
+// posterior. Its current group is always kept.
+void Optimiser::prepare_candidates() {
+    bool refresh = !pruning.enabled || !have_posterior || pruning.refresh_interval <= 1 ||
+                   iteration % pruning.refresh_interval == 0;
+    use_candidates = !refresh;
+    estep_stats.push_back(EStepStats{iteration, refresh, static_cast<long>(nLoci) * nGroups, 0, 0, 0});
+    if (refresh) return;
+
+    candidates.resize(nLoci);
+    ArenaVector<std::pair<double, unsigned>> ranked{ArenaAllocator<std::pair<double, unsigned>>(iteration_arena)};
+    ranked.reserve(nGroups);
+    for (int i=0; i < nLoci; ++i) {
+        ranked.clear();
+        if (posterior == Posterior::SPARSE) {
+            for (const auto& e : sparse->row(i)) ranked.emplace_back(e.prob, e.group);
+        }
+        else {
+            const auto& row = vtab->get_table()[i];
+            for (unsigned j=0; j < nGroups; ++j) ranked.emplace_back(row[j], j);
+        }
+        size_t k = std::min<size_t>(pruning.top_k, ranked.size());
+        std::partial_sort(ranked.begin(), ranked.begin() + k, ranked.end(),
+                          [](const std::pair<double, unsigned>& x, const std::pair<double, unsigned>& y) {
+                              return x.first > y.first;
+                          });
+        auto& cand = candidates[i];
+        cand.clear();
+        for (size_t r=0; r < k; ++r) cand.push_back(ranked[r].second);
+        cand.push_back(assignment[i]);
+        std::sort(cand.begin(), cand.end());
+        cand.erase(std::unique(cand.begin(), cand.end()), cand.end());
+    }
+}
+
+// Groups to score locus i against: everything on a refresh, otherwise its candidates plus any group that changed
+void Optimiser::candidate_groups(int i, std::vector<unsigned>& groups) {
+    groups.clear();
+    for (unsigned j=0; j < nGroups; ++j) {
+        if (!use_candidates || trees[j].changed ||
+            std::binary_search(candidates[i].begin(), candidates[i].end(), j)) {
+            groups.push_back(j);
+        }
+    }
+}
+
+/*
+ * Score locus i against its groups, skipping the exact likelihood for groups the parsimony screen shows can't reach
+ * the posterior threshold. Rejected groups are removed from groups; returns how many were rejected.
+ */
+template<typename Engine>
+long Optimiser::screen_locus(Engine& engine, int i, std::vector<unsigned>& groups, std::vector<double>& scores) {
+    int ref = assignment[i];
+    double ref_score = score_cell(engine, ref);
+    scores.clear();
+    if (ref_score == UNLIKELY) {
+        for (unsigned j : groups) scores.push_back(score_cell(engine, j));
+        return 0;
+    }
+    double ref_lnl = ref_score - log(proportions[ref]);
+    unsigned ref_pars = engine.get_parsimony();
+    bool sample = !screen.is_calibrated() || (i + iteration) % std::max(1, screening.sample_every) == 0;
+
+    Arena& arena = thread_arena();
+    ArenaScope scope(arena);
+    ArenaVector<unsigned> kept{ArenaAllocator<unsigned>(arena)};
+    ArenaVector<double> exact{ArenaAllocator<double>(arena)}; // Exactly scored cells so far; a conservative
+    exact.push_back(ref_score);                                 // posterior denominator
+    long rejected = 0;
+    for (unsigned j : groups) {
+        if (j == ref || trees[j].tree.empty()) {
+            kept.push_back(j);
+            scores.push_back(j == ref ? ref_score : UNLIKELY);
+            continue;
+        }
+        load_tree(engine, j);
+        unsigned pars = engine.get_parsimony();
+        if (!sample) {
+            double bound = screen.upper_bound(ref_lnl, ref_pars, pars, screening.z) + log(proportions[j]);
+            if (bound - utils::logsumexp(exact.data(), exact.size()) < log(screening.threshold)) {
+                ++rejected;
+                continue;
+            }
+        }
+        double lnl = engine.get_likelihood();
+        if (sample) screen.add_sample(static_cast<double>(pars) - ref_pars, lnl - ref_lnl, screening.max_samples);
+        kept.push_back(j);
+        scores.push_back(lnl + log(proportions[j]));
+        exact.push_back(scores.back());
+    }
+    groups.assign(kept.begin(), kept.end());
+    return rejected;
+}
+
+// Score locus i (loaded into engine) against groups, screening if enabled; returns the number of screened cells
+template<typename Engine>
+long Optimiser::score_locus(Engine& engine, int i, std::vector<unsigned>& groups, std::vector<double>& scores) {
+    if (screening.enabled) return screen_locus(engine, i, groups, scores);
+    scores.resize(groups.size());
+    for (size_t k=0; k < groups.size(); ++k) {
+        scores[k] = score_cell(engine, groups[k]);
+    }
+    return 0;
+}
+
 void Optimiser::eStep() {
+    PerfPhaseScope perf(PerfPhase::E_STEP);
+    prepare_candidates();
+    auto& groups = estep_groups;
+    auto& scores = estep_scores;
+    groups.reserve(nGroups);
+    scores.reserve(nGroups);
+    long scored = 0;
+    long screened = 0;
+    if (posterior == Posterior::SPARSE) sparse->clear();
+    if (scorer == Scorer::NATIVE && locus_data.empty()) load_locus_data();
+    if (live) {
+        live->cells_done.store(0, std::memory_order_relaxed);
+        live->cells_total.store(static_cast<int64_t>(nLoci) * nGroups, std::memory_order_relaxed);
+    }
+
     for (int i=0; i < nLoci; ++i) {
-        // TODO: nLoci reads of the alignment file every eStep? Too many!
-        al = utils::parse_alignment_file(alignment);
-        q = utils::parse_partitions(partitions[i].c_str());
-        PLLUPtr pll = std::make_unique<PLL>(*attr, q.get(), al.get());
-
-        // Load current parameter estimates
-        pll->set_alpha(parameters[i].alpha, 0, false);
-        pll->set_frequencies(parameters[i].freqs, 0, false);
-        pll->set_rates(parameters[i].rates, 0, false);
-        for (int j=0; j < nGroups; ++j) {
-            auto x=trees.size();
-            auto tree = trees[j].tree;
-            pll->set_tree(trees[j].tree);
-            vtab->set(i, j, pll->get_likelihood() + log(proportions[j]));
+        if (budget->expired()) {
+            interrupted = true;
+            return;
+        }
+        candidate_groups(i, groups);
+        if (scorer == Scorer::NATIVE) {
+            screened += score_locus(load_locus_scorer(i), i, groups, scores);
+        }
+        else if (!cache || screening.enabled || !cached_cells(i, groups, scores)) {
+            PLLUPtr pll = make_locus_pll(i);
+            screened += score_locus(*pll, i, groups, scores);
+            if (cache && !screening.enabled) store_cells(i, groups, scores);
+        }
+        scored += groups.size();
+        if (live) live->cells_done.fetch_add(nGroups, std::memory_order_relaxed);  // Skipped cells are done too
+
+        if (posterior == Posterior::SPARSE) {
+            // Each row is normalised and thinned as soon as it is scored, so no dense table is held
+            sparse->append_log_row(groups, scores);
+        }
+        else {
+            for (int j=0; j < nGroups; ++j) vtab->set(i, j, UNLIKELY);
+            for (size_t k=0; k < groups.size(); ++k) vtab->set(i, groups[k], scores[k]);
         }
     }
-    make_probability_table();
+    estep_stats.back().skipped = estep_stats.back().cells - scored;
+    estep_stats.back().screened = screened;
+    if (screening.enabled) screen.fit(screening.min_samples);
+    if (posterior == Posterior::DENSE) make_probability_table();
+    have_posterior = true;
 }
 
 void Optimiser::cStep() {
+    std::vector<int>& a = proposed;
+    a = assignment;
     switch (classifier) {
         case Classifier::MAP:
+            for (int i=0; i < nLoci; ++i) {
+                if (posterior == Posterior::SPARSE) {
+                    a[i] = static_cast<int>(sparse->map(i));
+                    continue;
+                }
+                const auto& row = vtab->get_table()[i];
+                a[i] = static_cast<int>(std::max_element(row.begin(), row.end()) - row.begin());
+            }
             break;
         case Classifier::IMPUTE:
             break;
         case Classifier::ANNEAL:
             break;
     }
+    if (!estep_stats.empty() && estep_stats.back().iteration == iteration) {
+        int reassigned = 0;
+        for (int i=0; i < nLoci; ++i) reassigned += (a[i] != assignment[i]);
+        estep_stats.back().reassigned = reassigned;
+    }
+    update_assignment(a);
 }
 
 // MAP function
@@ -117,68 +379,457 @@ void Optimiser::cStep() {
 
 
 
-void Optimiser::mStep() {
-    int index;
-    double lnl = 0;
+// Group g's schedule, downgraded to one without tree search if the budget can't cover a search. A tree search can't
+// be interrupted, and the group's last M-step time is the only estimate available.
+Schedule Optimiser::affordable_schedule(int g) {
+    Schedule group_schedule = group_schedules[g];
+    bool searching = (group_schedule == Schedule::TREE_SEARCH || group_schedule == Schedule::FULL_SEARCH);
+    if (searching && !budget->can_afford(trees[g].seconds)) {
+        group_schedule = (group_schedule == Schedule::FULL_SEARCH) ? Schedule::PARAM_SEARCH : Schedule::NO_SEARCH;
+    }
+    return group_schedule;
+}
+
+// Fit group g's tree to the given loci, starting from the group's current tree and the loci's current parameters.
+// With weights, the sites of loci[k] count weights[k] times. Only the parameters of the first saved loci are kept.
+pllresult Optimiser::fit_group(int g, const std::vector<int>& loci, Schedule group_schedule,
+                               const std::vector<int>& weights, size_t saved) {
+    saved = std::min(saved, loci.size());
+    std::vector<int> saved_loci(loci.begin(), loci.begin() + saved);
+    ContentHash key;
+    pllresult result;
+    if (cache) {
+        key.add("group fit").add(group_schedule).add(have_parameters).add(saved);
+        add_instance_key(key);
+        for (size_t k = 0; k < loci.size(); ++k) {
+            add_locus_key(key, loci[k]);
+            key.add(weights.empty() ? 1 : weights[k]);
+        }
+        if (have_parameters) key.add(trees[g].tree);
+        if (cached_fit(key, saved_loci, result)) return result;
+    }
 
+    auto group_al = utils::copy_alignment(dataset->alignment());
+    for (size_t k = 0; k < weights.size(); ++k) {
+        dataset->partitions().set_site_weights(group_al.get(), loci[k], weights[k]);
+    }
+    auto group_q = dataset->partitions().make_queue(loci);
+    pllInstanceAttr group_attr = *attr;
+    size_t planned_bytes = 0;
+    if (g < group_plan.modes.size()) { // A group split off since the last plan runs in full
+        apply_mode(group_plan.modes[g], group_attr);
+        planned_bytes = group_plan.bytes[g];
+    }
+    // Held until the instance is destroyed at the end of this function
+    MemoryGate::Reservation reservation(memory_gate.get(), planned_bytes);
+    PLLUPtr pll = std::make_unique<PLL>(group_attr, group_q.get(), group_al.get());
+
+    // Load current parameter estimates, if we have any yet (which we don't on first iteration)
+    if (have_parameters) {
+        bool opt = (group_schedule == Schedule::PARAM_SEARCH || group_schedule == Schedule::FULL_SEARCH);
+        for (int wgi = 0; wgi < loci.size(); ++wgi) {  // wgi = within group index; wdi = within dataset index
+            int wdi = loci[wgi];
+            pll->set_alpha(parameters.alpha(wdi), wgi, opt);
+            pll->set_frequencies(parameters.freqs(wdi), wgi, opt);
+            pll->set_rates(parameters.rates(wdi), wgi, opt);
+        }
+        if (!trees[g].tree.empty()) pll->set_tree(trees[g].tree);
+    }
+
+    // Optimise, saving the parameters of the loci
+    result = doOpt(std::move(pll), group_schedule, saved_loci);
+    // A fit the budget cut short (or a search it skipped) isn't the schedule's result, so it isn't cached. Expiry is
+    // permanent, so checking afterwards also catches a budget that ran out before or during the fit.
+    if (cache && !budget->expired()) store_fit(key, saved_loci, result);
+    return result;
+}
+
+// Model and likelihood settings of the PLL instances, which every cached result depends on
+void Optimiser::add_instance_key(ContentHash& key) {
+    key.add(attr->rateHetModel).add(attr->fastScaling).add(attr->randomNumberSeed);
+}
+
+// Locus i's data and, if there are any yet, its current parameters
+void Optimiser::add_locus_key(ContentHash& key, int i) {
+    key.add(dataset->locus_hashes()[i].hex());
+    if (!have_parameters) return;
+    int states = parameters.states(i);
+    key.add(parameters.alpha(i));
+    key.add(parameters.freqs(i), states * sizeof(double));
+    key.add(parameters.rates(i), ParameterStore::rates_size(states) * sizeof(double));
+}
+
+// Cached group fit: the tree and likelihood, and the parameters of the saved loci
+bool Optimiser::cached_fit(const ContentHash& key, const std::vector<int>& loci, pllresult& result) {
+    std::string value;
+    if (!cache->get(key, value)) return false;
+    CacheReader reader(value);
+    uint64_t n = 0;
+    if (!reader.get(result.tree) || !reader.get(result.likelihood) || !reader.get(n) || n != loci.size()) {
+        return false;
+    }
+    // Parsed into scratch first, so a damaged entry leaves the store untouched. A record is alpha, likelihood,
+    // freqs, rates: the store's own layout.
+    std::vector<double> records;
+    for (int i : loci) {
+        size_t stride = ParameterStore::stride(parameters.states(i));
+        for (size_t v = 0; v < stride; ++v) {
+            records.push_back(0);
+            if (!reader.get(records.back())) return false;
+        }
+    }
+    if (!reader.done()) return false;
+    const double* record = records.data();
+    for (int i : loci) {
+        int states = parameters.states(i);
+        parameters.alpha(i) = record[0];
+        parameters.likelihood(i) = record[1];
+        std::copy(record + 2, record + 2 + states, parameters.freqs(i));
+        std::copy(record + 2 + states, record + ParameterStore::stride(states), parameters.rates(i));
+        record += ParameterStore::stride(states);
+    }
+    result.trace = OptimiseTrace();
+    return true;
+}
+
+// Locus i with its current parameters, as loaded into a single-locus PLL instance; the tree is added per cell
+ContentHash Optimiser::cell_key(int i) {
+    ContentHash key;
+    key.add("cell");
+    add_instance_key(key);
+    add_locus_key(key, i);
+    return key;
+}
+
+// Log joint probabilities of locus i and groups, if every cell's likelihood is cached. Cells hold the likelihood
+// alone, since the proportions change every iteration.
+bool Optimiser::cached_cells(int i, const std::vector<unsigned>& groups, std::vector<double>& scores) {
+    ContentHash base = cell_key(i);
+    std::string value;
+    scores.resize(groups.size());
+    for (size_t k = 0; k < groups.size(); ++k) {
+        unsigned j = groups[k];
+        if (trees[j].tree.empty()) {
+            scores[k] = UNLIKELY;
+            continue;
+        }
+        ContentHash key = base;
+        key.add(trees[j].tree);
+        double lnl;
+        if (!cache->get(key, value)) return false;
+        CacheReader reader(value);
+        if (!reader.get(lnl) || !reader.done()) return false;
+        scores[k] = lnl + log(proportions[j]);
+    }
+    return true;
+}
+
+void Optimiser::store_cells(int i, const std::vector<unsigned>& groups, const std::vector<double>& scores) {
+    ContentHash base = cell_key(i);
+    for (size_t k = 0; k < groups.size(); ++k) {
+        unsigned j = groups[k];
+        if (trees[j].tree.empty() || scores[k] == UNLIKELY) continue;
+        ContentHash key = base;
+        key.add(trees[j].tree);
+        CacheWriter writer;
+        writer.put(scores[k] - log(proportions[j]));
+        cache->put(key, writer.str());
+    }
+}
+
+void Optimiser::store_fit(const ContentHash& key, const std::vector<int>& loci, const pllresult& result) {
+    CacheWriter writer;
+    writer.put(result.tree).put(result.likelihood).put<uint64_t>(loci.size());
+    for (int i : loci) {
+        int states = parameters.states(i);
+        writer.put(parameters.alpha(i)).put(parameters.likelihood(i));
+        for (int s = 0; s < states; ++s) writer.put(parameters.freqs(i)[s]);
+        for (size_t r = 0; r < ParameterStore::rates_size(states); ++r) writer.put(parameters.rates(i)[r]);
+    }
+    cache->put(key, writer.str());
+}
+
+// Optimise the tree and parameters of group g, returning the change in the group's likelihood. Weighted fits use
+// the loci and weights of the last prepare_soft_groups.
+double Optimiser::optimise_group(int g, bool weighted) {
+    auto start = std::chrono::steady_clock::now();
+    pllresult result;
+    if (weighted) {
+        // Weighted likelihoods are in 1/resolution units; the group's is the expected complete-data lnL of its loci
+        const SoftGroup& group = soft_groups[g];
+        result = fit_group(g, group.loci, affordable_schedule(g), group.weights, group.members);
+        for (size_t k = 0; k < group.members; ++k) parameters.likelihood(group.loci[k]) /= group.weights[k];
+        result.likelihood /= soft.resolution;
+    }
+    else {
+        result = fit_group(g, indexmap[g], affordable_schedule(g));
+    }
+
+    double gain = result.likelihood - trees[g].likelihood;
+    trees[g].changed = !utils::same_topology(trees[g].tree, result.tree) ||
+                       std::abs(gain) > pruning.change_threshold * indexmap[g].size();
+    trees[g].tree = result.tree;
+    trees[g].likelihood = result.likelihood;
+    trees[g].trace = std::move(result.trace);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    trees[g].seconds = elapsed.count();
+    update_native_tree(g);
+    return gain;
+}
+
+/*
+ * Loci and site weights of each group for a posterior-weighted M-step. Own loci are weighted by their posterior
+ * too, but never below one unit: the C-step may have put a locus where the posterior doesn't favour it.
+ */
+void Optimiser::prepare_soft_groups() {
+    soft_groups.resize(nGroups);
+    auto weight = [this](double prob) { return std::max(1, static_cast<int>(std::lround(prob * soft.resolution))); };
+    auto prob = [this](int i, int g) { return sparse ? sparse->get(i, g) : vtab->get(i, g); };
+    for (int g = 0; g < nGroups; ++g) {
+        SoftGroup& group = soft_groups[g];
+        group.loci = indexmap[g];
+        group.members = group.loci.size();
+        group.weights.clear();
+        for (int i : group.loci) group.weights.push_back(weight(prob(i, g)));
+    }
+    auto add = [&](int i, int g, double p) {
+        if (g == assignment[i] || p < soft.cutoff) return;
+        soft_groups[g].loci.push_back(i);
+        soft_groups[g].weights.push_back(weight(p));
+    };
+    for (int i = 0; i < nLoci; ++i) {
+        if (sparse) {
+            for (const auto& entry : sparse->row(i)) add(i, entry.group, entry.prob);
+        }
+        else {
+            for (int g = 0; g < nGroups; ++g) add(i, g, vtab->get(i, g));
+        }
+    }
+}
+
+void Optimiser::mStep() {
+    PerfPhaseScope perf(PerfPhase::M_STEP);
+    if (scorer == Scorer::NATIVE && locus_data.empty()) load_locus_data();
+    bool weighted = soft.enabled && have_posterior;
+    objective_changed = (weighted != weighted_mstep);
+    weighted_mstep = weighted;
+    if (objective_changed) best = EMState(); // Likelihoods of the two objectives aren't comparable
+    if (weighted) prepare_soft_groups();
+    plan_memory();
+    if (live) live->groups_done.store(0, std::memory_order_relaxed);
     // Update phylogenetic parameters
     for (int g = 0; g < nGroups; ++g) {
         // TODO: Don't recalculate if a group hasn't changed
-        al = utils::parse_alignment_file(alignment);
-        std::string qstring = qs[g]->str();
-        q = utils::parse_partitions(qstring.c_str());
-        PLLUPtr pll = std::make_unique<PLL>(*attr, q.get(), al.get());
-
-        // Load current parameter estimates, if we have any yet (which we don't on first iteration)
-        if (have_parameters) {
-            bool opt = (schedule == Schedule::PARAM_SEARCH || schedule == Schedule::FULL_SEARCH);
-            for (int wgi = 0; wgi < indexmap[g].size(); ++wgi) {  // wgi = within group index; wdi = within dataset index
-                int wdi = indexmap[g][wgi];
-                pll->set_alpha(parameters[wdi].alpha, wgi, opt);
-                pll->set_frequencies(parameters[wdi].freqs, wgi, opt);
-                pll->set_rates(parameters[wdi].rates, wgi, opt);
+        trees[g].changed = false;
+        if (indexmap[g].empty()) continue; // Empty group keeps its last tree
+        if (budget->expired()) {
+            interrupted = true;
+            return;
+        }
+        double gain = optimise_group(g, weighted);
+        update_schedule(g, gain);
+        if (live) live->groups_done.fetch_add(1, std::memory_order_relaxed);
+    };
+    have_parameters = true;
+
+    // Update assignment probabilities
+    update_proportions();
+    update_likelihood();
+    save_best();
+}
+
+// Summed in a fixed order so convergence checks don't depend on how the groups were scheduled
+void Optimiser::update_likelihood() {
+    ArenaVector<double> group_lnls{ArenaAllocator<double>(iteration_arena)};
+    group_lnls.reserve(trees.size());
+    for (auto& tree: trees) {
+        group_lnls.push_back(tree.likelihood);
+    }
+    likelihood = reduce::pairwise_sum(group_lnls);
+}
+
+namespace {
+    // Thrown inside E-step cell tasks to skip the cell once the budget has expired
+    struct Interrupted {};
+}
+
+/*
+ * M-step and E-step as a single task graph. Scoring locus i against group j needs the new tree for j and the new
+ * parameters for locus i, which come from the M-step of the group i is assigned to. Whichever of the two groups
+ * finishes last releases the block of cells (loci of one, tree of the other), so every cell is scored exactly once
+ * and as early as possible. Posterior normalisation runs once the last cell is in.
+ */
+void Optimiser::pipelinedStep() {
+    PerfPhaseScope perf(PerfPhase::PIPELINED);
+    make_pool();
+    objective_changed = weighted_mstep; // Groups optimise concurrently here, so the M-step is always hard
+    weighted_mstep = false;
+    if (objective_changed) best = EMState();
+
+    // Proportions depend only on the assignment, so the E-step priors are known before any tree is
+    update_proportions();
+    prepare_candidates();
+    std::atomic<long> scored(0);
+    locus_plls.clear();
+    locus_plls.resize(nLoci);
+    if (scorer == Scorer::NATIVE && locus_data.empty()) load_locus_data();
+    if (locus_mutexes.size() != nLoci) locus_mutexes = std::vector<std::mutex>(nLoci);
+    plan_memory();
+
+    std::mutex graph_mutex;
+    std::vector<int> finished;
+    std::exception_ptr error;
+    long remaining = static_cast<long>(nLoci) * nGroups; // Guarded by graph_mutex
+    std::condition_variable all_scored;
+    if (live) {
+        live->groups_done.store(0, std::memory_order_relaxed);
+        live->cells_done.store(0, std::memory_order_relaxed);
+        live->cells_total.store(remaining, std::memory_order_relaxed);
+    }
+    std::atomic_bool groups_skipped(false);
+
+    auto record_error = [&]() {
+        std::lock_guard<std::mutex> lock(graph_mutex);
+        if (!error) error = std::current_exception();
+    };
+
+    auto score = [&](int i, int j) {
+        PerfPhaseTag perf_phase(PerfPhase::PIPELINED);
+        try {
+            std::lock_guard<std::mutex> lock(locus_mutexes[i]);
+            if (budget->expired()) throw Interrupted();
+            bool candidate = !use_candidates || trees[j].changed ||
+                             std::binary_search(candidates[i].begin(), candidates[i].end(), j);
+            if (candidate) {
+                if (scorer == Scorer::NATIVE) {
+                    vtab->set(i, j, score_cell(load_locus_scorer(i), j));
+                }
+                else {
+                    if (!locus_plls[i]) locus_plls[i] = make_locus_pll(i);
+                    vtab->set(i, j, score_cell(*locus_plls[i], j));
+                }
+                ++scored;
+            }
+            else {
+                vtab->set(i, j, UNLIKELY);
             }
-            pll->set_tree(trees[g].tree);
         }
+        catch (const Interrupted&) {
+            interrupted = true;
+        }
+        catch (...) {
+            record_error();
+        }
+        if (live) live->cells_done.fetch_add(1, std::memory_order_relaxed);
+        // Counted and notified under the lock, so the waiter can't return (and destroy this frame) before the last
+        // cell is done with it
+        std::lock_guard<std::mutex> lock(graph_mutex);
+        if (--remaining == 0) all_scored.notify_all();
+    };
 
-        // Optimise
-        auto result = doOpt(std::move(pll), schedule);
+    // Loci of group g against the tree of group h
+    auto release_block = [&](int g, int h) {
+        for (int i : indexmap[g]) {
+            pool->submit([&score, i, h]() { score(i, h); });
+        }
+    };
 
-        // Save parameters
-        for (int i=0; i < result.locus_params.size(); ++i) {
-            index = indexmap[g][i];
-            parameters[index] = result.locus_params[i];
+    // Group fits run at most the memory plan's concurrency at a time, each submitting the next as it finishes, so
+    // no pool worker is parked on the memory gate while cells are waiting to be scored
+    std::vector<std::future<void>> group_tasks;    // Guarded by graph_mutex; grows while the graph runs
+    std::atomic<int> next_group(0);
+    std::function<void()> launch_group;
+    auto fit_group_task = [&](int g) {
+        PerfPhaseTag perf_phase(PerfPhase::PIPELINED);
+        double gain = 0;
+        bool optimised = false;
+        try {
+            trees[g].changed = false;
+            if (!indexmap[g].empty()) {
+                if (budget->expired()) {
+                    groups_skipped = true;
+                    interrupted = true;
+                }
+                else {
+                    gain = optimise_group(g);
+                    optimised = true;
+                }
+            }
         }
-        trees[g].tree = result.tree;
-        trees[g].likelihood = result.likelihood;
+        catch (...) {
+            record_error();
+        }
+
+        std::vector<int> ready;
+        {
+            std::lock_guard<std::mutex> lock(graph_mutex);
+            if (optimised) update_schedule(g, gain);
+            finished.push_back(g);
+            if (live) live->groups_done.fetch_add(1, std::memory_order_relaxed);
+            ready = finished;
+        }
+        for (int h : ready) {
+            release_block(g, h);
+            if (h != g) release_block(h, g);
+        }
+        launch_group();
     };
-    have_parameters = true;
+    launch_group = [&]() {
+        int g = next_group++;
+        if (g >= nGroups) return;
+        std::lock_guard<std::mutex> lock(graph_mutex);
+        group_tasks.push_back(pool->submit([&fit_group_task, g]() { fit_group_task(g); }));
+    };
+    int concurrency = memory_policy.budget_bytes ? std::max(1u, group_plan.concurrency) : nGroups;
+    for (int t = 0; t < concurrency; ++t) launch_group();
 
-    // Update assignment probabilities
-    proportions = get_proportions();
+    {
+        std::unique_lock<std::mutex> lock(graph_mutex);
+        all_scored.wait(lock, [&remaining]() { return remaining == 0; });
+    }
+    // Releasing tasks may still hold references to this frame. A task submits its successor before it returns, so
+    // waiting on them in order sees every one.
+    for (size_t t = 0;; ++t) {
+        std::future<void> task;
+        {
+            std::lock_guard<std::mutex> lock(graph_mutex);
+            if (t == group_tasks.size()) break;
+            task = std::move(group_tasks[t]);
+        }
+        task.get();
+    }
+    locus_plls.clear();
+    if (error) std::rethrow_exception(error);
 
-    for (auto& tree: trees) {
-        lnl += tree.likelihood;
+    have_parameters = true;
+    update_likelihood();
+    if (!groups_skipped) save_best();
+    estep_stats.back().skipped = estep_stats.back().cells - scored;
+    if (!interrupted) {
+        make_probability_table();
+        have_posterior = true;
     }
-    likelihood = lnl;
 }
 
-pllresult Optimiser::doOpt(PLLUPtr&& pll, Schedule schedule) {
+pllresult Optimiser::doOpt(PLLUPtr&& pll, Schedule schedule, const std::vector<int>& loci) {
+    OptimiseTrace trace;
     switch(schedule) {
         case Schedule::NO_SEARCH:
-            pll->optimise(false, false, false, true, EPS, false);
+            trace = pll->optimise(false, false, false, true, EPS, false, budget.get());
             break;
         case Schedule::PARAM_SEARCH:
-            pll->optimise(true, true, true, true, EPS, false);
+            trace = pll->optimise(true, true, true, true, EPS, false, budget.get());
             break;
         case Schedule::TREE_SEARCH:
-            pll->tree_search(false);
+            pll->tree_search(false, budget.get());
             break;
         case Schedule::FULL_SEARCH:
-            pll->tree_search(true);
+            pll->tree_search(true, budget.get());
             break;
     }
-    return get_parameters(std::move(pll));
+    auto result = get_parameters(std::move(pll), loci);
+    result.trace = std::move(trace);
+    return result;
 }
 
 
@@ -186,37 +837,813 @@ void Optimiser::set_assignment(const std::vector<int>& a) {
     nGroups = get_number_of_groups(a);
     trees.clear();
     trees.resize(nGroups);
+    native_trees.assign(nGroups, nullptr);
+    group_schedules.assign(nGroups, schedule);
+    churn.assign(nGroups, 1.0);
+    schedule_events.clear();
+    group_events.clear();
+    max_groups = nGroups;
+    iteration = 0;
+    weighted_mstep = false;
+    objective_changed = false;
+    best = EMState();
+    have_posterior = false;
+    estep_stats.clear();
+    memory_stats.clear();
     assignment = a;
     index(a);
-    set_qs(a);
-    vtab = std::make_unique<ValueTable>(nLoci, nGroups);
+    allocate_posterior();
+}
+
+// The dense table is only needed for dense mode, or as scratch space when pipelined cells arrive out of order.
+// Existing tables of the right shape are kept: every cell is written before it is read.
+void Optimiser::allocate_posterior() {
+    if (posterior == Posterior::DENSE || execution == Execution::PIPELINED) {
+        if (!vtab || vtab->nrows() != nLoci || vtab->ncols() != nGroups) {
+            vtab = std::make_unique<ValueTable>(nLoci, nGroups);
+        }
+    }
+    else {
+        vtab.reset();
+    }
+    if (posterior == Posterior::SPARSE) {
+        if (!sparse || sparse->ncols() != nGroups || sparse->get_tolerance() != posterior_tolerance) {
+            sparse = std::make_unique<SparsePosterior>(nGroups, posterior_tolerance);
+            sparse->reserve(nLoci);
+        }
+        sparse->clear();
+    }
+    else {
+        sparse.reset();
+    }
+}
+
+void Optimiser::set_posterior(Posterior posterior, double tolerance) {
+    this->posterior = posterior;
+    posterior_tolerance = tolerance;
+    if (nGroups > 0) allocate_posterior();
+}
+
+// Reassign loci without discarding the current trees and parameters, and measure how much each group changed
+void Optimiser::update_assignment(const std::vector<int>& a) {
+    ArenaVector<unsigned> moved(nGroups, 0, ArenaAllocator<unsigned>(iteration_arena));
+    for (int i=0; i < nLoci; ++i) {
+        if (a[i] != assignment[i]) {
+            ++moved[assignment[i]];
+            ++moved[a[i]];
+        }
+    }
+    ArenaVector<unsigned> sizes(nGroups, ArenaAllocator<unsigned>(iteration_arena));
+    reduce::histogram(a, nGroups, sizes.begin());
+    for (int g=0; g < nGroups; ++g) {
+        churn[g] = static_cast<double>(moved[g]) / std::max(1u, sizes[g]);
+    }
+    assignment = a;
+    index(a);
+}
+
+void Optimiser::set_execution(Execution execution, unsigned nthreads) {
+    this->execution = execution;
+    if (nthreads != this->nthreads) pool.reset();
+    this->nthreads = nthreads;
+    if (nGroups > 0) allocate_posterior();
+}
+
+void Optimiser::set_scorer(Scorer scorer) {
+    this->scorer = scorer;
+    refresh_native_trees();
+}
+
+void Optimiser::set_schedule(Schedule schedule, SchedulePolicy policy) {
+    this->schedule = schedule;
+    this->policy = policy;
+    group_schedules.assign(nGroups, schedule);
+}
+
+// Move group g one step up NO_SEARCH -> PARAM_SEARCH -> TREE_SEARCH -> FULL_SEARCH once its membership has
+// settled and the cheaper schedule has stopped paying off
+void Optimiser::update_schedule(int g, double gain) {
+    if (!policy.adaptive) return;
+    Schedule from = group_schedules[g];
+    if (from == Schedule::FULL_SEARCH) return;
+    if (churn[g] > policy.churn_threshold || gain >= policy.gain_threshold) return;
+
+    Schedule to = static_cast<Schedule>(static_cast<int>(from) + 1);
+    group_schedules[g] = to;
+    schedule_events.push_back(ScheduleEvent{iteration, g, from, to, churn[g], gain, trees[g].seconds});
+}
+
+// Log likelihood of each of loci under each of groups' trees, loci-major; UNLIKELY for groups without a tree
+void Optimiser::score_loci(const std::vector<int>& loci, const std::vector<int>& groups, std::vector<double>& lnls) {
+    size_t n = groups.size();
+    lnls.assign(loci.size() * n, UNLIKELY);
+    for (size_t a = 0; a < loci.size(); ++a) {
+        int i = loci[a];
+        if (scorer == Scorer::NATIVE) {
+            LocusScorer& engine = load_locus_scorer(i);
+            for (size_t b = 0; b < n; ++b) {
+                if (!trees[groups[b]].tree.empty()) lnls[a * n + b] = tree_lnl(engine, groups[b]);
+            }
+        }
+        else {
+            PLLUPtr pll = make_locus_pll(i);
+            for (size_t b = 0; b < n; ++b) {
+                if (!trees[groups[b]].tree.empty()) lnls[a * n + b] = tree_lnl(*pll, groups[b]);
+            }
+        }
+    }
+}
+
+void Optimiser::propose_group_moves() {
+    if (scorer == Scorer::NATIVE && locus_data.empty()) load_locus_data();
+    merge_groups();
+    remove_empty_groups();
+    if (moves.split && nGroups < max_groups) split_group();
+}
+
+/*
+ * Merge duplicate groups (smaller into larger, closest trees first), then undersized groups (into whichever group
+ * fits their loci best). A merge is kept if it loses at most merge_tolerance lnL per moved locus, and each group
+ * takes part in at most one merge per round. Merged groups are left empty; returns how many there were.
+ */
+int Optimiser::merge_groups() {
+    int ntaxa = dataset->ntaxa();
+    std::vector<std::unique_ptr<SplitSet>> splits(nGroups);
+    for (int g=0; g < nGroups; ++g) {
+        if (indexmap[g].empty() || trees[g].tree.empty()) continue;
+        splits[g] = std::make_unique<SplitSet>(NativeTree(trees[g].tree, dataset->taxa()), ntaxa);
+    }
+
+    std::vector<std::tuple<double, int, int>> duplicates;   // (branch score, from, into)
+    for (int g=0; g < nGroups; ++g) {
+        for (int h=g+1; h < nGroups; ++h) {
+            if (!splits[g] || !splits[h]) continue;
+            if (splits[g]->rf_distance(*splits[h]) > moves.max_rf) continue;
+            double score = splits[g]->branch_score(*splits[h]);
+            if (score > moves.max_branch_score) continue;
+            bool g_smaller = indexmap[g].size() < indexmap[h].size();
+            duplicates.emplace_back(score, g_smaller ? g : h, g_smaller ? h : g);
+        }
+    }
+    std::sort(duplicates.begin(), duplicates.end());
+
+    std::vector<std::pair<int, int>> proposals;     // (from, into), into < 0 to pick the best fitting group
+    for (const auto& d : duplicates) proposals.emplace_back(std::get<1>(d), std::get<2>(d));
+    for (int g=0; g < nGroups; ++g) {
+        if (!indexmap[g].empty() && indexmap[g].size() < moves.min_group_size && splits[g]) {
+            proposals.emplace_back(g, -1);
+        }
+    }
+
+    std::vector<bool> touched(nGroups, false);
+    std::vector<int> targets;
+    std::vector<double> lnls;
+    int merged = 0;
+    for (const auto& proposal : proposals) {
+        int from = proposal.first;
+        if (touched[from] || (proposal.second >= 0 && touched[proposal.second])) continue;
+        targets.assign(1, from);
+        if (proposal.second >= 0) {
+            targets.push_back(proposal.second);
+        }
+        else {
+            for (int h=0; h < nGroups; ++h) {
+                if (h != from && !touched[h] && !indexmap[h].empty() && splits[h]) targets.push_back(h);
+            }
+        }
+        if (targets.size() < 2) continue;
+
+        const auto& loci = indexmap[from];
+        score_loci(loci, targets, lnls);
+        size_t n = targets.size();
+        std::vector<double> totals(n, 0.0);
+        for (size_t a = 0; a < loci.size(); ++a) {
+            for (size_t b = 0; b < n; ++b) totals[b] += lnls[a * n + b];
+        }
+        size_t best_target = std::max_element(totals.begin() + 1, totals.end()) - totals.begin();
+        double gain = totals[best_target] - totals[0];
+        if (gain < -moves.merge_tolerance * loci.size()) continue;
+
+        int into = targets[best_target];
+        group_events.push_back(GroupEvent{iteration, GroupMove::MERGE, from, into,
+                                          static_cast<unsigned>(loci.size()), gain});
+        trees[into].likelihood += totals[best_target];
+        trees[into].changed = true;
+        churn[into] = 1.0;
+        for (int i : loci) assignment[i] = into;
+        touched[from] = touched[into] = true;
+        ++merged;
+    }
+    if (merged) index(assignment);
+    return merged;
+}
+
+// Drop groups without loci, renumbering the others in order
+void Optimiser::remove_empty_groups() {
+    std::vector<int> renumber(nGroups, -1);
+    int kept = 0;
+    for (int g=0; g < nGroups; ++g) {
+        if (!indexmap[g].empty()) renumber[g] = kept++;
+    }
+    if (kept == nGroups || kept == 0) return;
+
+    for (int g=0; g < nGroups; ++g) {
+        int to = renumber[g];
+        if (to < 0) {
+            bool merged = std::any_of(group_events.begin(), group_events.end(), [&](const GroupEvent& ev) {
+                return ev.iteration == iteration && ev.move == GroupMove::MERGE && ev.group == g;
+            });
+            if (!merged) group_events.push_back(GroupEvent{iteration, GroupMove::DROP, g, -1, 0, 0});
+            continue;
+        }
+        if (to == g) continue;
+        trees[to] = std::move(trees[g]);
+        native_trees[to] = std::move(native_trees[g]);
+        group_schedules[to] = group_schedules[g];
+        churn[to] = churn[g];
+    }
+    trees.resize(kept);
+    native_trees.resize(kept);
+    group_schedules.resize(kept);
+    churn.resize(kept);
+    for (int& a : assignment) a = renumber[a];
+    nGroups = kept;
+    index(assignment);
+    groups_changed();
+}
+
+/*
+ * Split the loci with the worst per-site fit off the group that fits its loci worst, into a new group with its own
+ * tree search. The split is kept if the new tree beats the likelihood those loci had by split_gain; the loci left
+ * behind are credited with their old likelihood until the next M-step. Costs one group optimisation either way.
+ */
+bool Optimiser::split_group() {
+    const size_t min_side = 2;
+    int worst = -1;
+    double worst_fit = 0;
+    for (int g=0; g < nGroups; ++g) {
+        if (indexmap[g].size() < 2 * min_side || trees[g].tree.empty()) continue;
+        double lnl = 0;
+        long sites = 0;
+        for (int i : indexmap[g]) {
+            lnl += parameters.likelihood(i);
+            sites += dataset->partitions()[i].sites();
+        }
+        double fit = lnl / std::max(1L, sites);
+        if (worst < 0 || fit < worst_fit) {
+            worst = g;
+            worst_fit = fit;
+        }
+    }
+    if (worst < 0 || !budget->can_afford(trees[worst].seconds)) return false;
+
+    std::vector<std::pair<double, int>> fits;
+    for (int i : indexmap[worst]) {
+        fits.emplace_back(parameters.likelihood(i) / std::max(1, dataset->partitions()[i].sites()), i);
+    }
+    std::sort(fits.begin(), fits.end());
+    fits.resize(fits.size() / 2);
+
+    ParameterStore saved = parameters;
+    std::vector<int> previous = assignment;
+    int k = nGroups;
+    double before = 0;
+    for (const auto& f : fits) {
+        assignment[f.second] = k;
+        before += saved.likelihood(f.second);
+    }
+    ++nGroups;
+    trees.emplace_back();
+    native_trees.push_back(nullptr);
+    group_schedules.push_back(group_schedules[worst] == Schedule::FULL_SEARCH ? Schedule::FULL_SEARCH
+                                                                              : Schedule::TREE_SEARCH);
+    churn.push_back(1.0);
+    index(assignment);
+
+    auto revert = [&]() {
+        parameters.assign(saved);
+        assignment = previous;
+        --nGroups;
+        trees.pop_back();
+        native_trees.pop_back();
+        group_schedules.pop_back();
+        churn.pop_back();
+        index(assignment);
+    };
+    try {
+        optimise_group(k);
+    }
+    catch (...) {
+        revert();
+        throw;
+    }
+    double gain = trees[k].likelihood - before;
+    if (gain < moves.split_gain || budget->expired()) {
+        revert();
+        return false;
+    }
+
+    trees[worst].likelihood -= before;
+    trees[worst].changed = true;
+    churn[worst] = 1.0;
+    group_events.push_back(GroupEvent{iteration, GroupMove::SPLIT, worst, k, static_cast<unsigned>(fits.size()),
+                                      gain});
+    groups_changed();
+    return true;
+}
+
+// After the number of groups changes: the posterior no longer matches, so the next E-step scores every cell
+void Optimiser::groups_changed() {
+    allocate_posterior();
+    have_posterior = false;
+    update_proportions();
+    update_likelihood();
+}
+
+// Returns false if the budget expired before the iteration completed, in which case the assignment is left as is
+bool Optimiser::doIteration() {
+    auto start = std::chrono::steady_clock::now();
+    interrupted = false;
+    iteration_arena.reset();
+    unsigned long allocations = heap_allocations();
+    switch (execution) {
+        case Execution::BARRIER: {
+            bool exact = begin_phase();
+            report_phase(StatusPhase::M_STEP);
+            mStep();
+            end_phase("M-step", exact);
+            if (!interrupted) {
+                exact = begin_phase();
+                report_phase(StatusPhase::E_STEP);
+                eStep();
+                end_phase("E-step", exact);
+            }
+            break;
+        }
+        case Execution::PIPELINED: {
+            bool exact = begin_phase();
+            report_phase(StatusPhase::PIPELINED);
+            pipelinedStep();
+            end_phase("pipelined", exact);
+            break;
+        }
+    }
+    if (interrupted) {
+        report_phase(StatusPhase::IDLE);
+        return false;
+    }
+    report_phase(StatusPhase::C_STEP);
+    cStep();
+    if (moves.enabled && (moves.interval <= 1 || iteration % moves.interval == 0)) {
+        report_phase(StatusPhase::GROUP_MOVES);
+        propose_group_moves();
+    }
+    if (!estep_stats.empty() && estep_stats.back().iteration == iteration) {
+        estep_stats.back().allocations = heap_allocations() - allocations;
+    }
+    ++iteration;
+    report_phase(StatusPhase::IDLE);
+    if (writer) {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        write_record("iteration", elapsed.count());
+    }
+    return true;
+}
+
+// Snapshot of the current state for the writer, which formats it on its own thread. The record's iteration is the
+// number of iterations completed.
+void Optimiser::write_record(const char* kind, double seconds) {
+    const WriterPolicy& out = writer->get_policy();
+    RunRecord record;
+    record.kind = kind;
+    record.restart = restart;
+    record.iteration = iteration;
+    auto value = [](double lnl) { return lnl == UNLIKELY ? std::nan("") : lnl; }; // Written as null
+    record.likelihood = value(likelihood);
+    record.seconds = seconds;
+    record.elapsed = budget->elapsed();
+    record.assignment = assignment;
+    record.proportions = proportions;
+    for (const auto& tree : trees) {
+        record.tree_likelihoods.push_back(value(tree.likelihood));
+        if (out.trees) record.trees.push_back(tree.tree);
+    }
+    if (out.posterior && have_posterior && (sparse || vtab)) {
+        QuantisedPosterior& q = record.posterior;
+        q.row_start.reserve(nLoci + 1);
+        q.row_start.push_back(0);
+        auto add = [&](unsigned j, double p) {
+            if (p < out.posterior_threshold) return;
+            q.groups.push_back(j);
+            q.levels.push_back(static_cast<uint16_t>(std::lround(std::min(1.0, p) * 65535)));
+        };
+        for (int i = 0; i < nLoci; ++i) {
+            if (sparse) {
+                for (const auto& entry : sparse->row(i)) add(entry.group, entry.prob);
+            }
+            else {
+                for (int j = 0; j < nGroups; ++j) add(j, vtab->get(i, j));
+            }
+            q.row_start.push_back(static_cast<uint32_t>(q.groups.size()));
+        }
+        record.has_posterior = true;
+    }
+    writer->write(std::move(record));
+}
+
+void Optimiser::set_memory_policy(MemoryPolicy policy) {
+    memory_policy = policy;
+    group_plan = MemoryPlan();
+    locus_modes.clear();
+    memory_gate.reset();
+    if (policy.budget_bytes == 0) return;
+    memory_gate = std::make_unique<MemoryGate>(policy.budget_bytes);
+}
+
+/*
+ * Choose each instance's mode for the coming iteration. Barrier execution optimises one group at a time, so every
+ * group instance may use the whole budget; pipelined execution wants one per thread. The gate enforces the budget
+ * on group instances whatever the plan, by holding back those that would exceed it. Single-locus instances (PLL
+ * scorer only) are planned one per thread but not gated, since the pipelined step keeps them for the whole
+ * iteration.
+ */
+void Optimiser::plan_memory() {
+    if (memory_policy.budget_bytes == 0) return;
+    const auto& locus_shapes = dataset->locus_shapes();
+    std::vector<int> single(1);
+    std::vector<std::array<size_t, 4>> footprints(nLoci);
+    for (int i=0; i < nLoci; ++i) {
+        single[0] = i;
+        for (int m=0; m < 4; ++m) {
+            footprints[i][m] = clv_bytes(locus_shapes, single, static_cast<InstanceMode>(m),
+                                         memory_policy.recom_fraction);
+        }
+    }
+    locus_modes = plan_instances(footprints, memory_policy.budget_bytes, nthreads).modes;
+
+    footprints.assign(nGroups, std::array<size_t, 4>());
+    for (int g=0; g < nGroups; ++g) {
+        const auto& loci = weighted_mstep ? soft_groups[g].loci : indexmap[g];
+        for (int m=0; m < 4; ++m) {
+            footprints[g][m] = clv_bytes(locus_shapes, loci, static_cast<InstanceMode>(m),
+                                         memory_policy.recom_fraction);
+        }
+    }
+    unsigned concurrency = (execution == Execution::PIPELINED) ? nthreads : 1;
+    group_plan = plan_instances(footprints, memory_policy.budget_bytes, concurrency);
+}
+
+bool Optimiser::begin_phase() {
+    return memory_policy.report_rss && reset_peak_resident();
+}
+
+void Optimiser::end_phase(const char* phase, bool exact) {
+    if (!memory_policy.report_rss) return;
+    memory_stats.push_back(PhaseMemory{iteration, phase, peak_resident_bytes(), exact});
+}
+
+void Optimiser::make_pool() {
+    if (pool) return;
+    pool = std::make_unique<work_stealing_thread_pool>(nthreads);
+    if (live) pool->set_counters(&live->pool);
+}
+
+void Optimiser::set_status(std::shared_ptr<StatusBoard> status) {
+    if (pool) pool->set_counters(status ? &status->get().pool : nullptr);
+    this->status = status;
+    live = status ? &status->get() : nullptr;
+    report_phase(StatusPhase::IDLE);
+}
+
+// Phase boundaries are where the slower-moving fields (iteration, likelihood, RSS) are refreshed
+void Optimiser::report_phase(StatusPhase phase) {
+    if (!live) return;
+    live->restart.store(restart, std::memory_order_relaxed);
+    live->iteration.store(iteration, std::memory_order_relaxed);
+    live->groups.store(nGroups, std::memory_order_relaxed);
+    live->likelihood_bits.store(LiveStatus::bits(likelihood), std::memory_order_relaxed);
+    live->rss_bytes.store(resident_bytes(), std::memory_order_relaxed);
+    live->set_phase(phase);
+}
+
+// Iterate until the likelihood stops improving, without stopping on an iteration that escalated a group's schedule.
+// If the budget runs out, the best state reached so far is loaded before returning.
+RunResult Optimiser::run(int max_iterations, double tolerance) {
+    auto started = std::chrono::steady_clock::now();
+    RunResult result;
+    double prev = UNLIKELY;
+    for (int i = 0; i < max_iterations; ++i) {
+        if (budget->expired()) {
+            result.out_of_budget = true;
+            break;
+        }
+        size_t events_before = schedule_events.size();
+        size_t moves_before = group_events.size();
+        if (!doIteration()) {
+            result.out_of_budget = true;
+            break;
+        }
+        result.iterations = i + 1;
+        bool escalated = schedule_events.size() > events_before || group_events.size() > moves_before ||
+                         objective_changed;
+        if (likelihood - prev < tolerance && !escalated) {
+            result.converged = true;
+            break;
+        }
+        prev = likelihood;
+    }
+    if (result.out_of_budget && best.likelihood > UNLIKELY) restore(best);
+    if (writer && !restarting) {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+        write_record("final", elapsed.count());
+    }
+    result.headroom = budget->remaining();
+    result.likelihood = likelihood;
+    return result;
+}
+
+// Independent runs from random assignments, keeping the best. Stops starting new restarts once the budget expires.
+RunResult Optimiser::run_restarts(int restarts, int nGroups, int max_iterations, double tolerance) {
+    RunResult result;
+    EMState overall;
+    auto started = std::chrono::steady_clock::now();
+    for (int r = 0; r < restarts && !budget->expired(); ++r) {
+        auto restart_start = std::chrono::steady_clock::now();
+        restart = r;
+        set_assignment(nGroups);
+        restarting = true;
+        RunResult run_result = run(max_iterations, tolerance);
+        restarting = false;
+        if (writer) {
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - restart_start;
+            write_record("restart", elapsed.count());
+        }
+        result.iterations += run_result.iterations;
+        if (!run_result.out_of_budget) result.restarts++;
+        if (best.likelihood > overall.likelihood) {
+            overall = best;
+            result.converged = run_result.converged;
+        }
+    }
+    result.out_of_budget = budget->expired();
+    if (overall.likelihood > UNLIKELY) restore(overall);
+    if (writer) {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+        write_record("final", elapsed.count());
+    }
+    result.headroom = budget->remaining();
+    result.likelihood = likelihood;
+    return result;
+}
+
+/*
+ * One mini-batch step. The batch is the next batch_size loci of a shuffled order, reshuffled once too few are left
+ * for a whole batch. Each group's tree is refitted to its loci in the batch, from its current tree, and its branch
+ * lengths are then moved only the step size of the way from the old tree to the fit. The batch's parameters are
+ * those of the fit: they belong to the batch's loci alone, so there is nothing to damp.
+ */
+void Optimiser::online_step(const OnlinePolicy& online, int t) {
+    auto start = std::chrono::steady_clock::now();
+    double eta = std::min(1.0, online.step0 * std::pow(t + online.offset, -online.decay));
+    size_t batch_size = std::min<size_t>(std::max(1u, online.batch_size), nLoci);
+    if (online_next + batch_size > online_order.size()) {
+        std::shuffle(online_order.begin(), online_order.end(), rng);
+        online_next = 0;
+    }
+    batch_groups.resize(nGroups);
+    for (auto& loci : batch_groups) loci.clear();
+    for (size_t b = 0; b < batch_size; ++b) {
+        int i = online_order[online_next++];
+        batch_groups[assignment[i]].push_back(i);
+    }
+
+    // Partial M-step
+    const auto& labels = dataset->taxon_labels();
+    std::vector<int> batch;
+    for (int g = 0; g < nGroups; ++g) {
+        auto& loci = batch_groups[g];
+        if (loci.empty()) continue;
+        if (budget->expired()) {
+            interrupted = true;
+            return;
+        }
+        std::sort(loci.begin(), loci.end());
+        batch.insert(batch.end(), loci.begin(), loci.end());
+        auto result = fit_group(g, loci, affordable_schedule(g));
+        if (!trees[g].tree.empty() && eta < 1) {
+            NativeTree from, to;
+            from.parse(trees[g].tree, dataset->taxa());
+            to.parse(result.tree, dataset->taxa());
+            result.tree = blend_branch_lengths(from, to, eta, dataset->ntaxa(), labels);
+        }
+        trees[g].tree = result.tree;
+        trees[g].changed = true;
+        update_native_tree(g);
+    }
+    have_parameters = true;
+
+    // Partial E- and C-step: the batch's loci move to their most probable group, and the proportions move the step
+    // size of the way to the batch's (with a pseudocount, so no group's prior reaches zero)
+    std::vector<int> groups(nGroups);
+    std::iota(groups.begin(), groups.end(), 0);
+    std::vector<double> lnls;
+    score_loci(batch, groups, lnls);
+    std::vector<int> a = assignment;
+    std::vector<unsigned> counts(nGroups, 0);
+    int reassigned = 0;
+    for (size_t k = 0; k < batch.size(); ++k) {
+        int i = batch[k];
+        double best_score = UNLIKELY;
+        for (int g = 0; g < nGroups; ++g) {
+            double lnl = lnls[k * nGroups + g];
+            if (lnl == UNLIKELY) continue;
+            double score = lnl + log(proportions[g]);
+            if (score > best_score) {
+                best_score = score;
+                a[i] = g;
+            }
+        }
+        if (a[i] != assignment[i]) ++reassigned;
+        ++counts[a[i]];
+    }
+    for (int g = 0; g < nGroups; ++g) {
+        double share = (counts[g] + 1) / static_cast<double>(batch.size() + nGroups);
+        proportions[g] = (1 - eta) * proportions[g] + eta * share;
+    }
+    update_assignment(a);
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    online_stats.push_back(OnlineStats{t, eta, static_cast<unsigned>(batch.size()), reassigned, false,
+                                       elapsed.count()});
+}
+
+// Mini-batch EM from the current assignment. Group likelihoods are only exact after a validation pass, so the run
+// converges, and best states are saved, on those alone.
+RunResult Optimiser::run_online(const OnlinePolicy& online) {
+    if (online.validation_interval < 1) throw std::invalid_argument("Validation interval must be at least 1");
+    RunResult result;
+    online_order.resize(nLoci);
+    std::iota(online_order.begin(), online_order.end(), 0);
+    online_next = nLoci; // Shuffle before the first batch
+    online_stats.clear();
+    if (scorer == Scorer::NATIVE && locus_data.empty()) load_locus_data();
+    update_proportions();
+
+    double prev = UNLIKELY;
+    for (int t = 0; t < online.max_steps; ++t) {
+        if (budget->expired()) {
+            result.out_of_budget = true;
+            break;
+        }
+        interrupted = false;
+        iteration_arena.reset();
+        report_phase(StatusPhase::ONLINE_STEP);
+        online_step(online, t);
+        report_phase(StatusPhase::IDLE);
+        if (interrupted) {
+            result.out_of_budget = true;
+            break;
+        }
+        if ((t + 1) % online.validation_interval != 0 && t + 1 < online.max_steps) continue;
+
+        auto start = std::chrono::steady_clock::now();
+        size_t events_before = schedule_events.size();
+        size_t moves_before = group_events.size();
+        if (!doIteration()) {
+            result.out_of_budget = true;
+            break;
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        online_stats.back().validation = true;
+        online_stats.back().seconds += elapsed.count();
+        result.iterations++;
+        bool escalated = schedule_events.size() > events_before || group_events.size() > moves_before ||
+                         objective_changed;
+        if (likelihood - prev < online.tolerance && !escalated) {
+            result.converged = true;
+            break;
+        }
+        prev = likelihood;
+    }
+    if (result.out_of_budget && best.likelihood > UNLIKELY) restore(best);
+    result.headroom = budget->remaining();
+    result.likelihood = likelihood;
+    return result;
+}
+
+// Remember the state after a complete M-step if it is the best so far
+void Optimiser::save_best() {
+    if (likelihood <= best.likelihood) return;
+    best.assignment = assignment;
+    best.trees = trees;
+    best.parameters.assign(parameters);
+    best.proportions = proportions;
+    best.likelihood = likelihood;
+    if (live) live->best_bits.store(LiveStatus::bits(likelihood), std::memory_order_relaxed);
+}
+
+void Optimiser::restore(const EMState& state) {
+    nGroups = state.trees.size();
+    trees = state.trees;
+    parameters.assign(state.parameters);
+    proportions = state.proportions;
+    likelihood = state.likelihood;
+    assignment = state.assignment;
+    index(assignment);
+    have_parameters = true;
+    have_posterior = false;
+    allocate_posterior();
+    if (group_schedules.size() != nGroups) group_schedules.assign(nGroups, schedule);
+    if (churn.size() != nGroups) churn.assign(nGroups, 1.0);
+    refresh_native_trees();
 }
 
 void Optimiser::set_assignment(int nGroups) {
     this->nGroups = nGroups;
-    auto a = make_random_assignment();
+    auto a = (seeding == Seeding::DISTANCE) ? make_distance_assignment() : make_random_assignment();
     set_assignment(a);
 }
 
-void Optimiser::set_qs(const std::vector<int>& a) {
-    qs.clear();
-    for (int i = 0; i < nGroups; ++i) {
-        qs.push_back(std::make_unique<std::stringstream>());
+// Write the parameters of the first loci.size() partitions of pll into the store, partition i being locus loci[i]
+pllresult Optimiser::get_parameters(PLLUPtr&& pll, const std::vector<int>& loci) {
+    int cap = std::min(pll->get_number_of_partitions(), static_cast<int>(loci.size()));
+    for (int i=0; i < cap; ++i) {
+        int locus = loci[i];
+        parameters.alpha(locus) = pll->get_alpha(i);
+        pll->get_frequencies(i, parameters.freqs(locus));
+        pll->get_rates(i, parameters.rates(locus));
+        parameters.likelihood(locus) = (*pll)[i]->partitionLH;
     }
-    for (int j = 0; j < a.size(); ++j) {
-        int group_index = a[j];
-        (*qs[group_index]) << partitions[j] << '\n';
+    return pllresult{pll->get_tree(), pll->get_likelihood(), OptimiseTrace()};
+};
+
+// Fit every locus on its own tree, from PLL's default parameters, as starting values for the group M-steps. Loci
+// are fitted concurrently on the pool; each writes only its own record of the parameter store. Returns false, and
+// leaves the parameters unset, if the budget expired before every locus was fitted.
+bool Optimiser::fit_loci(Schedule schedule) {
+    make_pool();
+    std::vector<std::future<void>> fits;
+    std::atomic<int> skipped(0);
+    for (int i=0; i < nLoci; ++i) {
+        fits.push_back(pool->submit([this, i, schedule, &skipped]() {
+            if (budget->expired()) {
+                ++skipped;  // Its record is still all zeros
+                return;
+            }
+            auto locus_al = utils::copy_alignment(dataset->alignment());
+            auto locus_q = dataset->partitions().make_queue(i);
+            PLLUPtr pll = std::make_unique<PLL>(*attr, locus_q.get(), locus_al.get());
+            doOpt(std::move(pll), schedule, std::vector<int>{i});
+        }));
     }
+    for (auto& fit : fits) fit.get();
+    have_parameters = (skipped == 0);
+    return have_parameters;
 }
 
-pllresult Optimiser::get_parameters(PLLUPtr&& pll) {
-    int cap = pll->get_number_of_partitions();
-    std::vector<perlocus> res(cap);
-    for (int i=0; i < cap; ++i) {
-        res[i].alpha = pll->get_alpha(i);
-        res[i].freqs = pll->get_frequencies(i);
-        res[i].rates = pll->get_rates(i);
-        res[i].likelihood = (*pll)[i]->partitionLH;
+// Start from parameters estimated elsewhere, e.g. another Optimiser's fit_loci on the same dataset
+void Optimiser::set_parameters(const ParameterStore& store) {
+    if (store.size() != nLoci) throw std::invalid_argument("Parameter store has the wrong number of loci");
+    parameters.assign(store);
+    have_parameters = true;
+}
+
+EMState Optimiser::get_state() {
+    EMState state;
+    state.assignment = assignment;
+    state.trees = trees;
+    state.parameters.assign(parameters);
+    state.proportions = proportions;
+    state.likelihood = likelihood;
+    return state;
+}
+
+// Start from another run's state, e.g. a point estimate on the data a bootstrap replicate resamples. Its trees and
+// parameters are kept, but its likelihoods belong to other data, so the first M-step sets them afresh.
+void Optimiser::warm_start(const EMState& state) {
+    if (state.assignment.size() != nLoci) throw std::invalid_argument("State has the wrong number of loci");
+    set_assignment(state.assignment);
+    restore(state);
+    for (auto& tree : trees) tree.likelihood = UNLIKELY;
+    likelihood = UNLIKELY;
+}
+
+// Largest absolute difference between the native and PLL log likelihoods over every (locus, group) cell with a tree
+double Optimiser::validate_scorer() {
+    if (locus_data.empty()) load_locus_data();
+    if (std::all_of(trees.begin(), trees.end(), [](const pergroup& t) { return t.tree.empty(); })) {
+        throw std::runtime_error("No fitted trees to validate the native scorer against");
     }
-    return pllresult{res, pll->get_tree(), pll->get_likelihood()};
-};
+    double max_diff = 0;
+    for (int i=0; i < nLoci; ++i) {
+        PLLUPtr pll = make_locus_pll(i);
+        LocusScorer& engine = load_locus_scorer(i);
+        for (int j=0; j < nGroups; ++j) {
+            if (trees[j].tree.empty()) continue;
+            pll->set_tree(trees[j].tree);
+            engine.set_tree(std::make_shared<const NativeTree>(trees[j].tree, dataset->taxa()));
+            max_diff = std::max(max_diff, std::abs(pll->get_likelihood() - engine.get_likelihood()));
+        }
+    }
+    return max_diff;
+}
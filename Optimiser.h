@@ -5,36 +5,50 @@
 #ifndef TREECL_EM_OPTIMISER_H
 #define TREECL_EM_OPTIMISER_H
 
+#include <atomic>
+#include <cstdint>
 #include <map>
+#include <mutex>
+#include <random>
 #include <string>
 #include <vector>
 #include <limits>
+#include "Arena.h"
+#include "Budget.h"
+#include "Dataset.h"
 #include "memory_management.h"
+#include "MemoryPlanner.h"
+#include "NativeLikelihood.h"
+#include "ParameterStore.h"
+#include "ParsimonyScreen.h"
+#include "PartitionTable.h"
+#include "PerfCounters.h"
 #include "PLL.h"
+#include "ResultCache.h"
+#include "ResultWriter.h"
+#include "SplitSet.h"
+#include "StatusBoard.h"
+#include "threadpool.h"
+#include "SparsePosterior.h"
 #include "utils.h"
 #include "ValueTable.h"
 
 const double UNLIKELY = std::numeric_limits<double>::lowest();
 
-// Parameters that belong to the locus
-struct perlocus {
-    double alpha;
-    std::vector<double> freqs;
-    std::vector<double> rates;
-    double likelihood;
-};
-
 //Parameters that belong to the group
 struct pergroup {
     std::string tree;
-    double likelihood;
+    double likelihood = UNLIKELY;
+    OptimiseTrace trace; // Per-block gains and timings from the group's last PLL::optimise
+    double seconds = 0;  // Wall-clock time of the group's last M-step
+    bool changed = true; // Topology or likelihood moved materially in the last M-step
 };
 
 //PLL result
 struct pllresult {
-    std::vector<perlocus> locus_params;
     std::string tree;
     double likelihood;
+    OptimiseTrace trace;
 };
 
 enum class Schedule {
@@ -44,56 +58,354 @@ enum class Schedule {
     FULL_SEARCH     // Optimise everything and do tree search
 }; // Optimisation schedule
 
+const char* schedule_name(Schedule schedule);
+Schedule parse_schedule(const std::string& name);  // Inverse of schedule_name
+
+// Thresholds controlling when a group's schedule escalates to the next, more expensive, level
+struct SchedulePolicy {
+    bool adaptive = true;           // If false, every group uses the initial schedule for the whole run
+    double churn_threshold = 0.05;  // Escalate only when at most this fraction of the group's loci moved...
+    double gain_threshold = 1.0;    // ...and the last M-step improved the group lnl by less than this
+};
+
+// E-step pruning: score each locus only against its most probable groups, plus any group that changed
+struct PruningPolicy {
+    bool enabled = false;
+    unsigned top_k = 2;             // Groups kept per locus from the previous posterior
+    int refresh_interval = 5;       // Every refresh_interval iterations, score every cell
+    double change_threshold = 0.5;  // A group's tree changed materially if its lnl moved more than this per locus
+};
+
+/*
+ * Collapsing of redundant groups: empty groups are dropped, and groups whose trees duplicate another's, or that hold
+ * too few loci, are merged into another group if that costs little likelihood. Slots freed this way, up to the
+ * number of groups the run started with, may be refilled by splitting off the worst fitting loci of a group.
+ */
+struct GroupMovePolicy {
+    bool enabled = false;
+    int interval = 1;               // Propose moves after every interval'th iteration
+    int max_rf = 0;                 // Trees at most this Robinson-Foulds distance apart...
+    double max_branch_score = 0.05; // ...and this branch score apart are duplicates
+    unsigned min_group_size = 2;    // Groups with fewer loci are merge candidates whatever their tree
+    double merge_tolerance = 0.5;   // Accept a merge losing at most this much lnL per moved locus
+    bool split = true;
+    double split_gain = 10.0;       // Accept a split improving the lnL by at least this much
+};
+
+/*
+ * Posterior-weighted M-step, for barrier execution. Each group is fitted to its own loci and to every other locus
+ * whose posterior probability of belonging to it is at least cutoff, each locus's sites weighted by that probability
+ * through PLL's integer site weights, at resolution weight units per unit of probability. A locus's parameters come
+ * from the fit of the group it is assigned to. Until there is a posterior (and after the groups change) the M-step
+ * is hard, as it always is in pipelined execution.
+ */
+struct SoftMStepPolicy {
+    bool enabled = false;
+    double cutoff = 0.05;
+    int resolution = 100;
+};
+
+enum class GroupMove {
+    MERGE,  // Loci of group moved into other; group removed
+    DROP,   // Empty group removed
+    SPLIT,  // Loci split off from group into a new group other
+};
+
+// Record of one accepted move. Group numbers are those before the move.
+struct GroupEvent {
+    int iteration;
+    GroupMove move;
+    int group;
+    int other;
+    unsigned loci;  // Loci moved
+    double gain;    // Change in lnL
+};
+
+struct EStepStats {
+    int iteration;
+    bool refresh;   // Every cell was scored
+    long cells;     // nLoci * nGroups
+    long skipped;   // Cells not scored exactly
+    int reassigned; // Loci whose assignment changed in the C-step that followed
+    long screened;  // Of the skipped cells, those rejected by the parsimony screen
+    unsigned long allocations = 0; // Heap allocations (operator new) during the whole iteration, if counted
+};
+
+// Peak resident memory of one phase of an iteration
+struct PhaseMemory {
+    int iteration;
+    const char* phase;  // "M-step", "E-step" or "pipelined"
+    size_t peak_rss;    // Bytes
+    bool exact;         // The peak was reset when the phase began; otherwise it is the peak since the process started
+};
+
+// Record of one escalation decision, kept so the thresholds can be tuned
+struct ScheduleEvent {
+    int iteration;
+    int group;
+    Schedule from;
+    Schedule to;
+    double churn;
+    double gain;
+    double seconds; // Wall-clock time of the M-step that triggered the decision
+};
+
 enum class Classifier {
     MAP,    // Assign to maximum aposteriori probability group
     IMPUTE, // Stochastic assignment due to posterior probability distribution
     ANNEAL, // Simulated annealing
 }; // Classification criterion
 
+enum class Execution {
+    BARRIER,    // M-step for every group, then E-step for every (locus, group) cell
+    PIPELINED,  // Single task graph: cells are scored as soon as the groups they depend on are optimised
+}; // Iteration execution mode
+
+enum class Seeding {
+    RANDOM,     // Uniform random labels, every group used at least once
+    DISTANCE,   // k-means++ on per-locus taxon distance matrices (Seeding.h)
+}; // How set_assignment(int) picks the initial assignment
+
+enum class Posterior {
+    DENSE,  // Full nLoci x nGroups table of probabilities (vtab)
+    SPARSE, // Per locus, only groups with probability above the tolerance (sparse)
+}; // Posterior representation
+
+enum class Scorer {
+    NATIVE, // Built-in pruning kernel with cached transition matrices (NativeLikelihood.h); check with validate_scorer
+    PLL,    // A single-locus PLL instance per locus
+}; // E-step likelihood engine
+
+// A consistent EM state: an assignment together with the trees and parameters optimised for it
+struct EMState {
+    std::vector<int> assignment;
+    std::vector<pergroup> trees;
+    ParameterStore parameters;
+    std::vector<double> proportions;
+    double likelihood = UNLIKELY;
+};
+
+struct RunResult {
+    int iterations = 0;         // Completed iterations, summed over restarts
+    int restarts = 0;           // Completed restarts
+    bool converged = false;
+    bool out_of_budget = false; // Stopped by the deadline or cancellation; the best state found so far is loaded
+    double headroom = 0;        // Seconds left on the budget on return (negative if overrun, infinite if unbounded)
+    double likelihood = UNLIKELY;
+};
+
+/*
+ * Mini-batch EM (run_online). Each step refits every group's tree to the group's loci in a random batch only, and
+ * moves the group's branch lengths and proportion a step of size step0 * (t + offset)^-decay towards the batch
+ * estimate; the batch's loci are then reassigned to their best group. A full E/M/C iteration every
+ * validation_interval steps gives the likelihood that convergence is judged on.
+ */
+struct OnlinePolicy {
+    unsigned batch_size = 256;
+    double step0 = 1.0;
+    double offset = 1.0;
+    double decay = 0.6;             // In (0.5, 1], so the steps sum to infinity but their squares don't
+    int validation_interval = 10;
+    int max_steps = 200;
+    double tolerance = EPS;         // Stop when a validation pass improves the likelihood by less than this
+};
 
+struct OnlineStats {
+    int step;
+    double step_size;
+    unsigned batch;     // Loci in the batch
+    int reassigned;     // Of those, loci that changed group
+    bool validation;    // A full iteration followed the step
+    double seconds;
+};
 
 class Optimiser {
 public:
     Optimiser(const std::string alignment, const std::vector<std::string>& partitions, attrSPtr attr) :
-        alignment(alignment), partitions(partitions), attr(attr), nLoci(partitions.size()) {
-        parameters.resize(nLoci);
+        Optimiser(std::make_shared<const Dataset>(alignment, partitions), attr) {};
+    Optimiser(DatasetSPtr dataset, attrSPtr attr) :
+        dataset(dataset), attr(attr), nLoci(dataset->size()) {
+        parameters = ParameterStore(dataset->partitions().states());
     };
     void set_assignment(const std::vector<int>& a);
     void set_assignment(int nGroups);
-    void set_qs(const std::vector<int>& a);
     void eStep();
     void cStep();
     void mStep();
-    pllresult doOpt(PLLUPtr&& pll, Schedule schedule);
-    //void doIteration();
+    void pipelinedStep();
+    pllresult doOpt(PLLUPtr&& pll, Schedule schedule, const std::vector<int>& loci);
+    bool doIteration();
+    RunResult run(int max_iterations, double tolerance=EPS);
+    RunResult run_restarts(int restarts, int nGroups, int max_iterations, double tolerance=EPS);
+    RunResult run_online(const OnlinePolicy& online);
+    const std::vector<OnlineStats>& get_online_stats() { return online_stats; };
+    void set_budget(BudgetSPtr budget) { this->budget = budget; };
+    const Budget& get_budget() { return *budget; };
+    void set_schedule(Schedule schedule, SchedulePolicy policy=SchedulePolicy());
+    void set_execution(Execution execution, unsigned nthreads);
+    void set_posterior(Posterior posterior, double tolerance=1e-8);
+    void set_pruning(PruningPolicy pruning) { this->pruning = pruning; };
+    const std::vector<EStepStats>& get_estep_stats() { return estep_stats; };
+    void set_screening(ScreeningPolicy screening) { this->screening = screening; }; // Barrier execution only
+    const ParsimonyScreen& get_screen() { return screen; };
+    void set_scorer(Scorer scorer);
+    void set_memory_policy(MemoryPolicy policy);
+    void set_group_moves(GroupMovePolicy moves) { this->moves = moves; };
+    void set_soft_mstep(SoftMStepPolicy soft) { this->soft = soft; };
+    // Group fits, and PLL-scored cells of the barrier E-step, are looked up here before being computed
+    void set_cache(std::shared_ptr<ResultCache> cache) { this->cache = cache; };
+    // A record after every iteration and restart, and a final one at the end of run or run_restarts
+    void set_writer(std::shared_ptr<ResultWriter> writer) { this->writer = writer; };
+    // Live counters for another process to watch; the board's pool counters follow the worker pool
+    void set_status(std::shared_ptr<StatusBoard> status);
+    const std::vector<GroupEvent>& get_group_events() { return group_events; };
+    const MemoryPlan& get_memory_plan() { return group_plan; };  // Group instances, as of the last M-step
+    const std::vector<PhaseMemory>& get_memory_stats() { return memory_stats; };
+    double validate_scorer();   // Max |native - PLL| log likelihood over every cell; needs fitted trees
+    const std::vector<Schedule>& get_group_schedules() { return group_schedules; };
+    const std::vector<ScheduleEvent>& get_schedule_events() { return schedule_events; };
     double get_likelihood() { return likelihood; };
     const std::vector<int>& get_assignment() { return assignment; };
+    const std::vector<pergroup>& get_trees() { return trees; };
     int get_number_of_groups(const std::vector<int>& a);
     void index(const std::vector<int>& a);
     std::vector<int> make_random_assignment();
+    std::vector<int> make_distance_assignment();
+    void set_seeding(Seeding seeding) { this->seeding = seeding; };
+    void set_seed(unsigned seed) { rng.seed(seed); };  // Initial assignments and mini-batches; random by default
     std::vector<double> get_proportions(int pseudocount=1);
-    pllresult get_parameters(PLLUPtr&& pll);
+    std::vector<double> get_expected_sizes();   // Posterior column sums: each group's expected number of loci
+    pllresult get_parameters(PLLUPtr&& pll, const std::vector<int>& loci);
+    bool fit_loci(Schedule schedule);
+    const ParameterStore& get_parameter_store() { return parameters; };
+    void set_parameters(const ParameterStore& store);
+    EMState get_state();
+    void warm_start(const EMState& state);
     void make_probability_table();
 private:
-    unsigned nGroups;
+    void update_assignment(const std::vector<int>& a);
+    void update_schedule(int g, double gain);
+    void update_likelihood();
+    void update_proportions();
+    double optimise_group(int g, bool weighted=false);
+    Schedule affordable_schedule(int g);
+    pllresult fit_group(int g, const std::vector<int>& loci, Schedule group_schedule,
+                        const std::vector<int>& weights=std::vector<int>(), size_t saved=SIZE_MAX);
+    void prepare_soft_groups();
+    void add_instance_key(ContentHash& key);
+    void add_locus_key(ContentHash& key, int i);
+    bool cached_fit(const ContentHash& key, const std::vector<int>& loci, pllresult& result);
+    void store_fit(const ContentHash& key, const std::vector<int>& loci, const pllresult& result);
+    ContentHash cell_key(int i);
+    bool cached_cells(int i, const std::vector<unsigned>& groups, std::vector<double>& scores);
+    void store_cells(int i, const std::vector<unsigned>& groups, const std::vector<double>& scores);
+    void write_record(const char* kind, double seconds);
+    void online_step(const OnlinePolicy& online, int t);
+    PLLUPtr make_locus_pll(int i);
+    double score_cell(PLL& pll, int j);
+    void load_locus_data();
+    LocusScorer& load_locus_scorer(int i);
+    void update_native_tree(int g);
+    void refresh_native_trees();
+    double score_cell(LocusScorer& scorer, int j);
+    void load_tree(PLL& pll, int j) { pll.set_tree(trees[j].tree, false); };
+    void load_tree(LocusScorer& scorer, int j) { scorer.set_tree(native_trees[j], false); };
+    template<typename Engine>
+    long score_locus(Engine& engine, int i, std::vector<unsigned>& groups, std::vector<double>& scores);
+    void save_best();
+    void prepare_candidates();
+    void candidate_groups(int i, std::vector<unsigned>& groups);
+    template<typename Engine>
+    long screen_locus(Engine& engine, int i, std::vector<unsigned>& groups, std::vector<double>& scores);
+    void allocate_posterior();
+    void restore(const EMState& state);
+    void plan_memory();
+    template<typename Engine>
+    double tree_lnl(Engine& engine, int j) { load_tree(engine, j); return engine.get_likelihood(); };
+    void score_loci(const std::vector<int>& loci, const std::vector<int>& groups, std::vector<double>& lnls);
+    void propose_group_moves();
+    int merge_groups();
+    bool split_group();
+    void remove_empty_groups();
+    void groups_changed();
+    bool begin_phase();
+    void make_pool();
+    void report_phase(StatusPhase phase);
+    void end_phase(const char* phase, bool exact);
+    unsigned nGroups = 0;
     unsigned nLoci;
-    const std::string alignment;
+    DatasetSPtr dataset;
     std::vector<int> assignment;
     std::map<int, std::vector<int>> indexmap;
-    std::vector<std::unique_ptr<std::stringstream>> qs;
-    const std::vector<std::string>& partitions;
     double likelihood = UNLIKELY;
-    queueUPtr q;
-    alignmentUPtr al;
     attrSPtr attr;
     Schedule schedule = Schedule::NO_SEARCH;
+    SchedulePolicy policy;
+    std::vector<Schedule> group_schedules;
+    std::vector<double> churn;
+    std::vector<ScheduleEvent> schedule_events;
+    int iteration = 0;
     Classifier classifier = Classifier::MAP;
-    std::vector<perlocus> parameters;
+    ParameterStore parameters; // Each locus's model, from the last M-step of its group
     std::vector<pergroup> trees;
     std::vector<double> proportions;
     bool have_parameters = false;
+    Execution execution = Execution::BARRIER;
+    Seeding seeding = Seeding::RANDOM;
+    std::mt19937 rng{std::random_device()()};
+    unsigned nthreads = 1;
+    std::shared_ptr<StatusBoard> status;    // Before the pool, which reports to it until destroyed
+    LiveStatus* live = nullptr;             // The board's counters, if there is a board
+    std::unique_ptr<work_stealing_thread_pool> pool;
+    std::vector<PLLUPtr> locus_plls;
+    std::vector<std::mutex> locus_mutexes;
+    Scorer scorer = Scorer::PLL;
+    std::vector<std::shared_ptr<const LocusData>> locus_data;       // From the dataset, on first use
+    std::vector<std::shared_ptr<NativeTree>> native_trees;  // Reparsed in place from trees after each M-step
+    Posterior posterior = Posterior::DENSE;
+    double posterior_tolerance = 1e-8;
+    bool have_posterior = false;
+    PruningPolicy pruning;
+    bool use_candidates = false;                   // False on a refresh
+    std::vector<std::vector<unsigned>> candidates; // Per locus, from the previous posterior
+    std::vector<EStepStats> estep_stats;
+    ScreeningPolicy screening;
+    ParsimonyScreen screen;
+    BudgetSPtr budget = std::make_shared<Budget>();
+    std::atomic_bool interrupted{false}; // Some work in the current iteration was skipped because the budget expired
+    EMState best;
+    Arena iteration_arena;              // Main-thread scratch, reset at the start of every iteration
+    std::vector<int> proposed;          // C-step scratch
+    MemoryPolicy memory_policy;
+    MemoryPlan group_plan;                      // Mode of each group's instance, replanned every M-step
+    std::vector<InstanceMode> locus_modes;      // Mode of each single-locus instance
+    std::unique_ptr<MemoryGate> memory_gate;    // Bounds the group instances alive at once
+    std::vector<PhaseMemory> memory_stats;
+    GroupMovePolicy moves;
+    std::vector<GroupEvent> group_events;
+    unsigned max_groups = 0;    // Groups at the start of the run; splits never go beyond it
+    std::vector<unsigned> estep_groups; // Barrier E-step scratch
+    std::vector<double> estep_scores;
+    SoftMStepPolicy soft;
+    bool weighted_mstep = false;        // The last M-step was posterior-weighted
+    bool objective_changed = false;     // ...and the one before wasn't, or vice versa
+    struct SoftGroup {
+        std::vector<int> loci;      // The group's own loci first, then the others it is fitted to
+        std::vector<int> weights;   // Site weight of each
+        size_t members = 0;         // Number of own loci
+    };
+    std::vector<SoftGroup> soft_groups;
+    std::shared_ptr<ResultCache> cache;
+    std::shared_ptr<ResultWriter> writer;
+    int restart = 0;            // Of run_restarts, for records
+    bool restarting = false;    // run() is inside run_restarts, which writes the final record itself
+    std::vector<int> online_order;      // Shuffled loci; batches are drawn from it in turn
+    size_t online_next = 0;
+    std::vector<std::vector<int>> batch_groups; // Mini-batch scratch: the batch's loci in each group
+    std::vector<OnlineStats> online_stats;
 public:
-    std::unique_ptr<ValueTable> vtab;
+    std::unique_ptr<ValueTable> vtab;          // Dense posterior, or log scores scratch for pipelined sparse mode
+    std::unique_ptr<SparsePosterior> sparse;   // Sparse posterior, in Posterior::SPARSE mode
 };
 
 
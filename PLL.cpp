@@ -3,6 +3,8 @@
 //
 
 #include <algorithm>
+#include <chrono>
+#include <iterator>
 #include <sstream>
 #include "PLL.h"
 
@@ -22,6 +24,7 @@ std::string PLL::get_tree() {
 }
 
 double PLL::get_likelihood() {
+    PerfScope perf(PerfRegion::PLL_LIKELIHOOD);
     pllEvaluateLikelihood(tr.get(), partitions, tr->start, PLL_TRUE, PLL_FALSE);
     return tr->likelihood;
 }
@@ -30,51 +33,82 @@ int PLL::get_number_of_partitions() {
     return partitions->numberOfPartitions;
 }
 
-void PLL::optimise(bool rates, bool freqs, bool alphas, bool branches, double epsilon, bool verbose) {
-    if (!rates && !freqs && !alphas && !branches) return;
+const char* block_name(OptBlock block) {
+    switch (block) {
+        case OptBlock::RATES:    return "rates";
+        case OptBlock::FREQS:    return "freqs";
+        case OptBlock::ALPHAS:   return "alphas";
+        case OptBlock::BRANCHES: return "brlen";
+    }
+    return "unknown";
+}
+
+// Each PLL optimiser finishes by evaluating the likelihood, so tr->likelihood is current after it returns
+void PLL::optimise_block(OptBlock block, double epsilon) {
+    switch (block) {
+        case OptBlock::RATES:
+            pllOptRatesGeneric(tr.get(), partitions, epsilon, partitions->rateList);
+            break;
+        case OptBlock::FREQS:
+            pllOptBaseFreqs(tr.get(), partitions, epsilon, partitions->freqList);
+            break;
+        case OptBlock::ALPHAS:
+            pllOptAlphasGeneric(tr.get(), partitions, epsilon, partitions->alphaList);
+            break;
+        case OptBlock::BRANCHES:
+            pllOptimizeBranchLengths(tr.get(), partitions, 32);
+            break;
+    }
+}
+
+// Stops between blocks once the budget expires, leaving the instance at the best point reached so far
+OptimiseTrace PLL::optimise(bool rates, bool freqs, bool alphas, bool branches, double epsilon, bool verbose,
+                            const Budget* budget) {
+    PerfScope perf(PerfRegion::PLL_OPTIMISE);
+    OptimiseTrace trace;
+    if (!rates && !freqs && !alphas && !branches) return trace;
+    const OptBlock blocks[] = {OptBlock::RATES, OptBlock::FREQS, OptBlock::ALPHAS, OptBlock::BRANCHES};
+    bool active[] = {rates, freqs, alphas, branches};
+    int low_gain_rounds[] = {0, 0, 0, 0};
     int i = 0;
     double loop_start_lnl;
     double loop_end_lnl;
+    bool out_of_time = false;
     pllEvaluateLikelihood(tr.get(), partitions, tr->start, PLL_TRUE, PLL_FALSE);
     for (;;) {
         i++;
         loop_start_lnl = tr->likelihood;
         if (verbose) std::cerr << "  iter " << i << " current lnl = " << loop_start_lnl << std::endl;
 
-        if (rates) {
-            pllOptRatesGeneric(tr.get(), partitions, epsilon, partitions->rateList);
-            pllEvaluateLikelihood(tr.get(), partitions, tr->start, PLL_TRUE, PLL_FALSE);
-            if (verbose) std::cerr << "    rates:  " << tr->likelihood << std::endl;
-        }
-
-        if (branches) {
-            pllOptimizeBranchLengths(tr.get(), partitions, 32);
-            pllEvaluateLikelihood(tr.get(), partitions, tr->start, PLL_TRUE, PLL_FALSE);
-            if (verbose) std::cerr << "    brlen1: " << tr->likelihood << std::endl;
-        }
-
-        if (freqs) {
-            pllOptBaseFreqs(tr.get(), partitions, epsilon, partitions->freqList);
-            pllEvaluateLikelihood(tr.get(), partitions, tr->start, PLL_TRUE, PLL_FALSE);
-            if (verbose) std::cerr << "    freqs:  " << tr->likelihood << std::endl;
-        }
-
-        if (branches) {
-            pllOptimizeBranchLengths(tr.get(), partitions, 32);
-            pllEvaluateLikelihood(tr.get(), partitions, tr->start, PLL_TRUE, PLL_FALSE);
-            if (verbose) std::cerr << "    brlen2: " << tr->likelihood << std::endl;
-        }
-
-        if (alphas) {
-            pllOptAlphasGeneric (tr.get(), partitions, epsilon, partitions->alphaList);
-            pllEvaluateLikelihood(tr.get(), partitions, tr->start, PLL_TRUE, PLL_FALSE);
-            if (verbose) std::cerr << "    alphas: " << tr->likelihood << std::endl;
+        for (int b = 0; b < 4; ++b) {
+            if (!active[b]) continue;
+            if (budget && budget->expired()) {
+                out_of_time = true;
+                break;
+            }
+            double block_start_lnl = tr->likelihood;
+            auto start = std::chrono::steady_clock::now();
+            optimise_block(blocks[b], epsilon);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            double gain = tr->likelihood - block_start_lnl;
+            trace.push_back(BlockTrace{i, blocks[b], gain, elapsed.count()});
+            if (verbose) std::cerr << "    " << block_name(blocks[b]) << ": " << tr->likelihood << std::endl;
+
+            // Stop revisiting a block once it has repeatedly failed to contribute
+            if (gain < epsilon) {
+                if (++low_gain_rounds[b] >= BLOCK_PATIENCE) {
+                    active[b] = false;
+                    if (verbose) std::cerr << "    dropping " << block_name(blocks[b]) << std::endl;
+                }
+            }
+            else {
+                low_gain_rounds[b] = 0;
+            }
         }
 
-        if (branches) {
-            pllOptimizeBranchLengths(tr.get(), partitions, 32);
-            pllEvaluateLikelihood(tr.get(), partitions, tr->start, PLL_TRUE, PLL_FALSE);
-            if (verbose) std::cerr << "    brlen3: " << tr->likelihood << std::endl;
+        if (out_of_time) {
+            if (verbose) std::cerr << "Budget expired" << std::endl;
+            break;
         }
 
         loop_end_lnl = tr->likelihood;
@@ -84,7 +118,8 @@ void PLL::optimise(bool rates, bool freqs, bool alphas, bool branches, double ep
             break;
         }
 
-        if (loop_end_lnl - loop_start_lnl <= tr->likelihoodEpsilon) {
+        if (loop_end_lnl - loop_start_lnl <= tr->likelihoodEpsilon ||
+            std::none_of(std::begin(active), std::end(active), [](bool a) { return a; })) {
             if (verbose) {
                 std::cerr << "loop_start_lnl = " << loop_start_lnl << std::endl
                           << "loop_end_lnl   = " << loop_end_lnl << std::endl
@@ -93,13 +128,20 @@ void PLL::optimise(bool rates, bool freqs, bool alphas, bool branches, double ep
             break;
         }
     }
+
+    // One full traversal so the per-partition likelihoods are consistent with the final parameters
+    pllEvaluateLikelihood(tr.get(), partitions, tr->start, PLL_TRUE, PLL_FALSE);
+    return trace;
 }
 
 const int PLL::get_number_of_partitions() const {
     return partitions->numberOfPartitions;
 }
 
-void PLL::tree_search(bool optimise_model) {
+// pllRaxmlSearchAlgorithm can't be interrupted, so the budget only decides whether to start
+void PLL::tree_search(bool optimise_model, const Budget* budget) {
+    PerfScope perf(PerfRegion::PLL_TREE_SEARCH);
+    if (budget && budget->expired()) return;
     pllEvaluateLikelihood(tr.get(), partitions, tr->start, PLL_TRUE, PLL_FALSE);
     int pll_bool = optimise_model ? PLL_TRUE : PLL_FALSE;
     pllRaxmlSearchAlgorithm(tr.get(), partitions, pll_bool);
@@ -114,8 +156,14 @@ void PLL::adjustAlignmentLength(partitionList *partitions, pllAlignmentData *ali
     alignment->sequenceLength = usedAlLength;
 }
 
-void PLL::set_tree(const std::string& nwk) {
-    newickUPtr newick(pllNewickParseString(nwk.c_str()), NewickDeleter());
+// Pass evaluate=false when only the topology is needed next (e.g. for get_parsimony) to skip the full traversal
+void PLL::set_tree(const std::string& nwk, bool evaluate) {
+    PerfScope perf(PerfRegion::PLL_SET_TREE);
+    newickUPtr newick;
+    {
+        std::lock_guard<std::mutex> lock(utils::pll_parser_mutex());
+        newick = newickUPtr(pllNewickParseString(nwk.c_str()), NewickDeleter());
+    }
 
     if (!newick) {
         throw std::runtime_error("pllNewickParseString returned a null pointer!");
@@ -126,7 +174,17 @@ void PLL::set_tree(const std::string& nwk) {
     }
 
     pllTreeInitTopologyNewick(tr.get(), newick.get(), PLL_FALSE);
-    pllEvaluateLikelihood(tr.get(), partitions, tr->start, PLL_TRUE, PLL_FALSE);
+    if (evaluate) pllEvaluateLikelihood(tr.get(), partitions, tr->start, PLL_TRUE, PLL_FALSE);
+}
+
+// Parsimony score of the current topology. The parsimony vectors are built on first use.
+unsigned PLL::get_parsimony() {
+    PerfScope perf(PerfRegion::PLL_PARSIMONY);
+    if (!parsimony_ready) {
+        pllInitParsimonyStructures(tr.get(), partitions, PLL_FALSE);
+        parsimony_ready = true;
+    }
+    return pllEvaluateParsimony(tr.get(), partitions, tr->start, PLL_TRUE, PLL_FALSE);
 }
 
 double PLL::get_alpha(int partition) {
@@ -146,32 +204,39 @@ void PLL::set_optimisable_alpha(int partition, bool optimisable) {
 }
 
 std::vector<double> PLL::get_frequencies(int partition) {
-    std::vector<double> freqs_vec;
-    int num_states = partitions->partitionData[partition]->states;
-    for (int j = 0; j < num_states; ++j) {
-        freqs_vec.push_back(partitions->partitionData[partition]->frequencies[j]);
-    }
+    std::vector<double> freqs_vec(partitions->partitionData[partition]->states);
+    get_frequencies(partition, freqs_vec.data());
     return freqs_vec;
 }
 
+void PLL::get_frequencies(int partition, double* out) {
+    int num_states = partitions->partitionData[partition]->states;
+    std::copy(partitions->partitionData[partition]->frequencies,
+              partitions->partitionData[partition]->frequencies + num_states, out);
+}
+
 void PLL::set_frequencies(std::vector<double> freqs, int partition, bool optimisable) {
+    size_t num_states = partitions->partitionData[partition]->states;
+    if (freqs.size() != num_states) {
+        std::ostringstream msg;
+        msg << "Frequencies vector is the wrong length. Should be " << num_states;
+        throw std::invalid_argument(msg.str());
+    }
+    set_frequencies(freqs.data(), partition, optimisable);
+}
 
+void PLL::set_frequencies(const double* freqs, int partition, bool optimisable) {
+    int num_states = partitions->partitionData[partition]->states;
     double s = 0;
-    for (double f : freqs) s += f;
+    for (int j = 0; j < num_states; ++j) s += freqs[j];
     double diff = 1 - s;
     if (diff < 0) diff = -diff;
 
     if (diff > EPS) {
         throw std::invalid_argument("Not setting frequencies: Frequencies do not sum to 1");
     }
-    size_t num_states = partitions->partitionData[partition]->states;
-    if (freqs.size() != num_states) {
-        std::ostringstream msg;
-        msg << "Frequencies vector is the wrong length. Should be " << num_states;
-        throw std::invalid_argument(msg.str());
-    }
     set_optimisable_frequencies(partition, true); // frequencies only updated if optimisable flag is true
-    pllSetFixedBaseFrequencies(&(freqs[0]), num_states, partition, partitions, tr.get());
+    pllSetFixedBaseFrequencies(const_cast<double*>(freqs), num_states, partition, partitions, tr.get());
     set_optimisable_frequencies(partition, optimisable);
 }
 
@@ -192,15 +257,20 @@ unsigned PLL::sites() {
 
 std::vector<double> PLL::get_rates(int partition) {
     if (partition >= partitions->numberOfPartitions) throw std::invalid_argument("Partitions out of bounds");
-    std::vector<double> rates_vec;
     int num_states = partitions->partitionData[partition]->states;
-    int num_rates = (num_states * (num_states - 1)) / 2;
-    for (int j = 0; j < num_rates; ++j) {
-        rates_vec.push_back(partitions->partitionData[partition]->substRates[j]);
-    }
+    std::vector<double> rates_vec((num_states * (num_states - 1)) / 2);
+    get_rates(partition, rates_vec.data());
     return rates_vec;
 }
 
+void PLL::get_rates(int partition, double* out) {
+    if (partition >= partitions->numberOfPartitions) throw std::invalid_argument("Partitions out of bounds");
+    int num_states = partitions->partitionData[partition]->states;
+    int num_rates = (num_states * (num_states - 1)) / 2;
+    std::copy(partitions->partitionData[partition]->substRates,
+              partitions->partitionData[partition]->substRates + num_rates, out);
+}
+
 void PLL::set_rates(std::vector<double> rates, int partition, bool optimisable) {
     if (partition >= partitions->numberOfPartitions) throw std::invalid_argument("Partitions out of bounds");
     int num_states = partitions->partitionData[partition]->states;
@@ -210,7 +280,14 @@ void PLL::set_rates(std::vector<double> rates, int partition, bool optimisable)
         msg << "Rates vector is the wrong length. Should be " << num_rates;
         throw std::invalid_argument(msg.str());
     }
-    pllSetSubstitutionMatrix(&(rates[0]), num_rates, partition, partitions, tr.get());
+    set_rates(rates.data(), partition, optimisable);
+}
+
+void PLL::set_rates(const double* rates, int partition, bool optimisable) {
+    if (partition >= partitions->numberOfPartitions) throw std::invalid_argument("Partitions out of bounds");
+    int num_states = partitions->partitionData[partition]->states;
+    int num_rates = (num_states * (num_states - 1)) / 2;
+    pllSetSubstitutionMatrix(const_cast<double*>(rates), num_rates, partition, partitions, tr.get());
     set_optimisable_rates(partition, optimisable);
 }
 
@@ -8,18 +8,39 @@
 extern "C" {
     #include <pll/pll.h>
 }
+#include "Budget.h"
 #include "memory_management.h"
+#include "PerfCounters.h"
 #include "utils.h"
 
 #define EPS 1e-6
 
 using pInfoPtr = pInfo*;
 
+// Parameter blocks visited by PLL::optimise
+enum class OptBlock { RATES, FREQS, ALPHAS, BRANCHES };
+
+const char* block_name(OptBlock block);
+
+// Likelihood gain and time spent by one block in one round of PLL::optimise
+struct BlockTrace {
+    int round;
+    OptBlock block;
+    double gain;
+    double seconds;
+};
+
+using OptimiseTrace = std::vector<BlockTrace>;
+
+// Number of consecutive rounds a block may gain less than epsilon before it is dropped
+const int BLOCK_PATIENCE = 2;
+
 
 class PLL{
 
 public:
     PLL(pllInstanceAttr& attr, pllQueue* queue, pllAlignmentData* alignment) {
+        PerfScope perf(PerfRegion::PLL_CREATE);
         tr = instanceUPtr(pllCreateInstance(&attr), InstanceDeleter());
         partitions = pllPartitionsCommit(queue, alignment);
         pllAlignmentRemoveDups(alignment, partitions);
@@ -43,11 +64,16 @@ public:
                         tr->start->back, PLL_TRUE, PLL_TRUE,
                         PLL_FALSE, PLL_FALSE, PLL_FALSE,
                         0, PLL_FALSE, PLL_FALSE);
-        newickUPtr newick = newickUPtr(pllNewickParseString(tr->tree_string));
+        newickUPtr newick;
+        {
+            std::lock_guard<std::mutex> lock(utils::pll_parser_mutex());
+            newick = newickUPtr(pllNewickParseString(tr->tree_string));
+        }
         pllTreeInitTopologyNewick(tr.get(), newick.get(), PLL_TRUE);
     }
 
     PLL(pllInstanceAttr& attr, pllQueue* queue, pllNewickTree* newick, pllAlignmentData* alignment) {
+        PerfScope perf(PerfRegion::PLL_CREATE);
         tr = instanceUPtr(pllCreateInstance(&attr), InstanceDeleter());
         partitions = pllPartitionsCommit(queue, alignment);
         pllAlignmentRemoveDups(alignment, partitions);
@@ -63,8 +89,10 @@ public:
     }
 
     // Move constructor
-    PLL (PLL&& other) noexcept : partitions(other.partitions), tr(std::move(other.tr)) {
+    PLL (PLL&& other) noexcept : partitions(other.partitions), tr(std::move(other.tr)),
+                                 parsimony_ready(other.parsimony_ready) {
         other.partitions = nullptr;
+        other.parsimony_ready = false;
     }
 
     /** Move assignment operator */
@@ -72,12 +100,14 @@ public:
         // simplified move-constructor that also protects against move-to-self.
         std::swap(partitions, other.partitions);
         std::swap(tr, other.tr);
+        std::swap(parsimony_ready, other.parsimony_ready);
         return *this;
     }
 
     // Destructor
     ~PLL() noexcept {
         if (partitions && tr) {
+            if (parsimony_ready) pllFreeParsimonyDataStructures(tr.get(), partitions);
             pllPartitionsDestroy(tr.get(), &partitions);
         }
     }
@@ -88,7 +118,8 @@ public:
     // Copy assignment
     PLL& operator=(const PLL& other) = delete;
 
-    void optimise(bool rates, bool freqs, bool alphas, bool branches, double epsilon=0.0001, bool verbose=false);
+    OptimiseTrace optimise(bool rates, bool freqs, bool alphas, bool branches, double epsilon=0.0001, bool verbose=false,
+                           const Budget* budget=nullptr);
     std::string get_tree();
     double get_likelihood();
     int get_number_of_partitions();
@@ -104,8 +135,9 @@ public:
 
     unsigned sites();
 
-    void tree_search(bool optimise_model);
-    void set_tree(const std::string& nwk);
+    void tree_search(bool optimise_model, const Budget* budget=nullptr);
+    void set_tree(const std::string& nwk, bool evaluate=true);
+    unsigned get_parsimony();
 
     double get_alpha(int partition);
     void set_alpha(double alpha, int partition, bool optimisable);
@@ -117,12 +149,21 @@ public:
 
     std::vector<double> get_rates(int partition);
     void set_rates(std::vector<double> rates, int partition, bool optimisable);
+
+    // Raw forms, reading and writing the partition's states (frequencies) or states*(states-1)/2 (rates) values
+    void get_frequencies(int partition, double* out);
+    void set_frequencies(const double* freqs, int partition, bool optimisable);
+    void get_rates(int partition, double* out);
+    void set_rates(const double* rates, int partition, bool optimisable);
     void set_optimisable_rates(int partition, bool optimisable);
 
 public:
     partitionList* partitions = nullptr;
     instanceUPtr tr;
     void adjustAlignmentLength(partitionList* partitions, pllAlignmentData* alignment);
+private:
+    bool parsimony_ready = false;
+    void optimise_block(OptBlock block, double epsilon);
 };
 
 typedef std::unique_ptr<PLL> PLLUPtr;
@@ -0,0 +1,26 @@
+//
+// Contiguous per-locus model parameters.
+//
+
+#include <cstring>
+#include "ParameterStore.h"
+
+ParameterStore::ParameterStore(const std::vector<int>& states) {
+    auto l = std::make_shared<Layout>();
+    l->states = states;
+    size_t total = 0;
+    for (int s : states) {
+        l->offsets.push_back(total);
+        total += stride(s);
+    }
+    layout = l;
+    values.assign(total, 0.0);
+}
+
+void ParameterStore::assign(const ParameterStore& other) {
+    if (layout != other.layout) {
+        *this = other;
+        return;
+    }
+    std::memcpy(values.data(), other.values.data(), values.size() * sizeof(double));
+}
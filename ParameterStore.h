@@ -0,0 +1,51 @@
+//
+// Contiguous per-locus model parameters.
+//
+
+#ifndef TREECL_EM_PARAMETERSTORE_H
+#define TREECL_EM_PARAMETERSTORE_H
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+/*
+ * Model parameters of every locus in one flat array. Each locus occupies a record
+ * [alpha, likelihood, freqs (states), rates (states * (states - 1) / 2)] whose stride depends only on its state
+ * count: 12 doubles for DNA, 212 for amino acids. The layout is fixed on construction and shared between copies,
+ * so snapshotting the parameters of the whole dataset copies a single array.
+ */
+class ParameterStore {
+    struct Layout {
+        std::vector<int> states;
+        std::vector<size_t> offsets;
+    };
+    std::shared_ptr<const Layout> layout;
+    std::vector<double> values;
+
+    size_t offset(size_t locus) const { return layout->offsets[locus]; }
+
+public:
+    static size_t rates_size(int states) { return static_cast<size_t>(states) * (states - 1) / 2; }
+    static size_t stride(int states) { return 2 + states + rates_size(states); }
+
+    ParameterStore() : layout(std::make_shared<const Layout>()) {}
+    explicit ParameterStore(const std::vector<int>& states);
+
+    size_t size() const { return layout->states.size(); }
+    int states(size_t locus) const { return layout->states[locus]; }
+
+    double& alpha(size_t locus) { return values[offset(locus)]; }
+    double alpha(size_t locus) const { return values[offset(locus)]; }
+    double& likelihood(size_t locus) { return values[offset(locus) + 1]; }
+    double likelihood(size_t locus) const { return values[offset(locus) + 1]; }
+    double* freqs(size_t locus) { return values.data() + offset(locus) + 2; }
+    const double* freqs(size_t locus) const { return values.data() + offset(locus) + 2; }
+    double* rates(size_t locus) { return freqs(locus) + states(locus); }
+    const double* rates(size_t locus) const { return freqs(locus) + states(locus); }
+
+    // Copy another store's values; a single memcpy, without reallocating, when the layouts are shared
+    void assign(const ParameterStore& other);
+};
+
+#endif //TREECL_EM_PARAMETERSTORE_H
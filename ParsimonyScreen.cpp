@@ -0,0 +1,35 @@
+//
+// Parsimony pre-screen for E-step cells.
+//
+
+#include <cmath>
+#include "ParsimonyScreen.h"
+
+void ParsimonyScreen::add_sample(double pars_diff, double lnl_diff, unsigned max_samples) {
+    samples.emplace_back(pars_diff, lnl_diff);
+    while (samples.size() > max_samples) samples.pop_front();
+}
+
+// Least squares through the origin; both differences are zero for the reference tree by construction
+void ParsimonyScreen::fit(unsigned min_samples) {
+    double sxy = 0, sxx = 0;
+    for (const auto& s : samples) {
+        sxy += s.first * s.second;
+        sxx += s.first * s.first;
+    }
+    if (samples.size() < min_samples || sxx == 0) {
+        calibrated = false;
+        return;
+    }
+    slope = sxy / sxx;
+
+    double ss = 0;
+    for (const auto& s : samples) {
+        double resid = s.second - slope * s.first;
+        ss += resid * resid;
+    }
+    sigma = std::sqrt(ss / (samples.size() - 1));
+
+    // More changes should never make a tree more likely; a non-negative fit means the screen has nothing to go on
+    calibrated = slope < 0;
+}
@@ -0,0 +1,47 @@
+//
+// Parsimony pre-screen for E-step cells.
+//
+
+#ifndef TREECL_EM_PARSIMONYSCREEN_H
+#define TREECL_EM_PARSIMONYSCREEN_H
+
+#include <deque>
+#include <utility>
+
+struct ScreeningPolicy {
+    bool enabled = false;
+    double threshold = 1e-6;    // Skip a cell if its estimated posterior can't reach this
+    double z = 3.0;             // Residual standard deviations added to the estimate before comparing
+    int sample_every = 10;      // Every sample_every-th locus is scored exactly to keep the calibration current
+    unsigned min_samples = 30;  // Calibration pairs needed before any cell is rejected
+    unsigned max_samples = 5000;
+};
+
+/*
+ * Predicts a cell's log-likelihood from parsimony. Within a locus, the difference in lnL between two trees is
+ * modelled as slope * (difference in parsimony score), with the slope and residual spread fitted by least squares
+ * on cells that were also scored exactly. The reference for each locus is the exactly scored lnL of its
+ * current group.
+ */
+class ParsimonyScreen {
+    std::deque<std::pair<double, double>> samples; // (parsimony difference, lnL difference)
+    double slope = 0;
+    double sigma = 0;
+    bool calibrated = false;
+
+public:
+    void add_sample(double pars_diff, double lnl_diff, unsigned max_samples);
+    void fit(unsigned min_samples);
+    bool is_calibrated() const { return calibrated; }
+    double get_slope() const { return slope; }
+    double get_sigma() const { return sigma; }
+    size_t nsamples() const { return samples.size(); }
+
+    // Optimistic lnL estimate for a tree with parsimony score pars, given an exactly scored reference tree
+    double upper_bound(double ref_lnl, unsigned ref_pars, unsigned pars, double z) const {
+        return ref_lnl + slope * (static_cast<double>(pars) - ref_pars) + z * sigma;
+    }
+};
+
+
+#endif //TREECL_EM_PARSIMONYSCREEN_H
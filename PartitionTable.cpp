@@ -0,0 +1,143 @@
+//
+// Parsed partition definitions, and PLL partition queues composed from them.
+//
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include "PartitionTable.h"
+#include "utils.h"
+
+namespace {
+    int states_of(int data_type) {
+        switch (data_type) {
+            case PLL_AA_DATA: return 20;
+            case PLL_BINARY_DATA: return 2;
+            default: return 4;
+        }
+    }
+
+    char* copy_string(const char* s) {
+        if (!s) return nullptr;
+        char* copy = strdup(s);
+        if (!copy) throw std::bad_alloc();
+        return copy;
+    }
+
+    void free_info(pllPartitionInfo* info) {
+        if (info->regionList) {
+            void* region;
+            while (pllQueueRemove(info->regionList, &region)) std::free(region);
+            std::free(info->regionList);
+        }
+        std::free(info->partitionName);
+        std::free(info->partitionModel);
+        std::free(info);
+    }
+
+    // Copy of a parsed partition, allocated the way PLL's parser allocates so pllQueuePartitionsDestroy frees it
+    pllPartitionInfo* copy_info(const pllPartitionInfo* info) {
+        auto* copy = static_cast<pllPartitionInfo*>(std::malloc(sizeof(pllPartitionInfo)));
+        if (!copy) throw std::bad_alloc();
+        *copy = *info;
+        copy->partitionName = nullptr;
+        copy->partitionModel = nullptr;
+        copy->regionList = nullptr;
+        try {
+            copy->partitionName = copy_string(info->partitionName);
+            copy->partitionModel = copy_string(info->partitionModel);
+            if (!pllQueueInit(&copy->regionList)) throw std::bad_alloc();
+            for (auto* it = info->regionList->head; it; it = it->next) {
+                auto* region = static_cast<pllPartitionRegion*>(std::malloc(sizeof(pllPartitionRegion)));
+                if (!region) throw std::bad_alloc();
+                *region = *static_cast<const pllPartitionRegion*>(it->item);
+                if (!pllQueueAppend(copy->regionList, region)) {
+                    std::free(region);
+                    throw std::bad_alloc();
+                }
+            }
+        }
+        catch (...) {
+            free_info(copy);
+            throw;
+        }
+        return copy;
+    }
+}
+
+int PartitionSpec::sites() const {
+    int total = 0;
+    for (const auto& region : regions) {
+        int stride = region.stride > 0 ? region.stride : 1;
+        if (region.end >= region.start) total += (region.end - region.start) / stride + 1;
+    }
+    return total;
+}
+
+PartitionTable::PartitionTable(const std::vector<std::string>& lines) {
+    for (const auto& line : lines) {
+        queueUPtr q;
+        {
+            std::lock_guard<std::mutex> lock(utils::pll_parser_mutex());
+            q = queueUPtr(pllPartitionParseString(line.c_str()), QueueDeleter());
+        }
+        if (!q || !q->head || q->head->next) {
+            throw std::invalid_argument("Expected exactly one partition per line, got: " + line);
+        }
+        auto* info = static_cast<const pllPartitionInfo*>(q->head->item);
+
+        PartitionSpec spec;
+        if (info->partitionName) spec.name = info->partitionName;
+        if (info->partitionModel) spec.model = info->partitionModel;
+        spec.data_type = info->dataType;
+        spec.states = states_of(info->dataType);
+        for (auto* it = info->regionList->head; it; it = it->next) {
+            auto* region = static_cast<const pllPartitionRegion*>(it->item);
+            spec.regions.push_back(PartitionRegion{region->start, region->end, region->stride});
+        }
+        specs.push_back(std::move(spec));
+        parsed.push_back(std::move(q));
+    }
+}
+
+const pllPartitionInfo* PartitionTable::info(size_t locus) const {
+    return static_cast<const pllPartitionInfo*>(parsed[locus]->head->item);
+}
+
+std::vector<int> PartitionTable::states() const {
+    std::vector<int> result;
+    for (const auto& spec : specs) result.push_back(spec.states);
+    return result;
+}
+
+void PartitionTable::append(pllQueue* queue, int locus) const {
+    pllPartitionInfo* copy = copy_info(info(locus));
+    if (!pllQueueAppend(queue, copy)) {
+        free_info(copy);
+        throw std::bad_alloc();
+    }
+}
+
+queueUPtr PartitionTable::make_queue(const std::vector<int>& loci) const {
+    pllQueue* q = nullptr;
+    if (!pllQueueInit(&q)) throw std::bad_alloc();
+    queueUPtr queue(q, QueueDeleter());
+    for (int locus : loci) append(queue.get(), locus);
+    return queue;
+}
+
+queueUPtr PartitionTable::make_queue(int locus) const {
+    pllQueue* q = nullptr;
+    if (!pllQueueInit(&q)) throw std::bad_alloc();
+    queueUPtr queue(q, QueueDeleter());
+    append(queue.get(), locus);
+    return queue;
+}
+
+void PartitionTable::set_site_weights(pllAlignmentData* alignment, int locus, int weight) const {
+    for (const auto& region : specs[locus].regions) {
+        int stride = region.stride > 0 ? region.stride : 1;
+        for (int s = region.start; s <= region.end; s += stride) alignment->siteWeights[s - 1] *= weight;
+    }
+}
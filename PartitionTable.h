@@ -0,0 +1,57 @@
+//
+// Parsed partition definitions, and PLL partition queues composed from them.
+//
+
+#ifndef TREECL_EM_PARTITIONTABLE_H
+#define TREECL_EM_PARTITIONTABLE_H
+
+#include <string>
+#include <vector>
+#include "memory_management.h"
+
+// Sites start..end (1-based, inclusive) taking every stride'th one, as in PLL
+struct PartitionRegion {
+    int start;
+    int end;
+    int stride;
+};
+
+struct PartitionSpec {
+    std::string name;
+    std::string model;
+    int data_type;  // PLL_DNA_DATA, PLL_AA_DATA, ...
+    int states;
+    std::vector<PartitionRegion> regions;
+
+    int sites() const;
+};
+
+/*
+ * One entry per locus, parsed from the partition lines once on construction. Queues for PLL are composed by
+ * copying the parsed pllPartitionInfo of each requested locus, so building a group's instance involves no text:
+ * the copies keep every field PLL's parser set, including those the spec doesn't mirror.
+ */
+class PartitionTable {
+    std::vector<queueUPtr> parsed;  // PLL's parse of each line, holding exactly one partition
+    std::vector<PartitionSpec> specs;
+
+    const pllPartitionInfo* info(size_t locus) const;
+    void append(pllQueue* queue, int locus) const;
+
+public:
+    PartitionTable() = default;
+    explicit PartitionTable(const std::vector<std::string>& lines);
+
+    size_t size() const { return specs.size(); }
+    const PartitionSpec& operator[](size_t locus) const { return specs[locus]; }
+    std::vector<int> states() const;
+
+    // Partition queue of the given loci, in order, ready for pllPartitionsCommit
+    queueUPtr make_queue(const std::vector<int>& loci) const;
+    queueUPtr make_queue(int locus) const;
+
+    // Scale the PLL site weights (0-based) of every site of locus by weight, in an alignment about to be loaded
+    void set_site_weights(pllAlignmentData* alignment, int locus, int weight) const;
+};
+
+#endif //TREECL_EM_PARTITIONTABLE_H
@@ -0,0 +1,296 @@
+//
+// Hardware performance counters (perf_event_open) around PLL calls and EM phases.
+//
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+#include "PerfCounters.h"
+
+namespace {
+    std::atomic_bool enabled{false};
+    thread_local PerfPhase current_phase = PerfPhase::OTHER;
+    std::atomic<int> next_thread{0};
+
+    // Counts of one thread, kept after the thread exits
+    struct ThreadTable {
+        int thread;
+        std::mutex mut;
+        std::array<std::array<PerfCounts, PERF_REGIONS>, PERF_PHASES> counts;
+    };
+
+    std::mutex registry_mutex;
+    std::vector<std::shared_ptr<ThreadTable>> registry;
+
+    bool intel_cpu() {
+#if defined(__x86_64__) || defined(__i386__)
+        unsigned eax, ebx, ecx, edx;
+        if (!__get_cpuid(0, &eax, &ebx, &ecx, &edx)) return false;
+        char vendor[13];
+        std::memcpy(vendor, &ebx, 4);
+        std::memcpy(vendor + 4, &edx, 4);
+        std::memcpy(vendor + 8, &ecx, 4);
+        vendor[12] = 0;
+        return std::strcmp(vendor, "GenuineIntel") == 0;
+#else
+        return false;
+#endif
+    }
+
+    // Sets the type and config of an event, or returns false if this CPU has no encoding for it
+    bool event_config(PerfEvent event, perf_event_attr& attr) {
+        attr.type = PERF_TYPE_HARDWARE;
+        switch (event) {
+            case PerfEvent::CYCLES: attr.config = PERF_COUNT_HW_CPU_CYCLES; return true;
+            case PerfEvent::INSTRUCTIONS: attr.config = PERF_COUNT_HW_INSTRUCTIONS; return true;
+            case PerfEvent::LLC_MISSES: attr.config = PERF_COUNT_HW_CACHE_MISSES; return true;
+            case PerfEvent::FP_VECTOR:
+                if (!intel_cpu()) return false;
+                attr.type = PERF_TYPE_RAW;
+                attr.config = 0x14c7;   // FP_ARITH_INST_RETIRED, umask 128B_PACKED_DOUBLE | 256B_PACKED_DOUBLE
+                return true;
+        }
+        return false;
+    }
+
+    std::string paranoid_level() {
+        std::ifstream in("/proc/sys/kernel/perf_event_paranoid");
+        std::string level;
+        return (in >> level) ? level : "unknown";
+    }
+
+    // The calling thread's counter group, opened on its first region once counting is enabled
+    struct ThreadCounters {
+        bool tried = false;
+        int leader = -1;
+        int opened = 0;
+        std::array<int, PERF_EVENTS> fds;
+        std::array<int, PERF_EVENTS> slots;     // Position in the group read, or -1
+        std::string status;
+        std::shared_ptr<ThreadTable> table;
+
+        ThreadCounters() {
+            fds.fill(-1);
+            slots.fill(-1);
+        }
+
+        ~ThreadCounters() {
+            for (int fd : fds) if (fd >= 0) close(fd);
+        }
+
+        void open() {
+            tried = true;
+            std::string missing;
+            auto unavailable = [&missing](PerfEvent event, const std::string& reason) {
+                missing += std::string(missing.empty() ? "" : ", ") + perf_event_name(event) + " (" + reason + ")";
+            };
+            for (int e = 0; e < PERF_EVENTS; ++e) {
+                auto event = static_cast<PerfEvent>(e);
+                perf_event_attr attr;
+                std::memset(&attr, 0, sizeof(attr));
+                attr.size = sizeof(attr);
+                if (!event_config(event, attr)) {
+                    unavailable(event, "not on this CPU");
+                    continue;
+                }
+                attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                                   PERF_FORMAT_TOTAL_TIME_RUNNING;
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+                int fd = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0));
+                if (fd < 0) {
+                    unavailable(event, std::strerror(errno));
+                    continue;
+                }
+                if (leader < 0) leader = fd;
+                fds[e] = fd;
+                slots[e] = opened++;
+            }
+            if (opened == 0) {
+                status = "no counters: " + missing + "; perf_event_paranoid is " + paranoid_level();
+                return;
+            }
+            status = "counting";
+            for (int e = 0; e < PERF_EVENTS; ++e) {
+                if (slots[e] >= 0) status += std::string(" ") + perf_event_name(static_cast<PerfEvent>(e));
+            }
+            if (!missing.empty()) status += "; unavailable: " + missing;
+        }
+
+        // Event values by PerfEvent, then time enabled and running
+        bool read_group(std::array<uint64_t, PERF_EVENTS + 2>& out) {
+            if (leader < 0) return false;
+            uint64_t buffer[3 + PERF_EVENTS];   // nr, time enabled, time running, values
+            ssize_t size = read(leader, buffer, sizeof(buffer));
+            if (size < static_cast<ssize_t>(3 * sizeof(uint64_t)) || buffer[0] != static_cast<uint64_t>(opened)) {
+                return false;
+            }
+            for (int e = 0; e < PERF_EVENTS; ++e) out[e] = slots[e] >= 0 ? buffer[3 + slots[e]] : 0;
+            out[PERF_EVENTS] = buffer[1];
+            out[PERF_EVENTS + 1] = buffer[2];
+            return true;
+        }
+
+        ThreadTable& get_table() {
+            if (!table) {
+                table = std::make_shared<ThreadTable>();
+                table->thread = next_thread++;
+                std::lock_guard<std::mutex> lock(registry_mutex);
+                registry.push_back(table);
+            }
+            return *table;
+        }
+    };
+
+    thread_local ThreadCounters local;
+}
+
+const char* perf_event_name(PerfEvent event) {
+    switch (event) {
+        case PerfEvent::CYCLES: return "cycles";
+        case PerfEvent::INSTRUCTIONS: return "instructions";
+        case PerfEvent::LLC_MISSES: return "LLC misses";
+        case PerfEvent::FP_VECTOR: return "FP vector ops";
+    }
+    return "unknown";
+}
+
+const char* perf_phase_name(PerfPhase phase) {
+    switch (phase) {
+        case PerfPhase::OTHER: return "other";
+        case PerfPhase::M_STEP: return "M-step";
+        case PerfPhase::E_STEP: return "E-step";
+        case PerfPhase::PIPELINED: return "pipelined";
+    }
+    return "unknown";
+}
+
+const char* perf_region_name(PerfRegion region) {
+    switch (region) {
+        case PerfRegion::PHASE: return "phase";
+        case PerfRegion::PLL_CREATE: return "PLL::PLL";
+        case PerfRegion::PLL_OPTIMISE: return "PLL::optimise";
+        case PerfRegion::PLL_TREE_SEARCH: return "PLL::tree_search";
+        case PerfRegion::PLL_LIKELIHOOD: return "PLL::get_likelihood";
+        case PerfRegion::PLL_SET_TREE: return "PLL::set_tree";
+        case PerfRegion::PLL_PARSIMONY: return "PLL::get_parsimony";
+    }
+    return "unknown";
+}
+
+void PerfCounts::add(const PerfCounts& other) {
+    calls += other.calls;
+    seconds += other.seconds;
+    for (int e = 0; e < PERF_EVENTS; ++e) {
+        values[e] += other.values[e];
+        samples[e] += other.samples[e];
+    }
+}
+
+bool enable_perf_counters() {
+    if (!local.tried) local.open();
+    enabled = true;
+    return local.opened > 0;
+}
+
+void disable_perf_counters() {
+    enabled = false;
+}
+
+bool perf_counters_enabled() {
+    return enabled;
+}
+
+std::string perf_counter_status() {
+    if (!local.tried) return "not opened on this thread";
+    return local.status;
+}
+
+void reset_perf_counters() {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for (auto& table : registry) {
+        std::lock_guard<std::mutex> table_lock(table->mut);
+        for (auto& phase : table->counts) phase.fill(PerfCounts());
+    }
+}
+
+std::vector<PerfRecord> perf_counter_report() {
+    std::vector<PerfRecord> report;
+    std::array<std::array<PerfCounts, PERF_REGIONS>, PERF_PHASES> totals;
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for (auto& table : registry) {
+        std::lock_guard<std::mutex> table_lock(table->mut);
+        for (int p = 0; p < PERF_PHASES; ++p) {
+            for (int r = 0; r < PERF_REGIONS; ++r) {
+                const PerfCounts& counts = table->counts[p][r];
+                if (counts.calls == 0) continue;
+                report.push_back(PerfRecord{table->thread, static_cast<PerfPhase>(p), static_cast<PerfRegion>(r),
+                                            counts});
+                totals[p][r].add(counts);
+            }
+        }
+    }
+    for (int p = 0; p < PERF_PHASES; ++p) {
+        for (int r = 0; r < PERF_REGIONS; ++r) {
+            if (totals[p][r].calls == 0) continue;
+            report.push_back(PerfRecord{-1, static_cast<PerfPhase>(p), static_cast<PerfRegion>(r), totals[p][r]});
+        }
+    }
+    return report;
+}
+
+PerfScope::PerfScope(PerfRegion region) : active(enabled.load(std::memory_order_relaxed)), region(region) {
+    if (!active) return;
+    phase = current_phase;
+    open();
+}
+
+PerfScope::PerfScope(PerfPhase phase) : active(enabled.load(std::memory_order_relaxed)), phase(phase),
+                                        region(PerfRegion::PHASE) {
+    if (active) open();
+}
+
+void PerfScope::open() {
+    if (!local.tried) local.open();
+    counting = local.read_group(begin);
+    start = std::chrono::steady_clock::now();
+}
+
+PerfScope::~PerfScope() {
+    if (!active) return;
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    PerfCounts counts;
+    counts.calls = 1;
+    counts.seconds = elapsed.count();
+    std::array<uint64_t, PERF_EVENTS + 2> end;
+    uint64_t running = 0;
+    if (counting && local.read_group(end)) running = end[PERF_EVENTS + 1] - begin[PERF_EVENTS + 1];
+    if (running > 0) {
+        double scale = static_cast<double>(end[PERF_EVENTS] - begin[PERF_EVENTS]) / running;
+        for (int e = 0; e < PERF_EVENTS; ++e) {
+            if (local.slots[e] < 0) continue;
+            counts.values[e] = (end[e] - begin[e]) * scale;
+            counts.samples[e] = 1;
+        }
+    }
+    ThreadTable& table = local.get_table();
+    std::lock_guard<std::mutex> lock(table.mut);
+    table.counts[static_cast<int>(phase)][static_cast<int>(region)].add(counts);
+}
+
+PerfPhaseTag::PerfPhaseTag(PerfPhase phase) : previous(current_phase) {
+    current_phase = phase;
+}
+
+PerfPhaseTag::~PerfPhaseTag() {
+    current_phase = previous;
+}
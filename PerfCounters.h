@@ -0,0 +1,104 @@
+//
+// Hardware performance counters (perf_event_open) around PLL calls and EM phases.
+//
+
+#ifndef TREECL_EM_PERFCOUNTERS_H
+#define TREECL_EM_PERFCOUNTERS_H
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+enum class PerfEvent { CYCLES, INSTRUCTIONS, LLC_MISSES, FP_VECTOR };
+const int PERF_EVENTS = 4;
+
+// Samples are attributed to the calling thread's phase. Pool tasks don't inherit it, so the code submitting them tags
+// them with PerfPhaseTag.
+enum class PerfPhase { OTHER, M_STEP, E_STEP, PIPELINED };
+const int PERF_PHASES = 4;
+
+// PHASE is the whole phase, as seen by the thread that ran it; the others are PLL wrapper methods
+enum class PerfRegion { PHASE, PLL_CREATE, PLL_OPTIMISE, PLL_TREE_SEARCH, PLL_LIKELIHOOD, PLL_SET_TREE, PLL_PARSIMONY };
+const int PERF_REGIONS = 7;
+
+const char* perf_event_name(PerfEvent event);
+const char* perf_phase_name(PerfPhase phase);
+const char* perf_region_name(PerfRegion region);
+
+/*
+ * Counts summed over the calls of one region. Counters are multiplexed when the PMU is oversubscribed, so each value
+ * is scaled by the fraction of its call it was running for. An event that couldn't be opened on a thread, or never got
+ * scheduled during a call, doesn't count that call: samples[e] says how many calls values[e] covers.
+ */
+struct PerfCounts {
+    unsigned long calls = 0;
+    double seconds = 0;
+    std::array<double, PERF_EVENTS> values{};
+    std::array<unsigned long, PERF_EVENTS> samples{};
+
+    void add(const PerfCounts& other);
+};
+
+struct PerfRecord {
+    int thread;         // In order of first use; -1 for the sum over threads
+    PerfPhase phase;
+    PerfRegion region;
+    PerfCounts counts;
+};
+
+/*
+ * Counting is off until enabled. Each thread opens its own counter group (user space only) the first time it enters a
+ * region after that, and keeps it until the thread exits. Events the kernel or CPU refuses are left out, so where
+ * perf_event_open isn't allowed at all (perf_event_paranoid, containers) regions still count calls and seconds.
+ * FP_VECTOR is Intel's FP_ARITH_INST_RETIRED for 128- and 256-bit packed doubles, and unavailable on other CPUs.
+ * Regions nest, and each counts inclusively of the ones inside it.
+ */
+bool enable_perf_counters();    // False if no event could be opened on the calling thread
+void disable_perf_counters();
+bool perf_counters_enabled();
+std::string perf_counter_status();  // Events opened on the calling thread, or why they weren't
+void reset_perf_counters();
+std::vector<PerfRecord> perf_counter_report();  // Every thread, phase and region with calls, then the totals
+
+class PerfScope {
+    bool active;
+    bool counting = false;  // The counters were read at the start
+    PerfPhase phase;
+    PerfRegion region;
+    std::chrono::steady_clock::time_point start;
+    std::array<uint64_t, PERF_EVENTS + 2> begin;   // Event values, then time enabled and running
+
+    void open();
+
+public:
+    explicit PerfScope(PerfRegion region);
+    PerfScope(const PerfScope& other) = delete;
+    PerfScope& operator=(const PerfScope& other) = delete;
+    ~PerfScope();
+
+protected:
+    PerfScope(PerfPhase phase);
+};
+
+// Sets the calling thread's phase until destroyed, without measuring anything
+class PerfPhaseTag {
+    PerfPhase previous;
+
+public:
+    explicit PerfPhaseTag(PerfPhase phase);
+    PerfPhaseTag(const PerfPhaseTag& other) = delete;
+    PerfPhaseTag& operator=(const PerfPhaseTag& other) = delete;
+    ~PerfPhaseTag();
+};
+
+// Sets the calling thread's phase, and measures it as its PHASE region
+class PerfPhaseScope : public PerfScope {
+    PerfPhaseTag tag;
+
+public:
+    explicit PerfPhaseScope(PerfPhase phase) : PerfScope(phase), tag(phase) {}
+};
+
+#endif //TREECL_EM_PERFCOUNTERS_H
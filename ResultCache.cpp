@@ -0,0 +1,182 @@
+//
+// Content-addressed on-disk cache of optimisation results, shared between runs and processes.
+//
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "ResultCache.h"
+
+namespace {
+    const char MAGIC[8] = {'t', 'c', 'l', 'c', 'a', 'c', 'h', '1'};
+
+    void make_directory(const std::string& path) {
+        if (mkdir(path.c_str(), 0777) != 0 && errno != EEXIST) {
+            throw std::runtime_error("Can't create cache directory " + path);
+        }
+    }
+
+    // Closes the descriptor, releasing any flock on it
+    struct FileDescriptor {
+        int fd;
+        explicit FileDescriptor(int fd) : fd(fd) {}
+        ~FileDescriptor() { if (fd >= 0) close(fd); }
+    };
+}
+
+ContentHash& ContentHash::add(const void* data, size_t n) {
+    auto bytes = static_cast<const unsigned char*>(data);
+    for (size_t k = 0; k < n; ++k) {
+        a = (a ^ bytes[k]) * 1099511628211ull;
+        b = (b ^ bytes[k]) * 0xff51afd7ed558ccdull;
+        b ^= b >> 29;
+    }
+    return *this;
+}
+
+std::string ContentHash::hex() const {
+    char digits[33];
+    std::snprintf(digits, sizeof(digits), "%016llx%016llx", static_cast<unsigned long long>(a),
+                  static_cast<unsigned long long>(b));
+    return std::string(digits, 32);
+}
+
+ResultCache::ResultCache(const CachePolicy& policy) : root(policy.directory), max_bytes(policy.max_bytes) {
+    if (root.empty()) throw std::invalid_argument("Cache directory not given");
+    make_directory(root);
+    for (int d = 0; d < 256; ++d) {
+        char name[4];
+        std::snprintf(name, sizeof(name), "/%02x", d);
+        make_directory(root + name);
+    }
+}
+
+std::string ResultCache::path(const std::string& key) const {
+    return root + "/" + key.substr(0, 2) + "/" + key.substr(2);
+}
+
+// File layout: magic, key (32 hex digits), value size (uint64), value
+bool ResultCache::get(const ContentHash& key, std::string& value) {
+    std::string digest = key.hex();
+    std::string file = path(digest);
+    std::ifstream in(file, std::ios::binary);
+    char magic[sizeof(MAGIC)];
+    char stored[32];
+    uint64_t size = 0;
+    bool ok = in.read(magic, sizeof(magic)) && std::equal(magic, magic + sizeof(magic), MAGIC) &&
+              in.read(stored, sizeof(stored)) && digest.compare(0, 32, stored, 32) == 0 &&
+              in.read(reinterpret_cast<char*>(&size), sizeof(size));
+    if (ok) {
+        value.resize(size);
+        ok = size == 0 || in.read(&value[0], size);
+        ok = ok && in.peek() == std::char_traits<char>::eof();
+    }
+    if (!ok) {
+        ++misses;
+        return false;
+    }
+    utimensat(AT_FDCWD, file.c_str(), nullptr, 0);  // Most recently used
+    ++hits;
+    return true;
+}
+
+void ResultCache::put(const ContentHash& key, const std::string& value) {
+    std::string digest = key.hex();
+    std::ostringstream temporary;
+    temporary << root << "/.tmp." << getpid() << "." << std::hash<std::thread::id>()(std::this_thread::get_id())
+              << "." << temporaries++;
+    {
+        std::ofstream out(temporary.str(), std::ios::binary | std::ios::trunc);
+        uint64_t size = value.size();
+        out.write(MAGIC, sizeof(MAGIC));
+        out.write(digest.data(), 32);
+        out.write(reinterpret_cast<const char*>(&size), sizeof(size));
+        out.write(value.data(), value.size());
+        if (!out) {
+            std::remove(temporary.str().c_str());
+            return; // A cache that can't be written to is just a cache that misses
+        }
+    }
+    if (std::rename(temporary.str().c_str(), path(digest).c_str()) != 0) {
+        std::remove(temporary.str().c_str());
+        return;
+    }
+    ++writes;
+    size_t total = written += value.size() + sizeof(MAGIC) + 32 + sizeof(uint64_t);
+    if (total > max_bytes / 8) {
+        written = 0;
+        evict();
+    }
+}
+
+bool ResultCache::evict() {
+    FileDescriptor lock(open((root + "/.lock").c_str(), O_RDWR | O_CREAT, 0666));
+    if (lock.fd < 0 || flock(lock.fd, LOCK_EX | LOCK_NB) != 0) return false;
+
+    // Temporaries left behind by processes that died mid-write
+    if (DIR* dir = opendir(root.c_str())) {
+        time_t stale = time(nullptr) - 3600;
+        while (struct dirent* entry = readdir(dir)) {
+            if (std::strncmp(entry->d_name, ".tmp.", 5) != 0) continue;
+            std::string file = root + "/" + entry->d_name;
+            struct stat info;
+            if (stat(file.c_str(), &info) == 0 && info.st_mtime < stale) unlink(file.c_str());
+        }
+        closedir(dir);
+    }
+
+    std::vector<std::tuple<struct timespec, off_t, std::string>> entries;
+    size_t total = 0;
+    for (int d = 0; d < 256; ++d) {
+        char name[4];
+        std::snprintf(name, sizeof(name), "%02x", d);
+        std::string directory = root + "/" + name;
+        DIR* dir = opendir(directory.c_str());
+        if (!dir) continue;
+        while (struct dirent* entry = readdir(dir)) {
+            if (entry->d_name[0] == '.') continue;
+            std::string file = directory + "/" + entry->d_name;
+            struct stat info;
+            if (stat(file.c_str(), &info) != 0) continue;
+            entries.emplace_back(info.st_mtim, info.st_size, file);
+            total += info.st_size;
+        }
+        closedir(dir);
+    }
+    if (total <= max_bytes) return true;
+
+    // Down to seven eighths of the cap, so the next pass isn't due straight away
+    std::sort(entries.begin(), entries.end(), [](const decltype(entries)::value_type& x,
+                                                 const decltype(entries)::value_type& y) {
+        const struct timespec& s = std::get<0>(x);
+        const struct timespec& t = std::get<0>(y);
+        return s.tv_sec != t.tv_sec ? s.tv_sec < t.tv_sec : s.tv_nsec < t.tv_nsec;
+    });
+    size_t target = max_bytes - max_bytes / 8;
+    for (const auto& entry : entries) {
+        if (total <= target) break;
+        if (unlink(std::get<2>(entry).c_str()) == 0) {
+            total -= std::get<1>(entry);
+            ++evictions;
+        }
+    }
+    return true;
+}
+
+CacheStats ResultCache::stats() const {
+    return CacheStats{hits, misses, writes, evictions};
+}
@@ -0,0 +1,108 @@
+//
+// Content-addressed on-disk cache of optimisation results, shared between runs and processes.
+//
+
+#ifndef TREECL_EM_RESULTCACHE_H
+#define TREECL_EM_RESULTCACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+// 128-bit hash of everything a result depends on, fed field by field. Two independent 64-bit lanes (FNV-1a and a
+// multiply-xorshift) so an accidental collision between keys is not a practical concern.
+class ContentHash {
+    uint64_t a = 14695981039346656037ull;
+    uint64_t b = 0x9e3779b97f4a7c15ull;
+
+public:
+    ContentHash& add(const void* data, size_t n);
+    ContentHash& add(const std::string& s) { add(s.size()); return add(s.data(), s.size()); }
+    ContentHash& add(const char* s) { return add(std::string(s)); }
+    template<typename T, typename = typename std::enable_if<std::is_arithmetic<T>::value ||
+                                                            std::is_enum<T>::value>::type>
+    ContentHash& add(T value) { return add(&value, sizeof(T)); }
+
+    std::string hex() const;  // 32 hex digits
+};
+
+// Cached values are flat byte strings; these build and parse them
+class CacheWriter {
+    std::string bytes;
+public:
+    template<typename T, typename = typename std::enable_if<std::is_arithmetic<T>::value>::type>
+    CacheWriter& put(T value) { bytes.append(reinterpret_cast<const char*>(&value), sizeof(T)); return *this; }
+    CacheWriter& put(const std::string& s) { put<uint64_t>(s.size()); bytes.append(s); return *this; }
+    const std::string& str() const { return bytes; }
+};
+
+class CacheReader {
+    const std::string& bytes;
+    size_t pos = 0;
+public:
+    explicit CacheReader(const std::string& bytes) : bytes(bytes) {}
+    template<typename T, typename = typename std::enable_if<std::is_arithmetic<T>::value>::type>
+    bool get(T& value) {
+        if (bytes.size() - pos < sizeof(T)) return false;
+        std::memcpy(&value, bytes.data() + pos, sizeof(T));
+        pos += sizeof(T);
+        return true;
+    }
+    bool get(std::string& s) {
+        uint64_t n;
+        if (!get(n) || bytes.size() - pos < n) return false;
+        s.assign(bytes, pos, n);
+        pos += n;
+        return true;
+    }
+    bool done() const { return pos == bytes.size(); }
+};
+
+struct CachePolicy {
+    std::string directory;
+    size_t max_bytes = size_t(1) << 30;   // Entries beyond this are evicted, least recently used first
+};
+
+struct CacheStats {
+    long hits = 0;
+    long misses = 0;
+    long writes = 0;
+    long evictions = 0;
+};
+
+/*
+ * One file per entry, named by the key's hash under a two-level fan-out. Entries are written to a temporary file
+ * and renamed into place, so a reader in any process sees a whole entry or none, and concurrent writers of the
+ * same key just replace one identical value with another. A hit touches the entry's modification time, which is
+ * what eviction orders by. Eviction runs when this process has written an eighth of the cap since the last one,
+ * under an exclusive flock so that only one process scans the directory at a time; an entry removed under a
+ * reader is just a miss. Files that don't parse (truncated by a crash, another version) are misses too.
+ */
+class ResultCache {
+    std::string root;
+    size_t max_bytes;
+    std::atomic<size_t> written{0};  // Bytes since the last eviction pass
+    std::atomic<long> hits{0};
+    std::atomic<long> misses{0};
+    std::atomic<long> writes{0};
+    std::atomic<long> evictions{0};
+    std::atomic<unsigned> temporaries{0};
+
+    std::string path(const std::string& key) const;
+
+public:
+    explicit ResultCache(const CachePolicy& policy);
+    ResultCache(const ResultCache& other) = delete;
+    ResultCache& operator=(const ResultCache& other) = delete;
+
+    bool get(const ContentHash& key, std::string& value);
+    void put(const ContentHash& key, const std::string& value);
+    // Remove least recently used entries until the cache is under the cap; returns false if another process is
+    // already doing so
+    bool evict();
+    CacheStats stats() const;
+};
+
+#endif //TREECL_EM_RESULTCACHE_H
@@ -0,0 +1,154 @@
+//
+// NDJSON stream of run progress, formatted and written on a background thread.
+//
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <stdexcept>
+#include "ResultWriter.h"
+
+namespace {
+    void append_number(std::string& line, double value) {
+        if (!std::isfinite(value)) {
+            line += "null";
+            return;
+        }
+        char buffer[32];
+        std::snprintf(buffer, sizeof(buffer), "%.17g", value);
+        line += buffer;
+    }
+
+    void append_string(std::string& line, const std::string& s) {
+        line += '"';
+        for (char c : s) {
+            if (c == '"' || c == '\\') {
+                line += '\\';
+                line += c;
+            }
+            else if (static_cast<unsigned char>(c) < 0x20) {
+                char buffer[8];
+                std::snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+                line += buffer;
+            }
+            else {
+                line += c;
+            }
+        }
+        line += '"';
+    }
+
+    template<typename T, typename Append>
+    void append_array(std::string& line, const std::vector<T>& values, Append append) {
+        line += '[';
+        for (size_t k = 0; k < values.size(); ++k) {
+            if (k) line += ',';
+            append(line, values[k]);
+        }
+        line += ']';
+    }
+
+    void append_integer(std::string& line, long value) {
+        line += std::to_string(value);
+    }
+}
+
+ResultWriter::ResultWriter(const std::string& filename, WriterPolicy policy) : policy(policy) {
+    if (filename == "-") {
+        out = &std::cout;
+    }
+    else {
+        file.open(filename, std::ios::out | std::ios::trunc);
+        if (!file) throw std::invalid_argument("Can't write results to " + filename);
+        out = &file;
+    }
+    worker = std::thread(&ResultWriter::run, this);
+}
+
+ResultWriter::~ResultWriter() {
+    {
+        std::lock_guard<std::mutex> lock(mut);
+        done = true;
+    }
+    cv.notify_one();
+    worker.join();
+}
+
+void ResultWriter::write(RunRecord&& record) {
+    {
+        std::lock_guard<std::mutex> lock(mut);
+        queue.push_back(std::move(record));
+        max_queued = std::max(max_queued, queue.size());
+    }
+    cv.notify_one();
+}
+
+size_t ResultWriter::get_max_queued() {
+    std::lock_guard<std::mutex> lock(mut);
+    return max_queued;
+}
+
+void ResultWriter::run() {
+    std::string line;
+    std::unique_lock<std::mutex> lock(mut);
+    for (;;) {
+        cv.wait(lock, [this]() { return done || !queue.empty(); });
+        if (queue.empty()) break;   // Done, and everything written
+        while (!queue.empty()) {
+            RunRecord record = std::move(queue.front());
+            queue.pop_front();
+            lock.unlock();
+            format(record, line);
+            out->write(line.data(), line.size());
+            lock.lock();
+        }
+        lock.unlock();
+        out->flush();
+        lock.lock();
+    }
+}
+
+void ResultWriter::format(const RunRecord& record, std::string& line) const {
+    line.clear();
+    line += "{\"kind\":";
+    append_string(line, record.kind);
+    line += ",\"restart\":";
+    append_integer(line, record.restart);
+    line += ",\"iteration\":";
+    append_integer(line, record.iteration);
+    line += ",\"likelihood\":";
+    append_number(line, record.likelihood);
+    line += ",\"seconds\":";
+    append_number(line, record.seconds);
+    line += ",\"elapsed\":";
+    append_number(line, record.elapsed);
+    line += ",\"assignment\":";
+    append_array(line, record.assignment, [](std::string& l, int v) { append_integer(l, v); });
+    line += ",\"proportions\":";
+    append_array(line, record.proportions, append_number);
+    line += ",\"tree_likelihoods\":";
+    append_array(line, record.tree_likelihoods, append_number);
+    if (!record.trees.empty()) {
+        line += ",\"trees\":";
+        append_array(line, record.trees, append_string);
+    }
+    if (record.has_posterior) {
+        // Row i is a flat [group, level, group, level, ...] list; probability = level / 65535
+        const QuantisedPosterior& posterior = record.posterior;
+        line += ",\"posterior\":{\"scale\":65535,\"rows\":[";
+        for (size_t i = 0; i + 1 < posterior.row_start.size(); ++i) {
+            if (i) line += ',';
+            line += '[';
+            for (uint32_t e = posterior.row_start[i]; e < posterior.row_start[i + 1]; ++e) {
+                if (e != posterior.row_start[i]) line += ',';
+                append_integer(line, posterior.groups[e]);
+                line += ',';
+                append_integer(line, posterior.levels[e]);
+            }
+            line += ']';
+        }
+        line += "]}";
+    }
+    line += "}\n";
+}
@@ -0,0 +1,82 @@
+//
+// NDJSON stream of run progress, formatted and written on a background thread.
+//
+
+#ifndef TREECL_EM_RESULTWRITER_H
+#define TREECL_EM_RESULTWRITER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Posterior in compressed sparse rows, each probability quantised to 16 bits (probability * 65535, rounded) and
+ * entries below the writer's threshold dropped.
+ */
+struct QuantisedPosterior {
+    std::vector<uint32_t> row_start;    // nrows + 1
+    std::vector<uint32_t> groups;
+    std::vector<uint16_t> levels;
+};
+
+// Snapshot of the EM state, taken by the Optimiser and owned by the writer from then on
+struct RunRecord {
+    const char* kind;           // "iteration", "restart" or "final"
+    int restart = 0;
+    int iteration = 0;
+    double likelihood = 0;
+    double seconds = 0;         // Of the iteration (or the whole restart, or run)
+    double elapsed = 0;         // Since the budget started
+    std::vector<int> assignment;
+    std::vector<double> proportions;
+    std::vector<std::string> trees;
+    std::vector<double> tree_likelihoods;
+    bool has_posterior = false;
+    QuantisedPosterior posterior;
+};
+
+struct WriterPolicy {
+    bool trees = true;
+    bool posterior = false;
+    double posterior_threshold = 1e-3;
+};
+
+/*
+ * Records are queued by the EM thread, which only moves its snapshot in, and turned into one JSON object per line
+ * by a background thread writing through a buffered stream. The queue is unbounded, so a slow disk makes the queue
+ * grow rather than the run wait; the stream is flushed whenever the queue runs dry, so a reader tailing the file
+ * sees each record soon after it is written. Everything queued is written before the destructor returns.
+ */
+class ResultWriter {
+    WriterPolicy policy;
+    std::ofstream file;
+    std::ostream* out;
+    std::mutex mut;
+    std::condition_variable cv;
+    std::deque<RunRecord> queue;
+    bool done = false;
+    size_t max_queued = 0;
+    std::thread worker;
+
+    void run();
+    void format(const RunRecord& record, std::string& line) const;
+
+public:
+    // filename "-" writes to standard output
+    ResultWriter(const std::string& filename, WriterPolicy policy=WriterPolicy());
+    ResultWriter(const ResultWriter& other) = delete;
+    ResultWriter& operator=(const ResultWriter& other) = delete;
+    ~ResultWriter();
+
+    const WriterPolicy& get_policy() const { return policy; }
+    void write(RunRecord&& record);
+    size_t get_max_queued();    // Deepest the queue has been
+};
+
+#endif //TREECL_EM_RESULTWRITER_H
@@ -0,0 +1,232 @@
+//
+// Initial assignments from k-means++ on per-locus taxon distance matrices.
+//
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <future>
+#include <limits>
+#include <stdexcept>
+#include "Seeding.h"
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace {
+    const uint8_t AMBIGUOUS = 255;
+    const int LANES = 16;           // Patterns per step of the comparison kernel
+    const size_t TILE_BYTES = 64 * 1024;
+
+    // Weighted (identical, comparable) site counts between two taxa over n patterns, n a multiple of LANES.
+    // Ambiguous entries are AMBIGUOUS, and padding patterns have weight 0.
+    inline void compare_taxa(const uint8_t* a, const uint8_t* b, const uint16_t* weights, int n,
+                             long& same, long& valid) {
+#ifdef __AVX2__
+        const __m256i ambiguous = _mm256_set1_epi16(AMBIGUOUS);
+        const __m256i ones = _mm256_set1_epi16(1);
+        __m256i acc_same = _mm256_setzero_si256();
+        __m256i acc_valid = _mm256_setzero_si256();
+        for (int p = 0; p < n; p += LANES) {
+            __m256i x = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + p)));
+            __m256i y = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + p)));
+            __m256i w = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(weights + p));
+            __m256i gap = _mm256_or_si256(_mm256_cmpeq_epi16(x, ambiguous), _mm256_cmpeq_epi16(y, ambiguous));
+            __m256i wv = _mm256_andnot_si256(gap, w);
+            __m256i ws = _mm256_and_si256(wv, _mm256_cmpeq_epi16(x, y));
+            acc_valid = _mm256_add_epi32(acc_valid, _mm256_madd_epi16(wv, ones));
+            acc_same = _mm256_add_epi32(acc_same, _mm256_madd_epi16(ws, ones));
+        }
+        alignas(32) int32_t s[8], v[8];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(s), acc_same);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(v), acc_valid);
+        same = 0;
+        valid = 0;
+        for (int i = 0; i < 8; ++i) {
+            same += s[i];
+            valid += v[i];
+        }
+#else
+        same = 0;
+        valid = 0;
+        for (int p = 0; p < n; ++p) {
+            if (a[p] == AMBIGUOUS || b[p] == AMBIGUOUS) continue;
+            valid += weights[p];
+            if (a[p] == b[p]) same += weights[p];
+        }
+#endif
+    }
+
+    float jukes_cantor(long same, long valid, int states) {
+        if (valid == 0) return std::numeric_limits<float>::quiet_NaN();
+        double p = 1.0 - static_cast<double>(same) / valid;
+        double b = static_cast<double>(states - 1) / states;
+        if (p >= b) return std::numeric_limits<float>::quiet_NaN();
+        return static_cast<float>(-b * std::log(1.0 - p / b));
+    }
+
+    /*
+     * Pairs are visited in tiles of taxa small enough that both tiles' rows stay in cache, so each row is read
+     * from memory once per tile rather than once per pair.
+     */
+    void locus_row(const LocusData& locus, float* out) {
+        int ntaxa = locus.ntaxa;
+        int n = (locus.npatterns + LANES - 1) / LANES * LANES;
+        std::vector<uint8_t> states(static_cast<size_t>(ntaxa) * n, AMBIGUOUS);
+        std::vector<uint16_t> weights(n, 0);
+        for (int p = 0; p < locus.npatterns; ++p) {
+            double w = locus.weights[p];
+            if (w > std::numeric_limits<int16_t>::max()) throw std::overflow_error("Pattern weight too large");
+            weights[p] = static_cast<uint16_t>(w);
+        }
+        for (int t = 0; t < ntaxa; ++t) {
+            const uint8_t* codes = locus.taxon_codes(t);
+            uint8_t* row = states.data() + static_cast<size_t>(t) * n;
+            for (int p = 0; p < locus.npatterns; ++p) {
+                uint32_t mask = locus.code_masks[codes[p]];
+                if (mask && !(mask & (mask - 1))) row[p] = static_cast<uint8_t>(__builtin_ctz(mask));
+            }
+        }
+
+        int tile = static_cast<int>(std::max<size_t>(4, TILE_BYTES / (2 * static_cast<size_t>(n))));
+        auto pair_index = [ntaxa](int t, int u) {
+            return static_cast<size_t>(t) * (2 * ntaxa - t - 1) / 2 + (u - t - 1);
+        };
+        for (int ti = 0; ti < ntaxa; ti += tile) {
+            for (int tj = ti; tj < ntaxa; tj += tile) {
+                for (int t = ti; t < std::min(ti + tile, ntaxa); ++t) {
+                    const uint8_t* a = states.data() + static_cast<size_t>(t) * n;
+                    for (int u = std::max(tj, t + 1); u < std::min(tj + tile, ntaxa); ++u) {
+                        long same, valid;
+                        compare_taxa(a, states.data() + static_cast<size_t>(u) * n, weights.data(), n, same, valid);
+                        out[pair_index(t, u)] = jukes_cantor(same, valid, locus.states);
+                    }
+                }
+            }
+        }
+    }
+
+    // Squared Euclidean distance over the pairs defined in both rows, scaled up to the full number of pairs
+    double distance2(const float* x, const float* y, size_t n) {
+        double sum = 0;
+        size_t used = 0;
+        for (size_t i = 0; i < n; ++i) {
+            if (std::isnan(x[i]) || std::isnan(y[i])) continue;
+            double d = x[i] - y[i];
+            sum += d * d;
+            ++used;
+        }
+        return used ? sum * n / used : std::numeric_limits<double>::infinity();
+    }
+}
+
+DistanceTable locus_distances(const std::vector<std::shared_ptr<const LocusData>>& loci,
+                              work_stealing_thread_pool& pool) {
+    DistanceTable table;
+    table.nloci = loci.size();
+    if (loci.empty()) return table;
+    size_t ntaxa = loci[0]->ntaxa;
+    table.npairs = ntaxa * (ntaxa - 1) / 2;
+    table.values.assign(table.nloci * table.npairs, std::numeric_limits<float>::quiet_NaN());
+
+    const size_t chunk = 8;
+    std::vector<std::future<void>> tasks;
+    for (size_t first = 0; first < loci.size(); first += chunk) {
+        tasks.push_back(pool.submit([&, first]() {
+            for (size_t i = first; i < std::min(first + chunk, loci.size()); ++i) locus_row(*loci[i], table.row(i));
+        }));
+    }
+    for (auto& task : tasks) task.get();
+    return table;
+}
+
+std::vector<int> kmeans_plus_plus(const DistanceTable& table, unsigned k, std::mt19937& engine, int max_iterations) {
+    size_t n = table.nloci, dim = table.npairs;
+    if (k == 0 || k > n) throw std::invalid_argument("k-means needs between 1 and nloci clusters");
+
+    // Seeding: each new centre is a locus drawn with probability proportional to its squared distance to the
+    // nearest centre chosen so far
+    std::vector<float> centres(static_cast<size_t>(k) * dim);
+    std::vector<double> nearest(n, std::numeric_limits<double>::infinity());
+    size_t first = std::uniform_int_distribution<size_t>(0, n - 1)(engine);
+    std::copy(table.row(first), table.row(first) + dim, centres.begin());
+    for (unsigned c = 1; c < k; ++c) {
+        const float* prev = centres.data() + (c - 1) * dim;
+        double total = 0;
+        for (size_t i = 0; i < n; ++i) {
+            nearest[i] = std::min(nearest[i], distance2(table.row(i), prev, dim));
+            if (std::isfinite(nearest[i])) total += nearest[i];
+        }
+        size_t pick = 0;
+        if (total > 0) {
+            double u = std::uniform_real_distribution<double>(0, total)(engine);
+            for (pick = 0; pick < n - 1; ++pick) {
+                if (std::isfinite(nearest[pick]) && (u -= nearest[pick]) <= 0) break;
+            }
+        }
+        else {
+            pick = std::uniform_int_distribution<size_t>(0, n - 1)(engine);
+        }
+        std::copy(table.row(pick), table.row(pick) + dim, centres.begin() + c * dim);
+    }
+
+    // Lloyd iterations. A cluster left empty takes the locus furthest from its own centre.
+    std::vector<int> labels(n, -1);
+    std::vector<double> sums(static_cast<size_t>(k) * dim);
+    std::vector<unsigned> counts(static_cast<size_t>(k) * dim);
+    std::vector<unsigned> sizes(k);
+    std::vector<double> own(n);
+    for (int iter = 0; iter < max_iterations; ++iter) {
+        bool moved = false;
+        for (size_t i = 0; i < n; ++i) {
+            int best = 0;
+            double best_d = std::numeric_limits<double>::infinity();
+            for (unsigned c = 0; c < k; ++c) {
+                double d = distance2(table.row(i), centres.data() + c * dim, dim);
+                if (d < best_d) {
+                    best = static_cast<int>(c);
+                    best_d = d;
+                }
+            }
+            own[i] = best_d;
+            moved |= (labels[i] != best);
+            labels[i] = best;
+        }
+        std::fill(sizes.begin(), sizes.end(), 0);
+        for (int label : labels) ++sizes[label];
+        for (unsigned c = 0; c < k; ++c) {
+            if (sizes[c] > 0) continue;
+            size_t far = 0;
+            double far_d = -1;
+            for (size_t i = 0; i < n; ++i) {
+                double d = std::isfinite(own[i]) ? own[i] : 0;
+                if (sizes[labels[i]] > 1 && d > far_d) {
+                    far = i;
+                    far_d = d;
+                }
+            }
+            --sizes[labels[far]];
+            labels[far] = static_cast<int>(c);
+            sizes[c] = 1;
+            own[far] = 0;
+            moved = true;
+        }
+        if (!moved) break;
+
+        std::fill(sums.begin(), sums.end(), 0.0);
+        std::fill(counts.begin(), counts.end(), 0u);
+        for (size_t i = 0; i < n; ++i) {
+            const float* x = table.row(i);
+            size_t base = static_cast<size_t>(labels[i]) * dim;
+            for (size_t d = 0; d < dim; ++d) {
+                if (std::isnan(x[d])) continue;
+                sums[base + d] += x[d];
+                ++counts[base + d];
+            }
+        }
+        for (size_t j = 0; j < centres.size(); ++j) {
+            centres[j] = counts[j] ? static_cast<float>(sums[j] / counts[j]) : std::numeric_limits<float>::quiet_NaN();
+        }
+    }
+    return labels;
+}
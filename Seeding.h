@@ -0,0 +1,36 @@
+//
+// Initial assignments from k-means++ on per-locus taxon distance matrices.
+//
+
+#ifndef TREECL_EM_SEEDING_H
+#define TREECL_EM_SEEDING_H
+
+#include <memory>
+#include <random>
+#include <vector>
+#include "NativeLikelihood.h"
+#include "threadpool.h"
+
+/*
+ * One row per locus: the Jukes-Cantor corrected distances between every pair of taxa (upper triangle, row-major),
+ * NaN where the pair shares no unambiguous site or the p-distance saturates.
+ */
+class DistanceTable {
+public:
+    size_t nloci = 0;
+    size_t npairs = 0;
+    std::vector<float> values;
+
+    const float* row(size_t locus) const { return values.data() + locus * npairs; }
+    float* row(size_t locus) { return values.data() + locus * npairs; }
+};
+
+// Distances of every locus, computed in parallel on pool
+DistanceTable locus_distances(const std::vector<std::shared_ptr<const LocusData>>& loci,
+                              work_stealing_thread_pool& pool);
+
+// k-means++ seeding followed by Lloyd iterations; returns labels 0..k-1, each used at least once
+std::vector<int> kmeans_plus_plus(const DistanceTable& table, unsigned k, std::mt19937& engine,
+                                  int max_iterations = 20);
+
+#endif //TREECL_EM_SEEDING_H
@@ -0,0 +1,103 @@
+//
+// Sparse locus x group posterior table.
+//
+
+#include <algorithm>
+#include <cmath>
+#include "Arena.h"
+#include "SparsePosterior.h"
+#include "reduce.h"
+#include "utils.h"
+
+SparsePosterior::SparsePosterior(unsigned cols, double tolerance) : ncol(cols), tolerance(tolerance) {
+    row_start.push_back(0);
+}
+
+void SparsePosterior::clear() {
+    row_start.assign(1, 0);
+    entries.clear();
+    discarded.clear();
+}
+
+void SparsePosterior::reserve(unsigned rows) {
+    row_start.reserve(rows + 1);
+    discarded.reserve(rows);
+}
+
+void SparsePosterior::append_log_row(const std::vector<double>& logprobs) {
+    ArenaScope scope(thread_arena());
+    ArenaVector<unsigned> groups(logprobs.size(), ArenaAllocator<unsigned>(thread_arena()));
+    for (unsigned j = 0; j < groups.size(); ++j) groups[j] = j;
+    append_log_row(groups.data(), logprobs.data(), logprobs.size());
+}
+
+void SparsePosterior::append_log_row(const std::vector<unsigned>& groups, const std::vector<double>& logprobs) {
+    append_log_row(groups.data(), logprobs.data(), logprobs.size());
+}
+
+void SparsePosterior::append_log_row(const unsigned* groups, const double* logprobs, size_t n) {
+    double lps = utils::logsumexp(logprobs, n);
+    size_t best = std::max_element(logprobs, logprobs + n) - logprobs;
+    ArenaScope scope(thread_arena());
+    ArenaVector<double> dropped{ArenaAllocator<double>(thread_arena())};
+    for (size_t k = 0; k < n; ++k) {
+        double p = exp(logprobs[k] - lps);
+        if (p >= tolerance || k == best) {
+            entries.push_back(SparseEntry{groups[k], p});
+        }
+        else {
+            dropped.push_back(p);
+        }
+    }
+    std::sort(entries.begin() + row_start.back(), entries.end(),
+              [](const SparseEntry& a, const SparseEntry& b) { return a.group < b.group; });
+    discarded.push_back(reduce::pairwise_sum(dropped));
+    row_start.push_back(entries.size());
+}
+
+SparsePosterior::Row SparsePosterior::row(unsigned r) const {
+    return Row{entries.data() + row_start[r], entries.data() + row_start[r + 1]};
+}
+
+double SparsePosterior::get(unsigned r, unsigned c) const {
+    for (const auto& e : row(r)) {
+        if (e.group == c) return e.prob;
+    }
+    return 0;
+}
+
+unsigned SparsePosterior::map(unsigned r) const {
+    auto rw = row(r);
+    return std::max_element(rw.begin(), rw.end(),
+                            [](const SparseEntry& a, const SparseEntry& b) { return a.prob < b.prob; })->group;
+}
+
+double SparsePosterior::max_discarded_mass() const {
+    if (discarded.empty()) return 0;
+    return *std::max_element(discarded.begin(), discarded.end());
+}
+
+double SparsePosterior::density() const {
+    if (discarded.empty() || ncol == 0) return 0;
+    return static_cast<double>(entries.size()) / (static_cast<double>(nrows()) * ncol);
+}
+
+std::vector<double> SparsePosterior::colsum(work_stealing_thread_pool* pool) const {
+    std::vector<std::vector<double>> columns(ncol);
+    for (const auto& e : entries) columns[e.group].push_back(e.prob);
+    std::vector<double> s(ncol, 0);
+    for (unsigned c = 0; c < ncol; ++c) {
+        const auto& column = columns[c];
+        s[c] = pool ? reduce::parallel_sum(column.begin(), column.end(), *pool) : reduce::pairwise_sum(column);
+    }
+    return s;
+}
+
+void SparsePosterior::print() const {
+    for (unsigned r = 0; r < nrows(); ++r) {
+        for (const auto& e : row(r)) {
+            std::cout << e.group << ':' << e.prob << ' ';
+        }
+        std::cout << "(discarded " << discarded[r] << ')' << std::endl;
+    }
+}
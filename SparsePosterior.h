@@ -0,0 +1,65 @@
+//
+// Sparse locus x group posterior table.
+//
+
+#ifndef TREECL_EM_SPARSEPOSTERIOR_H
+#define TREECL_EM_SPARSEPOSTERIOR_H
+
+#include <iostream>
+#include <vector>
+
+class work_stealing_thread_pool;
+
+struct SparseEntry {
+    unsigned group;
+    double prob;
+};
+
+/*
+ * Posterior probabilities stored row by row (compressed sparse rows). Each row keeps only the groups whose
+ * probability is at least the tolerance - always including the most probable group - and records the mass it
+ * discarded, so sum(row) + discarded(row) == 1. Rows are appended in order.
+ */
+class SparsePosterior {
+    std::vector<size_t> row_start;
+    std::vector<SparseEntry> entries;
+    std::vector<double> discarded;
+    unsigned ncol;
+    double tolerance;
+
+public:
+    struct Row {
+        const SparseEntry* first;
+        const SparseEntry* last;
+        const SparseEntry* begin() const { return first; }
+        const SparseEntry* end() const { return last; }
+        size_t size() const { return last - first; }
+    };
+
+    SparsePosterior(unsigned cols, double tolerance);
+    unsigned nrows() const { return discarded.size(); }
+    unsigned ncols() const { return ncol; }
+    double get_tolerance() const { return tolerance; }
+    void clear();
+    void reserve(unsigned rows);
+
+    // Normalise a row of log joint probabilities (one per group, ncols long) and append the retained entries
+    void append_log_row(const std::vector<double>& logprobs);
+
+    // Append a row of log joint probabilities for a subset of groups, treating the other groups as having zero mass
+    void append_log_row(const std::vector<unsigned>& groups, const std::vector<double>& logprobs);
+    void append_log_row(const unsigned* groups, const double* logprobs, size_t n);
+
+    Row row(unsigned r) const;
+    double get(unsigned r, unsigned c) const;
+    unsigned map(unsigned r) const;                 // Most probable group
+    double discarded_mass(unsigned r) const { return discarded[r]; }
+    double max_discarded_mass() const;
+    size_t nonzeros() const { return entries.size(); }
+    double density() const;                         // Retained entries as a fraction of nrows * ncols
+    std::vector<double> colsum(work_stealing_thread_pool* pool=nullptr) const;   // Reduced on the pool, if given
+    void print() const;
+};
+
+
+#endif //TREECL_EM_SPARSEPOSTERIOR_H
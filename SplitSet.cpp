@@ -0,0 +1,181 @@
+//
+// Bipartitions of a tree, for Robinson-Foulds and branch score distances.
+//
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <stdexcept>
+#include "SplitSet.h"
+
+namespace {
+    int popcount(const uint64_t* set, size_t words) {
+        int count = 0;
+        for (size_t w = 0; w < words; ++w) count += __builtin_popcountll(set[w]);
+        return count;
+    }
+
+    // Taxa below each node, words 64-bit words per node
+    std::vector<uint64_t> subtree_sets(const NativeTree& tree, int ntaxa, size_t words) {
+        std::vector<uint64_t> below(tree.nodes.size() * words, 0);
+        for (size_t n = 0; n < tree.nodes.size(); ++n) {
+            const auto& node = tree.nodes[n];
+            uint64_t* set = below.data() + n * words;
+            if (node.nchildren == 0) {
+                if (node.taxon < 0 || node.taxon >= ntaxa) throw std::invalid_argument("Tree tip outside the taxon set");
+                set[node.taxon / 64] |= uint64_t(1) << (node.taxon % 64);
+                continue;
+            }
+            const int* children = tree.children(node);
+            for (int c = 0; c < node.nchildren; ++c) {
+                const uint64_t* child = below.data() + children[c] * words;
+                for (size_t w = 0; w < words; ++w) set[w] |= child[w];
+            }
+        }
+        return below;
+    }
+}
+
+SplitSet::SplitSet(const NativeTree& tree, int ntaxa) :
+        ntaxa(ntaxa), words((static_cast<size_t>(ntaxa) + 63) / 64), tip_lengths(ntaxa, 0.0) {
+    std::vector<uint64_t> below = subtree_sets(tree, ntaxa, words);
+    uint64_t last_mask = (ntaxa % 64) ? (uint64_t(1) << (ntaxa % 64)) - 1 : ~uint64_t(0);
+
+    std::vector<uint64_t> raw;
+    std::vector<double> raw_lengths;
+    int root = tree.root();
+    for (int n = 0; n < static_cast<int>(tree.nodes.size()); ++n) {
+        const auto& node = tree.nodes[n];
+        const uint64_t* set = below.data() + n * words;
+        if (n == root) continue;
+        if (node.nchildren == 0) {
+            tip_lengths[node.taxon] += node.length;
+            continue;
+        }
+        int count = popcount(set, words);
+        if (count < 2 || count > ntaxa - 2) {
+            // Only reachable next to a bifurcating root, where this branch continues a tip branch
+            if (count == ntaxa - 1) {
+                for (int t = 0; t < ntaxa; ++t) {
+                    if (!(set[t / 64] >> (t % 64) & 1)) tip_lengths[t] += node.length;
+                }
+            }
+            continue;
+        }
+        size_t start = raw.size();
+        raw.insert(raw.end(), set, set + words);
+        if (raw[start] & 1) {
+            for (size_t w = 0; w < words; ++w) raw[start + w] = ~raw[start + w];
+            raw[start + words - 1] &= last_mask;
+        }
+        raw_lengths.push_back(node.length);
+    }
+
+    // Sort, merging the two halves of a branch split by a bifurcating root
+    size_t nraw = raw_lengths.size();
+    std::vector<size_t> order(nraw);
+    std::iota(order.begin(), order.end(), 0);
+    auto less = [&](size_t a, size_t b) {
+        return std::lexicographical_compare(raw.begin() + a * words, raw.begin() + (a + 1) * words,
+                                            raw.begin() + b * words, raw.begin() + (b + 1) * words);
+    };
+    std::sort(order.begin(), order.end(), less);
+    for (size_t k : order) {
+        auto first = raw.begin() + k * words;
+        if (!lengths.empty() && std::equal(first, first + words, bits.end() - words)) {
+            lengths.back() += raw_lengths[k];
+            continue;
+        }
+        bits.insert(bits.end(), first, first + words);
+        lengths.push_back(raw_lengths[k]);
+    }
+}
+
+int SplitSet::compare(size_t k, const SplitSet& other, size_t l) const {
+    const uint64_t* a = split(k);
+    const uint64_t* b = other.split(l);
+    for (size_t w = 0; w < words; ++w) {
+        if (a[w] != b[w]) return a[w] < b[w] ? -1 : 1;
+    }
+    return 0;
+}
+
+int SplitSet::rf_distance(const SplitSet& other) const {
+    if (other.ntaxa != ntaxa) throw std::invalid_argument("Split sets are over different taxa");
+    size_t k = 0, l = 0;
+    int shared = 0;
+    while (k < size() && l < other.size()) {
+        int c = compare(k, other, l);
+        if (c == 0) {
+            ++shared;
+            ++k;
+            ++l;
+        }
+        else if (c < 0) ++k;
+        else ++l;
+    }
+    return static_cast<int>(size() + other.size()) - 2 * shared;
+}
+
+double SplitSet::branch_score(const SplitSet& other) const {
+    if (other.ntaxa != ntaxa) throw std::invalid_argument("Split sets are over different taxa");
+    double sum = 0;
+    size_t k = 0, l = 0;
+    while (k < size() || l < other.size()) {
+        int c = (k == size()) ? 1 : (l == other.size()) ? -1 : compare(k, other, l);
+        double d;
+        if (c == 0) d = lengths[k++] - other.lengths[l++];
+        else if (c < 0) d = lengths[k++];
+        else d = other.lengths[l++];
+        sum += d * d;
+    }
+    for (int t = 0; t < ntaxa; ++t) {
+        double d = tip_lengths[t] - other.tip_lengths[t];
+        sum += d * d;
+    }
+    return std::sqrt(sum);
+}
+
+bool SplitSet::find(const uint64_t* key, double& length) const {
+    size_t lo = 0, hi = size();
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        const uint64_t* s = split(mid);
+        if (std::lexicographical_compare(s, s + words, key, key + words)) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == size() || !std::equal(key, key + words, split(lo))) return false;
+    length = lengths[lo];
+    return true;
+}
+
+std::string blend_branch_lengths(const NativeTree& from, const NativeTree& to, double step, int ntaxa,
+                                 const std::vector<std::string>& labels) {
+    SplitSet old(from, ntaxa);
+    size_t words = old.words;
+    uint64_t last_mask = (ntaxa % 64) ? (uint64_t(1) << (ntaxa % 64)) - 1 : ~uint64_t(0);
+    std::vector<uint64_t> below = subtree_sets(to, ntaxa, words);
+    std::vector<uint64_t> key(words);
+
+    NativeTree blended = to;
+    for (int n = 0; n < static_cast<int>(to.nodes.size()); ++n) {
+        if (n == to.root()) continue;
+        auto& node = blended.nodes[n];
+        double previous;
+        bool found;
+        if (node.nchildren == 0) {
+            previous = old.tip_lengths[node.taxon];
+            found = true;
+        }
+        else {
+            std::copy(below.begin() + n * words, below.begin() + (n + 1) * words, key.begin());
+            if (key[0] & 1) {
+                for (size_t w = 0; w < words; ++w) key[w] = ~key[w];
+                key[words - 1] &= last_mask;
+            }
+            found = old.find(key.data(), previous);
+        }
+        if (found) node.length = previous + step * (node.length - previous);
+    }
+    return blended.newick(labels);
+}
@@ -0,0 +1,52 @@
+//
+// Bipartitions of a tree, for Robinson-Foulds and branch score distances.
+//
+
+#ifndef TREECL_EM_SPLITSET_H
+#define TREECL_EM_SPLITSET_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "NativeLikelihood.h"
+
+/*
+ * The non-trivial splits of an unrooted tree as bitsets over the taxa, each normalised to the side without taxon 0
+ * and kept sorted, with the length of the branch inducing it. Tip branches are kept separately, by taxon. A
+ * bifurcating root contributes one split, whose length is the sum of the two root branches.
+ */
+class SplitSet {
+    int ntaxa;
+    size_t words;
+    std::vector<uint64_t> bits;     // size() x words
+    std::vector<double> lengths;
+    std::vector<double> tip_lengths;
+
+    const uint64_t* split(size_t k) const { return bits.data() + k * words; }
+    int compare(size_t k, const SplitSet& other, size_t l) const;
+
+    friend std::string blend_branch_lengths(const NativeTree& from, const NativeTree& to, double step, int ntaxa,
+                                            const std::vector<std::string>& labels);
+
+public:
+    SplitSet(const NativeTree& tree, int ntaxa);
+    size_t size() const { return lengths.size(); }
+
+    // Number of splits in one tree but not the other
+    int rf_distance(const SplitSet& other) const;
+    // Kuhner-Felsenstein branch score: Euclidean distance between the branch length vectors, with a missing
+    // split contributing its length from the tree that has it
+    double branch_score(const SplitSet& other) const;
+
+    // Length of the branch inducing a split (normalised as above), if the tree has it
+    bool find(const uint64_t* split, double& length) const;
+};
+
+/*
+ * Newick of tree to, with each branch length taken step of the way from its length in tree from to its own. Branches
+ * whose split isn't in from keep their own length. Used to damp the tree updates of mini-batch EM.
+ */
+std::string blend_branch_lengths(const NativeTree& from, const NativeTree& to, double step, int ntaxa,
+                                 const std::vector<std::string>& labels);
+
+#endif //TREECL_EM_SPLITSET_H
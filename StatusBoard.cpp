@@ -0,0 +1,90 @@
+//
+// Live run status in a memory-mapped file, for monitoring from another process.
+//
+
+#include <chrono>
+#include <new>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "StatusBoard.h"
+
+namespace {
+    const char MAGIC[8] = {'t', 'c', 'l', 's', 't', 'a', 't', 0};
+    const int64_t VERSION = 1;
+}
+
+const char* status_phase_name(StatusPhase phase) {
+    switch (phase) {
+        case StatusPhase::IDLE: return "idle";
+        case StatusPhase::M_STEP: return "M-step";
+        case StatusPhase::E_STEP: return "E-step";
+        case StatusPhase::PIPELINED: return "pipelined";
+        case StatusPhase::C_STEP: return "C-step";
+        case StatusPhase::GROUP_MOVES: return "group moves";
+        case StatusPhase::ONLINE_STEP: return "mini-batch step";
+        case StatusPhase::DONE: return "done";
+    }
+    return "unknown";
+}
+
+void LiveStatus::set_phase(StatusPhase p) {
+    phase.store(static_cast<int64_t>(p), std::memory_order_relaxed);
+    beat();
+}
+
+void LiveStatus::beat() {
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    heartbeat_ms.store(std::chrono::duration_cast<std::chrono::milliseconds>(now).count(), std::memory_order_relaxed);
+}
+
+StatusBoard::StatusBoard(const std::string& path) : path(path) {
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) throw std::runtime_error("Can't create status file " + path);
+    if (ftruncate(fd, sizeof(LiveStatus)) != 0) {
+        close(fd);
+        throw std::runtime_error("Can't size status file " + path);
+    }
+    void* memory = mmap(nullptr, sizeof(LiveStatus), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) throw std::runtime_error("Can't map status file " + path);
+    status = new (memory) LiveStatus();
+    status->version = VERSION;
+    status->pid = getpid();
+    status->likelihood_bits = LiveStatus::bits(0);
+    status->best_bits = LiveStatus::bits(0);
+    status->beat();
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(status->magic, MAGIC, sizeof(MAGIC));    // Last, so a reader never sees a half-initialised board
+}
+
+StatusBoard::~StatusBoard() {
+    status->set_phase(StatusPhase::DONE);
+    status->~LiveStatus();
+    munmap(status, sizeof(LiveStatus));
+    unlink(path.c_str());
+}
+
+StatusView::StatusView(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("Can't open status file " + path);
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < static_cast<off_t>(sizeof(LiveStatus))) {
+        close(fd);
+        throw std::runtime_error("Not a status file (or not ready yet): " + path);
+    }
+    void* memory = mmap(nullptr, sizeof(LiveStatus), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) throw std::runtime_error("Can't map status file " + path);
+    status = static_cast<const LiveStatus*>(memory);
+    if (std::memcmp(status->magic, MAGIC, sizeof(MAGIC)) != 0 || status->version != VERSION) {
+        munmap(memory, sizeof(LiveStatus));
+        throw std::runtime_error("Not a status file (or not ready yet): " + path);
+    }
+}
+
+StatusView::~StatusView() {
+    munmap(const_cast<LiveStatus*>(status), sizeof(LiveStatus));
+}
@@ -0,0 +1,86 @@
+//
+// Live run status in a memory-mapped file, for monitoring from another process.
+//
+
+#ifndef TREECL_EM_STATUSBOARD_H
+#define TREECL_EM_STATUSBOARD_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include "threadpool.h"
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "Status counters must be lock-free to be shared between processes");
+
+enum class StatusPhase : int64_t {
+    IDLE,
+    M_STEP,
+    E_STEP,
+    PIPELINED,
+    C_STEP,
+    GROUP_MOVES,
+    ONLINE_STEP,
+    DONE,
+};
+
+const char* status_phase_name(StatusPhase phase);
+
+/*
+ * Layout of the status file. Writers update single fields with relaxed atomics, so a reader may see fields from
+ * slightly different moments, but never a torn value. Doubles are stored as their bit patterns.
+ */
+struct LiveStatus {
+    char magic[8];
+    int64_t version;
+    int64_t pid;
+    std::atomic<int64_t> heartbeat_ms{0};   // Unix time of the last update
+    std::atomic<int64_t> phase{0};
+    std::atomic<int64_t> restart{0};
+    std::atomic<int64_t> iteration{0};
+    std::atomic<int64_t> groups{0};
+    std::atomic<int64_t> groups_done{0};    // Of the current M-step
+    std::atomic<int64_t> cells_done{0};     // Of the current E-step
+    std::atomic<int64_t> cells_total{0};
+    std::atomic<uint64_t> likelihood_bits{0};
+    std::atomic<uint64_t> best_bits{0};
+    std::atomic<int64_t> rss_bytes{0};
+    pool_counters pool;
+
+    static uint64_t bits(double value) { uint64_t b; std::memcpy(&b, &value, sizeof(b)); return b; }
+    static double value(uint64_t bits) { double v; std::memcpy(&v, &bits, sizeof(v)); return v; }
+    void set_phase(StatusPhase p);
+    void beat();
+};
+
+/*
+ * Owner of a status file: created (or truncated) on construction, mapped shared, and removed on destruction. The
+ * file lives wherever the path says; a tmpfs path such as /dev/shm/... keeps it off disk.
+ */
+class StatusBoard {
+    std::string path;
+    LiveStatus* status = nullptr;
+
+public:
+    explicit StatusBoard(const std::string& path);
+    StatusBoard(const StatusBoard& other) = delete;
+    StatusBoard& operator=(const StatusBoard& other) = delete;
+    ~StatusBoard();
+
+    LiveStatus& get() { return *status; }
+};
+
+// Read-only mapping of another process's status file
+class StatusView {
+    const LiveStatus* status = nullptr;
+
+public:
+    explicit StatusView(const std::string& path);
+    StatusView(const StatusView& other) = delete;
+    StatusView& operator=(const StatusView& other) = delete;
+    ~StatusView();
+
+    const LiveStatus& get() const { return *status; }
+};
+
+#endif //TREECL_EM_STATUSBOARD_H
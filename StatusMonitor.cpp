@@ -0,0 +1,45 @@
+//
+// treeCl_status: print the live status of a running treeCl_EM.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include "StatusBoard.h"
+
+// treeCl_status status-file [interval seconds]: one line, or one line per interval until the run ends
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " status-file [interval seconds]" << std::endl;
+        return 2;
+    }
+    double interval = argc > 2 ? std::stod(argv[2]) : 0;
+    try {
+        StatusView view(argv[1]);
+        const LiveStatus& s = view.get();
+        for (;;) {
+            auto phase = static_cast<StatusPhase>(s.phase.load(std::memory_order_relaxed));
+            auto now = std::chrono::system_clock::now().time_since_epoch();
+            long age = std::chrono::duration_cast<std::chrono::milliseconds>(now).count() - s.heartbeat_ms.load();
+            int64_t active = s.pool.active.load();
+            int64_t idle = std::max<int64_t>(0, s.pool.workers.load() - active);
+            std::cout << "pid " << s.pid << " restart " << s.restart.load() << " iteration " << s.iteration.load()
+                      << " " << status_phase_name(phase) << " | groups " << s.groups_done.load() << "/"
+                      << s.groups.load() << " cells " << s.cells_done.load() << "/" << s.cells_total.load()
+                      << " | lnL " << LiveStatus::value(s.likelihood_bits.load()) << " best "
+                      << LiveStatus::value(s.best_bits.load()) << " | workers " << active << " active "
+                      << idle << " idle, " << s.pool.tasks.load() << " tasks, " << s.pool.steals.load()
+                      << " steals | RSS " << s.rss_bytes.load() / (1 << 20) << " MiB | updated " << age / 1000.0
+                      << "s ago" << std::endl;
+            if (interval <= 0 || phase == StatusPhase::DONE) break;
+            std::this_thread::sleep_for(std::chrono::duration<double>(interval));
+        }
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
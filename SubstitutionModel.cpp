@@ -0,0 +1,271 @@
+//
+// Reversible substitution model with discrete Gamma rate heterogeneity, for the native likelihood kernel.
+//
+
+#include <algorithm>
+#include <cmath>
+#include "SubstitutionModel.h"
+
+namespace {
+    // Branch length limits, from PLL's PLL_ZMIN and PLL_ZMAX on z = exp(-length / fracchange)
+    const double LOG_ZMIN = std::log(1.0E-15);
+    const double LOG_ZMAX = std::log(1.0 - 1.0E-6);
+    const double MIN_FREQ = 1e-12;
+
+    // Cyclic Jacobi eigendecomposition of a symmetric N x N matrix a (destroyed). Eigenvectors are the columns of v.
+    template<int N>
+    void jacobi_eigen(std::array<double, N * N>& a, std::array<double, N>& values, std::array<double, N * N>& v) {
+        const int n = N;
+        v.fill(0);
+        for (int i = 0; i < n; ++i) v[i * n + i] = 1;
+
+        for (int sweep = 0; sweep < 100; ++sweep) {
+            double off = 0;
+            for (int p = 0; p < n; ++p)
+                for (int q = p + 1; q < n; ++q)
+                    off += a[p * n + q] * a[p * n + q];
+            if (off < 1e-30) break;
+
+            for (int p = 0; p < n; ++p) {
+                for (int q = p + 1; q < n; ++q) {
+                    double apq = a[p * n + q];
+                    if (std::fabs(apq) < 1e-300) continue;
+                    double theta = (a[q * n + q] - a[p * n + p]) / (2 * apq);
+                    double t = (theta >= 0 ? 1.0 : -1.0) / (std::fabs(theta) + std::sqrt(theta * theta + 1));
+                    double c = 1 / std::sqrt(t * t + 1);
+                    double s = t * c;
+                    for (int k = 0; k < n; ++k) {
+                        double akp = a[k * n + p];
+                        double akq = a[k * n + q];
+                        a[k * n + p] = c * akp - s * akq;
+                        a[k * n + q] = s * akp + c * akq;
+                    }
+                    for (int k = 0; k < n; ++k) {
+                        double apk = a[p * n + k];
+                        double aqk = a[q * n + k];
+                        a[p * n + k] = c * apk - s * aqk;
+                        a[q * n + k] = s * apk + c * aqk;
+                    }
+                    for (int k = 0; k < n; ++k) {
+                        double vkp = v[k * n + p];
+                        double vkq = v[k * n + q];
+                        v[k * n + p] = c * vkp - s * vkq;
+                        v[k * n + q] = s * vkp + c * vkq;
+                    }
+                }
+            }
+        }
+        for (int i = 0; i < n; ++i) values[i] = a[i * n + i];
+    }
+
+    /*
+     * Gamma function routines, following Yang's PAML implementations of the AS 32, AS 91 and AS 111 algorithms
+     * (as used by RAxML and PLL to place the discrete Gamma categories).
+     */
+    double ln_gamma(double alpha) {
+        double x = alpha, f = 0, z;
+        if (x < 7) {
+            f = 1;
+            z = x - 1;
+            while (++z < 7) f *= z;
+            x = z;
+            f = -std::log(f);
+        }
+        z = 1 / (x * x);
+        return f + (x - 0.5) * std::log(x) - x + .918938533204673
+               + (((-.000595238095238 * z + .000793650793651) * z - .002777777777778) * z + .083333333333333) / x;
+    }
+
+    // Regularised lower incomplete gamma function P(alpha, x)
+    double incomplete_gamma(double x, double alpha, double ln_gamma_alpha) {
+        const double accurate = 1e-8, overflow = 1e30;
+        double p = alpha;
+        if (x == 0) return 0;
+        if (x < 0 || p <= 0) return -1;
+
+        double factor = std::exp(p * std::log(x) - x - ln_gamma_alpha);
+        if (x <= 1 || x < p) {
+            // Series expansion
+            double gin = 1, term = 1, rn = p;
+            do {
+                rn++;
+                term *= x / rn;
+                gin += term;
+            } while (term > accurate);
+            return gin * factor / p;
+        }
+
+        // Continued fraction
+        double a = 1 - p, b = a + x + 1, term = 0;
+        double pn[6] = {1, x, x + 1, x * b, 0, 0};
+        double gin = pn[2] / pn[3];
+        for (;;) {
+            a++;
+            b += 2;
+            term++;
+            double an = a * term;
+            for (int i = 0; i < 2; i++) pn[i + 4] = b * pn[i + 2] - an * pn[i];
+            if (pn[5] != 0) {
+                double rn = pn[4] / pn[5];
+                double dif = std::fabs(gin - rn);
+                if (dif <= accurate && dif <= accurate * rn) return 1 - factor * gin;
+                gin = rn;
+            }
+            for (int i = 0; i < 4; i++) pn[i] = pn[i + 2];
+            if (std::fabs(pn[4]) >= overflow) {
+                for (int i = 0; i < 4; i++) pn[i] /= overflow;
+            }
+        }
+    }
+
+    double point_normal(double prob) {
+        const double a0 = -.322232431088, a1 = -1, a2 = -.342242088547, a3 = -.0204231210245;
+        const double a4 = -.453642210148e-4, b0 = .0993484626060, b1 = .588581570495;
+        const double b2 = .531103462366, b3 = .103537752850, b4 = .0038560700634;
+        double p = prob;
+        double p1 = (p < 0.5 ? p : 1 - p);
+        if (p1 < 1e-20) return -9999;
+        double y = std::sqrt(std::log(1 / (p1 * p1)));
+        double z = y + ((((y * a4 + a3) * y + a2) * y + a1) * y + a0) / ((((y * b4 + b3) * y + b2) * y + b1) * y + b0);
+        return (p < 0.5 ? -z : z);
+    }
+
+    // Quantile of the chi-square distribution with v degrees of freedom
+    double point_chi2(double prob, double v) {
+        const double e = .5e-6, aa = .6931471805;
+        double p = prob;
+        if (p < .000002 || p > .999998 || v <= 0) return -1;
+
+        double g = ln_gamma(v / 2);
+        double xx = v / 2, c = xx - 1, ch;
+
+        if (v < -1.24 * std::log(p)) {
+            ch = std::pow((p * xx * std::exp(g + xx * aa)), 1 / xx);
+            if (ch - e < 0) return ch;
+        }
+        else if (v <= .32) {
+            ch = 0.4;
+            double a = std::log(1 - p), q;
+            do {
+                q = ch;
+                double p1 = 1 + ch * (4.67 + ch);
+                double p2 = ch * (6.73 + ch * (6.66 + ch));
+                double t = -0.5 + (4.67 + 2 * ch) / p1 - (6.73 + ch * (13.32 + 3 * ch)) / p2;
+                ch -= (1 - std::exp(a + g + .5 * ch + c * aa) * p2 / p1) / t;
+            } while (std::fabs(q / ch - 1) - .01 > 0);
+        }
+        else {
+            double x = point_normal(p);
+            double p1 = .222222 / v;
+            ch = v * std::pow((x * std::sqrt(p1) + 1 - p1), 3.0);
+            if (ch > 2.2 * v + 6) ch = -2 * (std::log(1 - p) - c * std::log(.5 * ch) + g);
+        }
+
+        double q;
+        do {
+            q = ch;
+            double p1 = .5 * ch;
+            double t = incomplete_gamma(p1, xx, g);
+            if (t < 0) return -1;
+            double p2 = p - t;
+            t = p2 * std::exp(xx * aa + g + p1 - c * std::log(ch));
+            double b = t / ch, a = 0.5 * t - b * c;
+            double s1 = (210 + a * (140 + a * (105 + a * (84 + a * (70 + 60 * a))))) / 420;
+            double s2 = (420 + a * (735 + a * (966 + a * (1141 + 1278 * a)))) / 2520;
+            double s3 = (210 + a * (462 + a * (707 + 932 * a))) / 2520;
+            double s4 = (252 + a * (672 + 1182 * a) + c * (294 + a * (889 + 1740 * a))) / 5040;
+            double s5 = (84 + 264 * a + c * (175 + 606 * a)) / 2520;
+            double s6 = (120 + c * (346 + 127 * c)) / 5040;
+            ch += t * (1 + 0.5 * t * s1 - b * c * (s1 - b * (s2 - b * (s3 - b * (s4 - b * (s5 - b * s6))))));
+        } while (std::fabs(q / ch - 1) > e);
+        return ch;
+    }
+}
+
+void discrete_gamma_rates(double alpha, int ncat, double* rates) {
+    if (ncat == 1) {
+        rates[0] = 1;
+        return;
+    }
+    double beta = alpha;
+    double lng = ln_gamma(alpha + 1);
+    double prev = 0;
+    for (int i = 0; i < ncat - 1; ++i) {
+        double cut = point_chi2((i + 1.0) / ncat, 2 * alpha) / (2 * beta);
+        cut = incomplete_gamma(cut * beta, alpha + 1, lng);
+        rates[i] = (cut - prev) * ncat;
+        prev = cut;
+    }
+    rates[ncat - 1] = (1 - prev) * ncat;
+}
+
+template<int States>
+SubstitutionModel<States>::SubstitutionModel(const double* rates, const double* freqs, double alpha) {
+    const int n = States;
+    std::copy(freqs, freqs + n, this->freqs.begin());
+    std::array<double, States> pi;
+    for (int i = 0; i < n; ++i) pi[i] = std::max(freqs[i], MIN_FREQ);
+
+    // Exchangeabilities, then Q_ij = R_ij * pi_j
+    std::array<double, States * States> r;
+    r.fill(0);
+    for (int i = 0, k = 0; i < n; ++i) {
+        for (int j = i + 1; j < n; ++j, ++k) {
+            r[i * n + j] = r[j * n + i] = rates[k];
+        }
+    }
+    fracchange = 0;
+    for (int i = 0; i < n; ++i)
+        for (int j = 0; j < n; ++j)
+            if (i != j) fracchange += pi[i] * r[i * n + j] * pi[j];
+
+    // Symmetric form A = D^1/2 Q D^-1/2 of the normalised Q
+    std::array<double, States * States> a;
+    for (int i = 0; i < n; ++i) {
+        double diag = 0;
+        for (int j = 0; j < n; ++j) {
+            if (i == j) continue;
+            double qij = r[i * n + j] * pi[j] / fracchange;
+            diag -= qij;
+            a[i * n + j] = r[i * n + j] * std::sqrt(pi[i] * pi[j]) / fracchange;
+        }
+        a[i * n + i] = diag;
+    }
+
+    std::array<double, States * States> u;
+    jacobi_eigen<States>(a, eigenvalues, u);
+
+    // P(t) = D^-1/2 U exp(Lt) U^T D^1/2
+    for (int i = 0; i < n; ++i) {
+        for (int k = 0; k < n; ++k) {
+            left[i * n + k] = u[i * n + k] / std::sqrt(pi[i]);
+            right[k * n + i] = u[i * n + k] * std::sqrt(pi[i]);
+        }
+    }
+
+    discrete_gamma_rates(alpha, GAMMA_CATEGORIES, gamma_rates.data());
+}
+
+template<int States>
+void SubstitutionModel<States>::transition_matrices(double length, double* out) const {
+    const int n = States;
+    double lz = std::min(std::max(-length / fracchange, LOG_ZMIN), LOG_ZMAX);
+    double t = -lz * fracchange;
+    std::array<double, States> expl;
+
+    std::fill(out, out + MATRIX_SIZE, 0.0);
+    for (int c = 0; c < GAMMA_CATEGORIES; ++c) {
+        for (int k = 0; k < n; ++k) expl[k] = std::exp(eigenvalues[k] * gamma_rates[c] * t);
+        double* pc = out + c * PADDED * PADDED;
+        for (int i = 0; i < n; ++i) {
+            for (int j = 0; j < n; ++j) {
+                double p = 0;
+                for (int k = 0; k < n; ++k) p += left[i * n + k] * expl[k] * right[k * n + j];
+                pc[j * PADDED + i] = p > 0 ? p : 0;
+            }
+        }
+    }
+}
+
+template class SubstitutionModel<4>;
+template class SubstitutionModel<20>;
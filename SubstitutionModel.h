@@ -0,0 +1,50 @@
+//
+// Reversible substitution model with discrete Gamma rate heterogeneity, for the native likelihood kernel.
+//
+
+#ifndef TREECL_EM_SUBSTITUTIONMODEL_H
+#define TREECL_EM_SUBSTITUTIONMODEL_H
+
+#include <array>
+
+const int GAMMA_CATEGORIES = 4;
+
+/*
+ * Reversible model built from PLL-style parameters: exchangeabilities in upper-triangle row order
+ * (AC, AG, AT, CG, CT, GT for DNA; 190 values for amino acids), equilibrium frequencies and the Gamma shape.
+ * Q is normalised to one expected substitution per unit time, matching PLL's treatment of branch lengths.
+ * Sizes are compile-time constants; SubstitutionModel<4> and SubstitutionModel<20> are instantiated.
+ */
+template<int States>
+class SubstitutionModel {
+public:
+    static constexpr int PADDED = (States + 3) & ~3;   // States rounded up to the width of one AVX register
+    static constexpr int RATES = States * (States - 1) / 2;
+    static constexpr int MATRIX_SIZE = GAMMA_CATEGORIES * PADDED * PADDED;
+
+private:
+    double fracchange;          // Expected rate of the unnormalised Q; PLL clamps branch lengths in this scale
+    std::array<double, States> freqs;
+    std::array<double, States> eigenvalues;
+    std::array<double, States * States> left;   // Row i scaled by 1/sqrt(pi_i)
+    std::array<double, States * States> right;  // Column j scaled by sqrt(pi_j)
+    std::array<double, GAMMA_CATEGORIES> gamma_rates;
+
+public:
+    // rates holds RATES values and freqs holds States values
+    SubstitutionModel(const double* rates, const double* freqs, double alpha);
+    const std::array<double, States>& frequencies() const { return freqs; }
+    const std::array<double, GAMMA_CATEGORIES>& rates() const { return gamma_rates; }
+
+    /*
+     * Transition probabilities for a branch of the given length, one matrix per rate category. Each matrix is
+     * stored column-major with columns padded to PADDED: out[(c * PADDED + j) * PADDED + i] = P_c(i -> j).
+     * out must hold MATRIX_SIZE doubles.
+     */
+    void transition_matrices(double length, double* out) const;
+};
+
+// Mean rates of the ncat discrete Gamma categories (Yang 1994), written to rates
+void discrete_gamma_rates(double alpha, int ncat, double* rates);
+
+#endif //TREECL_EM_SUBSTITUTIONMODEL_H
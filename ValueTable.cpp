@@ -3,6 +3,7 @@
 //
 
 #include "ValueTable.h"
+#include "reduce.h"
 
 ValueTable::ValueTable(unsigned rows, unsigned cols) {
     table = std::vector<std::vector<double>>(rows, std::vector<double>(cols, 0));
@@ -14,12 +15,14 @@ double ValueTable::get(unsigned r, unsigned c) {
     return table[r][c];
 }
 
-std::vector<double> ValueTable::colsum() {
+std::vector<double> ValueTable::colsum(work_stealing_thread_pool* pool) {
     std::vector<double> s(ncol, 0);
+    std::vector<double> column(nrow);
     for (int c = 0; c < ncol; ++c) {
         for (int r = 0; r < nrow; ++r) {
-            s[c] += get(r, c);
+            column[r] = get(r, c);
         }
+        s[c] = pool ? reduce::parallel_sum(column.begin(), column.end(), *pool) : reduce::pairwise_sum(column);
     }
     return s;
 }
@@ -27,21 +30,14 @@ std::vector<double> ValueTable::colsum() {
 std::vector<double> ValueTable::rowsum() {
     std::vector<double> s(nrow, 0);
     for (int r = 0; r < nrow; ++r) {
-        for (int c = 0; c < ncol; ++c) {
-            s[r] += get(r, c);
-        }
+        s[r] = reduce::pairwise_sum(table[r]);
     }
     return s;
 }
 
 double ValueTable::sum() {
-    double s;
-    for (int r = 0; r < nrow; ++r) {
-        for (int c = 0; c < ncol; ++c) {
-            s += get(r, c);
-        }
-    }
-    return s;
+    // Sum of row sums: each row is reduced pairwise, then the row totals are reduced pairwise
+    return reduce::pairwise_sum(rowsum());
 }
 
 void ValueTable::set(unsigned r, unsigned c, double val) {
@@ -8,6 +8,8 @@
 #include <iostream>
 #include <vector>
 
+class work_stealing_thread_pool;
+
 class ValueTable {
     std::vector<std::vector<double>> table;
     unsigned nrow;
@@ -20,7 +22,7 @@ public:
     double get(unsigned r, unsigned c);
     void set(unsigned r, unsigned c, double val);
     std::vector<double> rowsum();
-    std::vector<double> colsum();
+    std::vector<double> colsum(work_stealing_thread_pool* pool=nullptr);   // Columns reduced on the pool, if given
     double sum();
     std::vector<double> rowmean();
     std::vector<double> colmean();
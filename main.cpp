@@ -4,18 +4,23 @@
 #include <iostream>
 #include <iterator>
 #include <map>
+#include <random>
 #include <string>
 #include <sstream>
 #include <utility>
 #include <pll/pll.h>
 #include <thread>
 #include "PLL.h"
+#include "BatchRunner.h"
+#include "Bootstrap.h"
+#include "ModelSelection.h"
 #include "Optimiser.h"
 #include "utils.h"
 
 
 std::string MYFILE="data/conc.phy";
 std::string MYPART="data/conc.partitions.txt";
+const double NATIVE_SCORER_TOLERANCE = 1e-6;   // Largest |lnl - PLL lnl| before the E-step stays on PLL
 
 
 
@@ -37,7 +42,54 @@ double strain(PLL* pll) {
 
 std::mt19937 engine(12345);
 
-int main()
+// treeCl_EM --batch manifest [threads [memory MiB [cache directory]]]: one tab-separated line per job on stdout, as
+// jobs finish
+int run_batch(attrSPtr attr, int argc, char** argv) {
+    BatchPolicy batch;
+    batch.threads = argc > 3 ? static_cast<unsigned>(std::stoul(argv[3])) : std::thread::hardware_concurrency();
+    if (argc > 4) batch.memory_bytes = static_cast<size_t>(std::stoul(argv[4])) << 20;
+    BatchRunner runner(attr, batch);
+    if (argc > 5) {
+        CachePolicy caching;
+        caching.directory = argv[5];
+        runner.set_cache(std::make_shared<ResultCache>(caching));
+    }
+    std::cout << "job\tline\talignment\tK\tstatus\tlnl\titerations\tseconds\tassignment" << std::endl;
+    size_t failed = runner.run(read_manifest(argv[2]), [](const BatchResult& r) {
+        std::cout << r.job << "\t" << r.entry.line << "\t" << r.entry.alignment << "\t" << r.entry.groups << "\t"
+                  << (!r.error.empty() ? "error: " + r.error : r.run.converged ? "converged" : "stopped") << "\t"
+                  << r.run.likelihood << "\t" << r.run.iterations << "\t" << r.seconds << "\t";
+        for (size_t i = 0; i < r.assignment.size(); ++i) std::cout << (i ? "," : "") << r.assignment[i];
+        std::cout << std::endl;
+    });
+    return failed ? 1 : 0;
+}
+
+// Totals per phase and region, then the same per thread. IPC and LLC misses per kilo-instruction are the quick check
+// for memory-bound kernels; "-" is an event that never counted.
+void print_perf_report() {
+    std::cout << "Hardware counters: " << perf_counter_status() << std::endl;
+    for (const auto& r : perf_counter_report()) {
+        const PerfCounts& c = r.counts;
+        std::string thread = r.thread < 0 ? "all threads" : "thread " + std::to_string(r.thread);
+        std::cout << perf_phase_name(r.phase) << " " << perf_region_name(r.region) << " (" << thread << "): "
+                  << c.calls << " calls, " << c.seconds << "s";
+        for (int e = 0; e < PERF_EVENTS; ++e) {
+            std::cout << ", " << perf_event_name(static_cast<PerfEvent>(e)) << " ";
+            if (c.samples[e]) std::cout << c.values[e]; else std::cout << "-";
+        }
+        double cycles = c.values[static_cast<int>(PerfEvent::CYCLES)];
+        double instructions = c.values[static_cast<int>(PerfEvent::INSTRUCTIONS)];
+        double misses = c.values[static_cast<int>(PerfEvent::LLC_MISSES)];
+        if (cycles > 0 && instructions > 0) std::cout << ", IPC " << instructions / cycles;
+        if (instructions > 0 && c.samples[static_cast<int>(PerfEvent::LLC_MISSES)]) {
+            std::cout << ", LLC MPKI " << 1000 * misses / instructions;
+        }
+        std::cout << std::endl;
+    }
+}
+
+int main(int argc, char** argv)
 {
 
 
@@ -47,20 +99,131 @@ int main()
     attr->saveMemory = PLL_FALSE;
     attr->useRecom = PLL_FALSE;
     attr->randomNumberSeed = 12345;
-    attr->numberOfThreads = std::thread::hardware_concurrency();
+    attr->numberOfThreads = 1; // Parallelism comes from running instances concurrently on the pool
+
+    if (argc > 2 && std::string(argv[1]) == "--batch") return run_batch(attr, argc, argv);
+    enable_perf_counters(); // Falls back to calls and seconds where counters aren't allowed
 
     std::vector<std::string> partitions = utils::readlines(MYPART);
-    auto o = Optimiser(MYFILE, partitions, attr);
+    auto dataset = std::make_shared<const Dataset>(MYFILE, partitions);
+    Optimiser o(dataset, attr);
+    o.set_execution(Execution::PIPELINED, std::thread::hardware_concurrency());
+    PruningPolicy pruning;
+    pruning.enabled = true;
+    o.set_pruning(pruning);
+    MemoryPolicy memory;
+    memory.budget_bytes = size_t(4) << 30;
+    memory.report_rss = true;
+    o.set_memory_policy(memory);
+    GroupMovePolicy moves;
+    moves.enabled = true;
+    o.set_group_moves(moves);
+    WriterPolicy output;
+    output.posterior = true;
+    o.set_writer(std::make_shared<ResultWriter>("results.ndjson", output));
+    o.set_status(std::make_shared<StatusBoard>("treeCl_EM.status")); // Watch with: treeCl_status treeCl_EM.status 1
     o.set_assignment(std::vector<int>{0,1,2,0,1,2,0,1,2,0,1,2,0,1,2});
     std::vector<int> x = o.get_assignment();
     std::vector<double> y = o.get_proportions(1);
     utils::print_container(x.begin(), x.end());
     utils::print_container(y.begin(), y.end());
 
+    // The native scorer is only used once it agrees with PLL on the first fitted trees
     o.mStep();
-    o.eStep();
-    std::cout << "VTAB" << std::endl;
-    o.vtab->print();
+    double scorer_diff = o.validate_scorer();
+    std::cout << "Native scorer max |lnl - PLL lnl| = " << scorer_diff << std::endl;
+    if (scorer_diff <= NATIVE_SCORER_TOLERANCE) o.set_scorer(Scorer::NATIVE);
+    else std::cerr << "Native scorer disagrees with PLL; scoring with PLL" << std::endl;
+
+    o.set_budget(std::make_shared<Budget>(3600));
+    RunResult run = o.run(20);
+    std::cout << (run.converged ? "Converged" : "Stopped") << " after " << run.iterations << " iterations, lnl = "
+              << run.likelihood << ", " << run.headroom << "s of budget left" << std::endl;
+    if (o.sparse) {
+        std::cout << "SPARSE (density " << o.sparse->density() << ", max discarded mass "
+                  << o.sparse->max_discarded_mass() << ")" << std::endl;
+        o.sparse->print();
+    }
+    else {
+        std::cout << "VTAB" << std::endl;
+        o.vtab->print();
+    }
+    std::vector<double> sizes = o.get_expected_sizes();
+    std::cout << "Expected group sizes: ";
+    utils::print_container(sizes.begin(), sizes.end());
+    for (const auto& st : o.get_estep_stats()) {
+#ifdef TREECL_COUNT_ALLOCATIONS
+        std::string allocations = std::to_string(st.allocations);
+#else
+        std::string allocations = "n/a";    // Not counted in this build
+#endif
+        std::cout << "iter " << st.iteration << (st.refresh ? " refresh" : " pruned") << ": skipped "
+                  << st.skipped << "/" << st.cells << " cells (" << st.screened << " by parsimony), " << st.reassigned << " loci reassigned, "
+                  << allocations << " heap allocations" << std::endl;
+    }
+    for (const auto& ev : o.get_group_events()) {
+        const char* move = ev.move == GroupMove::MERGE ? "merged into" : ev.move == GroupMove::SPLIT ? "split into" : "dropped";
+        std::cout << "iter " << ev.iteration << " group " << ev.group << " " << move;
+        if (ev.other >= 0) std::cout << " " << ev.other;
+        std::cout << " (" << ev.loci << " loci, gain " << ev.gain << ")" << std::endl;
+    }
+    const MemoryPlan& plan = o.get_memory_plan();
+    std::cout << "Memory plan: " << plan.concurrency << " concurrent group instances"
+              << (plan.over_budget ? " (over budget)" : "") << std::endl;
+    for (size_t g = 0; g < plan.modes.size(); ++g) {
+        std::cout << "  group " << g << ": " << instance_mode_name(plan.modes[g]) << ", "
+                  << plan.bytes[g] / (1 << 20) << " MiB" << std::endl;
+    }
+    for (const auto& ph : o.get_memory_stats()) {
+        std::cout << "iter " << ph.iteration << " " << ph.phase << ": peak RSS " << ph.peak_rss / (1 << 20) << " MiB"
+                  << (ph.exact ? "" : " (since start)") << std::endl;
+    }
+    for (const auto& ev : o.get_schedule_events()) {
+        std::cout << "iter " << ev.iteration << " group " << ev.group << ": "
+                  << schedule_name(ev.from) << " -> " << schedule_name(ev.to)
+                  << " (churn " << ev.churn << ", gain " << ev.gain << ", " << ev.seconds << "s)" << std::endl;
+    }
+    print_perf_report();
+    disable_perf_counters();
+
+    Optimiser online_o(dataset, attr);
+    online_o.set_assignment(3);
+    SoftMStepPolicy soft;
+    soft.enabled = true;
+    online_o.set_soft_mstep(soft);
+    online_o.set_budget(std::make_shared<Budget>(600));
+    OnlinePolicy online;
+    online.batch_size = 5;
+    online.validation_interval = 5;
+    online.max_steps = 50;
+    RunResult online_run = online_o.run_online(online);
+    std::cout << "Mini-batch EM: " << (online_run.converged ? "converged" : "stopped") << " after "
+              << online_o.get_online_stats().size() << " steps, " << online_run.iterations
+              << " validation passes, lnl = " << online_run.likelihood << std::endl;
+    for (const auto& st : online_o.get_online_stats()) {
+        std::cout << "step " << st.step << " (eta " << st.step_size << "): " << st.reassigned << "/" << st.batch
+                  << " loci reassigned, " << st.seconds << "s" << (st.validation ? ", validated" : "") << std::endl;
+    }
+
+    BootstrapPolicy resampling;
+    resampling.replicates = 100;
+    resampling.threads = std::thread::hardware_concurrency();
+    Bootstrap bootstrap(dataset, attr, resampling);
+    bootstrap.set_budget(std::make_shared<Budget>(600));
+    CoAssignment coassignment = bootstrap.run(o.get_state());
+    std::vector<double> support = coassignment.support(o.get_assignment());
+    std::cout << "Bootstrap support (" << coassignment.nreplicates() << " replicates): ";
+    utils::print_container(support.begin(), support.end());
+
+    SelectionPolicy kscan;
+    kscan.max_groups = 5;
+    kscan.threads = std::thread::hardware_concurrency();
+    ModelSelector selector(dataset, attr, kscan);
+    selector.set_budget(std::make_shared<Budget>(600));
+    for (const auto& r : selector.run()) {
+        std::cout << "K=" << r.groups << ": lnl " << r.likelihood << ", " << r.parameters << " parameters, BIC "
+                  << r.bic << ", AIC " << r.aic << std::endl;
+    }
 
 
     std::uniform_real_distribution<double> dist(0, 1);
@@ -0,0 +1,111 @@
+//
+// Deterministic reductions.
+//
+
+#ifndef TREECL_EM_REDUCE_H
+#define TREECL_EM_REDUCE_H
+
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <iterator>
+#include <vector>
+#include "threadpool.h"
+
+namespace reduce {
+    // Ranges at or below this size are summed with a plain loop at the leaves of the pairwise tree
+    const size_t PAIRWISE_BLOCK = 32;
+
+    // Ranges at or below this size are summed by a single pool task
+    const size_t PARALLEL_GRAIN = 4096;
+
+    /*
+     * Pairwise (cascade) summation. The range is always split at its midpoint, so the shape of the
+     * summation tree - and therefore the rounding - depends only on the length of the range.
+     */
+    template<typename Iter>
+    double pairwise_sum(Iter first, size_t n) {
+        if (n <= PAIRWISE_BLOCK) {
+            double s = 0.0;
+            for (size_t i = 0; i < n; ++i, ++first) s += *first;
+            return s;
+        }
+        size_t half = n / 2;
+        Iter mid = std::next(first, half);
+        return pairwise_sum(first, half) + pairwise_sum(mid, n - half);
+    }
+
+    template<typename Iter>
+    double pairwise_sum(Iter first, Iter last) {
+        return pairwise_sum(first, static_cast<size_t>(std::distance(first, last)));
+    }
+
+    template<typename Container>
+    double pairwise_sum(const Container& c) {
+        return pairwise_sum(std::begin(c), c.size());
+    }
+
+    namespace detail {
+        // Leaves are the subtrees of the pairwise tree of n terms at or below the grain, left to right
+        template<typename Iter>
+        void submit_leaves(Iter first, size_t n, size_t grain, work_stealing_thread_pool& pool,
+                           std::vector<std::future<double>>& leaves) {
+            if (n <= grain) {
+                leaves.push_back(pool.submit([first, n]() { return pairwise_sum(first, n); }));
+                return;
+            }
+            size_t half = n / 2;
+            submit_leaves(first, half, grain, pool, leaves);
+            submit_leaves(std::next(first, half), n - half, grain, pool, leaves);
+        }
+
+        // Walks the same tree as submit_leaves, consuming leaf results in order. Runs other pool tasks while a leaf
+        // isn't ready, so the caller may itself be a task on the pool.
+        inline double combine_leaves(size_t n, size_t grain, work_stealing_thread_pool& pool,
+                                     std::vector<std::future<double>>& leaves, size_t& next) {
+            if (n <= grain) {
+                std::future<double>& leaf = leaves[next++];
+                while (leaf.wait_for(std::chrono::seconds(0)) != std::future_status::ready) pool.run_pending_task();
+                return leaf.get();
+            }
+            size_t half = n / 2;
+            double left = combine_leaves(half, grain, pool, leaves, next);
+            double right = combine_leaves(n - half, grain, pool, leaves, next);
+            return left + right;
+        }
+    }
+
+    /*
+     * Parallel pairwise summation. The range is cut into the subtrees of the pairwise tree that fit in the grain,
+     * each summed as a pool task, and the task results are added back up along the same tree. Both the blocks and
+     * the tree depend only on the length of the range, so the result is bitwise identical to pairwise_sum whatever
+     * the number of threads or the order the tasks finish in. The grain must be at least PAIRWISE_BLOCK.
+     */
+    template<typename Iter>
+    double parallel_sum(Iter first, Iter last, work_stealing_thread_pool& pool, size_t grain = PARALLEL_GRAIN) {
+        size_t n = static_cast<size_t>(std::distance(first, last));
+        grain = std::max(grain, PAIRWISE_BLOCK);
+        if (n <= grain) return pairwise_sum(first, n);
+        std::vector<std::future<double>> leaves;
+        detail::submit_leaves(first, n, grain, pool, leaves);
+        size_t next = 0;
+        return detail::combine_leaves(n, grain, pool, leaves, next);
+    }
+
+    // Single pass count of the labels in [0, nbins) into counts[0, nbins). Out of range labels are ignored.
+    template<typename Out>
+    void histogram(const std::vector<int>& labels, unsigned nbins, Out counts) {
+        std::fill(counts, counts + nbins, 0u);
+        for (int label : labels) {
+            if (label >= 0 && static_cast<unsigned>(label) < nbins) ++counts[label];
+        }
+    }
+
+    inline std::vector<unsigned> histogram(const std::vector<int>& labels, unsigned nbins) {
+        std::vector<unsigned> counts(nbins, 0);
+        histogram(labels, nbins, counts.begin());
+        return counts;
+    }
+}
+
+#endif //TREECL_EM_REDUCE_H
@@ -5,6 +5,8 @@
 #ifndef THREADPOOL_THREADPOOL_H
 #define THREADPOOL_THREADPOOL_H
 
+#include <atomic>
+#include <cstdint>
 #include <deque>
 #include <functional>
 #include <future>
@@ -388,6 +390,18 @@ public:
     }
 };
 
+/*
+ * Activity of the pools reporting to it, for live monitoring. Only lock-free atomics, so it can sit in memory shared
+ * with another process. Idle workers are workers - active.
+ */
+struct pool_counters
+{
+    std::atomic<int64_t> workers{0};
+    std::atomic<int64_t> active{0};     // Running a task (a thread waiting on the pool may help, so can exceed workers)
+    std::atomic<int64_t> tasks{0};      // Completed
+    std::atomic<int64_t> steals{0};     // Tasks taken from another worker's queue
+};
+
 /*
  * Work stealing thread pool
  */
@@ -395,6 +409,7 @@ class work_stealing_thread_pool
 {
     typedef function_wrapper task_type;
     std::atomic_bool done;
+    std::atomic<pool_counters*> counters{nullptr};
     threadsafe_queue<task_type> pool_work_queue;
     std::vector<std::unique_ptr<work_stealing_queue> > queues;
     std::vector<std::thread> threads;
@@ -477,6 +492,15 @@ public:
     ~work_stealing_thread_pool()
     {
         done=true;
+        set_counters(nullptr);
+    }
+
+    // The counters must outlive the pool, or be replaced before they go
+    void set_counters(pool_counters* counters_)
+    {
+        pool_counters* old=counters.exchange(counters_);
+        if(old) old->workers-=threads.size();
+        if(counters_) counters_->workers+=threads.size();
     }
 
     template<typename FunctionType>
@@ -499,11 +523,23 @@ public:
     void run_pending_task()
     {
         task_type task;
+        bool stolen=false;
         if(pop_task_from_local_queue(task) ||
            pop_task_from_pool_queue(task)  ||
-           pop_task_from_other_thread_queue(task))
+           (stolen=pop_task_from_other_thread_queue(task)))
         {
+            pool_counters* c=counters.load(std::memory_order_relaxed);
+            if(c)
+            {
+                c->active.fetch_add(1, std::memory_order_relaxed);
+                if(stolen) c->steals.fetch_add(1, std::memory_order_relaxed);
+            }
             task();
+            if(c)
+            {
+                c->active.fetch_sub(1, std::memory_order_relaxed);
+                c->tasks.fetch_add(1, std::memory_order_relaxed);
+            }
         }
         else
         {
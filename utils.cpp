@@ -3,15 +3,29 @@
 //
 
 #include <algorithm>
+#include <cctype>
 #include <cmath>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <new>
+#include <numeric>
+#include <random>
 #include <stdexcept>
 #include <vector>
+#include "Arena.h"
 #include "utils.h"
+#include "reduce.h"
 
 namespace utils{
-    bool is_file(std::string filename) {
+    // PLL's alignment, partition and newick parsers share a lexer with global state, so only one thread may
+    // be parsing at a time
+    std::mutex& pll_parser_mutex() {
+        static std::mutex mut;
+        return mut;
+    }
+
+    bool is_file(const std::string& filename) {
         std::ifstream fl(filename.c_str());
         bool result = true;
         if (!fl) {
@@ -34,11 +48,12 @@ namespace utils{
         return result;
     }
 
-    alignmentUPtr parse_alignment_file(std::string path) {
+    alignmentUPtr parse_alignment_file(const std::string& path) {
         if (!is_file(path)) {
             std::cerr << "Couldn't find the alignment file " << path << std::endl;
             throw std::exception();
         }
+        std::lock_guard<std::mutex> lock(pll_parser_mutex());
         alignmentUPtr alignment;
         AlignmentDeleter del;
         alignment = alignmentUPtr(pllParseAlignmentFile(PLL_FORMAT_PHYLIP, path.c_str()), del);
@@ -53,27 +68,77 @@ namespace utils{
         return alignment;
     }
 
-    queueUPtr parse_partitions(std::string partitions) {
-        if (is_file(partitions)) {
-            return queueUPtr(pllPartitionParse(partitions.c_str()), QueueDeleter());
+    // Deep copy of a parsed alignment, for handing to PLL (which recodes the data it loads) without re-reading
+    // the file. The copy is allocated the way PLL's parser allocates, so AlignmentDeleter can release it.
+    alignmentUPtr copy_alignment(const pllAlignmentData* alignment) {
+        int count = alignment->sequenceCount;
+        int length = alignment->sequenceLength;
+        alignmentUPtr copy(pllInitAlignmentData(count, length), AlignmentDeleter());
+        if (!copy) throw std::bad_alloc();
+        copy->originalSeqLength = alignment->originalSeqLength;
+        for (int t = 1; t <= count; ++t) {
+            std::memcpy(copy->sequenceData[t], alignment->sequenceData[t], length);
+            copy->sequenceLabels[t] = strdup(alignment->sequenceLabels[t]);
+        }
+        std::memcpy(copy->siteWeights, alignment->siteWeights, length * sizeof(int));
+        return copy;
+    }
+
+    // Same as strip_branch_lengths(a) == strip_branch_lengths(b), without building the stripped strings
+    bool same_topology(const std::string& a, const std::string& b) {
+        auto skip_length = [](const std::string& s, size_t& pos) {
+            if (pos < s.size() && s[pos] == ':') {
+                ++pos;
+                while (pos < s.size() && (isdigit(s[pos]) || s[pos] == '.' || s[pos] == 'e' || s[pos] == 'E' ||
+                                          s[pos] == '-' || s[pos] == '+')) ++pos;
+                return true;
+            }
+            return false;
+        };
+        size_t i = 0, j = 0;
+        for (;;) {
+            while (skip_length(a, i)) {}
+            while (skip_length(b, j)) {}
+            if (i == a.size() || j == b.size()) return i == a.size() && j == b.size();
+            if (a[i++] != b[j++]) return false;
         }
-        else {
-            return queueUPtr(pllPartitionParseString(partitions.c_str()), QueueDeleter());
+    }
+
+    // Topology-only form of a newick string, for comparing trees written out by the same PLL instance layout
+    std::string strip_branch_lengths(const std::string& newick) {
+        std::string result;
+        result.reserve(newick.size());
+        bool in_length = false;
+        for (char c : newick) {
+            if (c == ':') {
+                in_length = true;
+                continue;
+            }
+            if (in_length && (isdigit(c) || c == '.' || c == 'e' || c == 'E' || c == '-' || c == '+')) continue;
+            in_length = false;
+            result.push_back(c);
         }
+        return result;
     }
 
     double logsumexp(const std::vector<double>& nums) {
-        double max_exp = nums[0], sum = 0.0;
+        return logsumexp(nums.data(), nums.size());
+    }
+
+    double logsumexp(const double* nums, size_t n) {
+        double max_exp = nums[0];
         size_t i;
 
-        for (i = 1 ; i < nums.size() ; i++)
+        for (i = 1 ; i < n ; i++)
             if (nums[i] > max_exp)
                 max_exp = nums[i];
 
-        for (i = 0; i < nums.size() ; i++)
-            sum += exp(nums[i] - max_exp);
+        ArenaScope scope(thread_arena());
+        ArenaVector<double> scaled(n, ArenaAllocator<double>(thread_arena()));
+        for (i = 0; i < n ; i++)
+            scaled[i] = exp(nums[i] - max_exp);
 
-        return log(sum) + max_exp;
+        return log(reduce::pairwise_sum(scaled)) + max_exp;
     }
 
     template<typename T>
@@ -91,7 +156,7 @@ namespace utils{
     template std::vector<int> csum(const std::vector<int> &row);
 
     std::vector<double> scale_by_sum(const std::vector<double> &nums) {
-        double sum = std::accumulate(nums.begin(), nums.end(), 0.0);
+        double sum = reduce::pairwise_sum(nums);
         std::cout << sum << std::endl;
         std::vector<double> output;
         for (auto elem : nums) {
@@ -5,16 +5,21 @@
 #ifndef TREECL_EM_UTILS_H
 #define TREECL_EM_UTILS_H
 
+#include <mutex>
 #include <sstream>
 #include <vector>
 #include "memory_management.h"
 
 namespace utils {
-    bool is_file(std::string filename);
+    std::mutex& pll_parser_mutex();
+    bool is_file(const std::string& filename);
     std::vector<std::string> readlines(const std::string& filename);
-    alignmentUPtr parse_alignment_file(std::string path);
-    queueUPtr parse_partitions(std::string partitions);
+    alignmentUPtr parse_alignment_file(const std::string& path);
+    alignmentUPtr copy_alignment(const pllAlignmentData* alignment);
+    std::string strip_branch_lengths(const std::string& newick);
+    bool same_topology(const std::string& a, const std::string& b);
     double logsumexp(const std::vector<double>& nums);
+    double logsumexp(const double* nums, size_t n);
     std::vector<double> scale_by_sum(const std::vector<double>& nums);
     size_t random_select(const std::vector<double>& probs);
 